@@ -0,0 +1,457 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <store.h>
+#include <thread.h>
+
+// Store benchmark: a configurable mix of adds and gets from a number
+// of threads, reporting throughput and latency percentiles, followed
+// by the time to recover (re-open) the store.
+//
+//	--path=./bench		where the store lives
+//	--keys=100000		preloaded (in bulk, if sequential) before the run
+//	--ops=100000		per thread
+//	--threads=1
+//	--size=100			value bytes
+//	--reads=50			percentage of ops that are gets
+//	--rnd				random keys (otherwise sequential)
+//	--tran=N			N writes per transaction (0 for plain adds)
+//	--sync				transactions are synced to disk
+//
+// Plain adds are only for a single writer, so with several threads
+// (or --sync) writes default to a transaction each.
+//	--async=N			write-behind buffer of N bytes
+//	--compress=N		compress values of N bytes or more
+//	--prealloc=N		preallocate the log N bytes at a time
+//	--direct			O_DIRECT writes
+//	--parallel			parallel recovery
+
+#define HIST_SUB 16
+#define HIST_BUCKETS (64*HIST_SUB)
+
+// Latencies (nanoseconds) to within 1/16th: linear below 16, then
+// 16 buckets for each power of two.
+
+typedef struct
+{
+	uint64_t cnt, miss, max, total;
+	uint64_t b[HIST_BUCKETS];
+}
+ hist;
+
+static int hist_bucket(uint64_t ns)
+{
+	if (ns < HIST_SUB)
+		return (int)ns;
+
+	int bit = 63 - __builtin_clzll(ns);
+	return (bit-3)*HIST_SUB + (int)((ns >> (bit-4)) & (HIST_SUB-1));
+}
+
+static uint64_t hist_value(int i)
+{
+	if (i < HIST_SUB)
+		return i;
+
+	return (uint64_t)(HIST_SUB + (i % HIST_SUB)) << (i/HIST_SUB - 1);
+}
+
+static void hist_add(hist *h, uint64_t ns)
+{
+	h->b[hist_bucket(ns)]++;
+	h->cnt++;
+	h->total += ns;
+
+	if (ns > h->max)
+		h->max = ns;
+}
+
+static void hist_merge(hist *h, const hist *h2)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		h->b[i] += h2->b[i];
+
+	h->cnt += h2->cnt;
+	h->miss += h2->miss;
+	h->total += h2->total;
+
+	if (h2->max > h->max)
+		h->max = h2->max;
+}
+
+static uint64_t hist_pct(const hist *h, double pct)
+{
+	uint64_t want = (uint64_t)(h->cnt * pct / 100.0), n = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+	{
+		n += h->b[i];
+
+		if (n > want)
+			return hist_value(i);
+	}
+
+	return h->max;
+}
+
+static const char *fmt_ns(char *buf, uint64_t ns)
+{
+	if (ns < 1000)
+		sprintf(buf, "%lluns", (unsigned long long)ns);
+	else if (ns < 1000000)
+		sprintf(buf, "%.1fus", ns/1e3);
+	else if (ns < 1000000000)
+		sprintf(buf, "%.1fms", ns/1e6);
+	else
+		sprintf(buf, "%.2fs", ns/1e9);
+
+	return buf;
+}
+
+static void hist_print(const char *name, const hist *h)
+{
+	char p50[32], p99[32], p999[32], max[32], avg[32];
+
+	if (!h->cnt)
+		return;
+
+	printf("  %-6s n=%llu", name, (unsigned long long)h->cnt);
+
+	if (h->miss)
+		printf(" miss=%llu", (unsigned long long)h->miss);
+
+	printf(" avg=%s p50=%s p99=%s p999=%s max=%s\n",
+		fmt_ns(avg, h->total/h->cnt), fmt_ns(p50, hist_pct(h, 50.0)),
+		fmt_ns(p99, hist_pct(h, 99.0)), fmt_ns(p999, hist_pct(h, 99.9)),
+		fmt_ns(max, h->max));
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t mix64(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+typedef struct
+{
+	store *st;
+	uint64_t nonce, next;
+	long keys, ops;
+	int size, reads, rnd, tran, sync;
+	int done;
+	event *ev;
+	char *val;
+}
+ bench;
+
+typedef struct
+{
+	bench *b;
+	int id;
+	hist rd, wr;
+}
+ worker;
+
+// Key 'i' of this run. Sequential keys follow on from any previous
+// run, so are appended in order.
+
+static uuid bench_key(const bench *b, uint64_t i)
+{
+	uuid u;
+	u.u1 = b->rnd ? mix64(i ^ b->nonce) : (b->nonce << 32) + i;
+	u.u2 = 1;
+	return u;
+}
+
+static void bench_value(char *buf, int size, uint64_t i)
+{
+	int j;
+
+	for (j = 0; j < size; j++)
+		buf[j] = 'a' + (char)((i + j/8) % 26);
+}
+
+static int bench_next(void *p1, uuid *u, const void **buf, size_t *len)
+{
+	bench *b = (bench*)p1;
+
+	if (b->next > (uint64_t)b->keys)
+		return 0;
+
+	uint64_t i = b->next++;
+	*u = bench_key(b, i);
+	bench_value(b->val, b->size, i);
+	*buf = b->val;
+	*len = b->size;
+	return 1;
+}
+
+static int bench_worker(void *p1)
+{
+	worker *w = (worker*)p1;
+	bench *b = w->b;
+	char *val = (char*)malloc(b->size);
+	uint64_t seed = mix64(w->id + 1);
+	hstore *h = NULL;
+	int pending = 0;
+	long i;
+
+	for (i = 0; i < b->ops; i++)
+	{
+		seed = mix64(seed);
+		int rd = (int)(seed % 100) < b->reads;
+		uint64_t t = now_ns();
+
+		if (rd)
+		{
+			uint64_t hi = b->next > 1 ? b->next-1 : 1;
+			uint64_t k = 1 + (mix64(seed) % hi);
+			uuid u = bench_key(b, k);
+			void *buf = malloc(b->size+1);
+			size_t len = b->size+1;
+
+			if (!store_get(b->st, &u, &buf, &len))
+				w->rd.miss++;
+
+			free(buf);
+			hist_add(&w->rd, now_ns()-t);
+			continue;
+		}
+
+		uint64_t k = atomic_addu64(&b->next, 1);
+		uuid u = bench_key(b, k);
+		bench_value(val, b->size, k);
+
+		if (!b->tran)
+			store_add(b->st, &u, val, b->size);
+		else
+		{
+			if (!h)
+				h = store_begin(b->st);
+
+			store_hadd(h, &u, val, b->size);
+
+			if (++pending == b->tran)
+			{
+				store_end(h, b->sync);
+				h = NULL;
+				pending = 0;
+			}
+		}
+
+		hist_add(&w->wr, now_ns()-t);
+	}
+
+	if (h)
+		store_end(h, b->sync);
+
+	free(val);
+	atomic_inc(&b->done);
+	event_signal(b->ev);
+	return 0;
+}
+
+int main(int ac, char *av[])
+{
+	char path[1024];
+	long keys = 100000, ops = 100000;
+	int threads = 1, size = 100, reads = 50, rnd = 0, tran = 0, sync = 0;
+	int async = 0, compress = 0, prealloc = 0, direct = 0, parallel = 0;
+	int i;
+
+	sprintf(path, "./bench");
+
+	for (i = 1; i < ac; i++)
+	{
+		if (!strncmp(av[i], "--path=", 7))
+			sscanf(av[i], "%*[^=]=%1023s", path);
+
+		if (!strncmp(av[i], "--keys=", 7))
+			sscanf(av[i], "%*[^=]=%ld", &keys);
+
+		if (!strncmp(av[i], "--ops=", 6))
+			sscanf(av[i], "%*[^=]=%ld", &ops);
+
+		if (!strncmp(av[i], "--threads=", 10))
+			sscanf(av[i], "%*[^=]=%d", &threads);
+
+		if (!strncmp(av[i], "--size=", 7))
+			sscanf(av[i], "%*[^=]=%d", &size);
+
+		if (!strncmp(av[i], "--reads=", 8))
+			sscanf(av[i], "%*[^=]=%d", &reads);
+
+		if (!strncmp(av[i], "--tran=", 7))
+			sscanf(av[i], "%*[^=]=%d", &tran);
+
+		if (!strncmp(av[i], "--async=", 8))
+			sscanf(av[i], "%*[^=]=%d", &async);
+
+		if (!strncmp(av[i], "--compress=", 11))
+			sscanf(av[i], "%*[^=]=%d", &compress);
+
+		if (!strncmp(av[i], "--prealloc=", 11))
+			sscanf(av[i], "%*[^=]=%d", &prealloc);
+
+		if (!strcmp(av[i], "--rnd"))
+			rnd = 1;
+
+		if (!strcmp(av[i], "--sync"))
+			sync = 1;
+
+		if (!strcmp(av[i], "--direct"))
+			direct = 1;
+
+		if (!strcmp(av[i], "--parallel"))
+			parallel = 1;
+	}
+
+	if (threads < 1)
+		threads = 1;
+
+	if (size < 1)
+		size = 1;
+
+	if ((sync || (threads > 1)) && !tran)
+		tran = 1;
+
+	printf("storebench: path=%s keys=%ld ops=%ld threads=%d size=%d reads=%d%% %s %s%s%s\n",
+		path, keys, ops, threads, size, reads, rnd?"random":"sequential",
+		tran?"transactions":"plain", sync?" sync":"", async?" async":"");
+
+	bench b = {0};
+	b.nonce = (uint64_t)time(NULL);
+	b.keys = keys;
+	b.ops = ops;
+	b.size = size;
+	b.reads = reads;
+	b.rnd = rnd;
+	b.tran = tran;
+	b.sync = sync;
+	b.next = 1;
+
+	uint64_t t = now_ns();
+	b.st = store_open(path, NULL, 0);
+
+	if (!b.st)
+	{
+		printf("storebench: open '%s' failed\n", path);
+		return 1;
+	}
+
+	printf("open: %lu keys in %.3fs\n", store_count(b.st), (now_ns()-t)/1e9);
+
+	if (compress)
+		store_set_compress(b.st, compress);
+
+	if (prealloc && !store_set_prealloc(b.st, prealloc))
+		printf("storebench: preallocation unsupported\n");
+
+	if (direct && !store_set_direct(b.st, 1))
+		printf("storebench: direct writes unsupported\n");
+
+	// Preload, in key order unless random...
+
+	if (keys > 0)
+	{
+		b.val = (char*)malloc(size);
+		t = now_ns();
+		unsigned long n = 0;
+
+		if (!rnd)
+			n = store_bulk_load(b.st, &bench_next, &b, NULL);
+		else
+		{
+			const void *buf;
+			size_t len;
+			uuid u;
+
+			while (bench_next(&b, &u, &buf, &len))
+				n += store_add(b.st, &u, buf, len);
+		}
+
+		double secs = (now_ns()-t)/1e9;
+		printf("load: %lu keys in %.3fs (%.0f/s, %.1f MB/s)\n", n, secs, n/secs, n*(double)size/secs/1e6);
+		free(b.val);
+	}
+
+	if (async)
+		store_set_buffer(b.st, async, 10);
+
+	// The run...
+
+	worker *w = (worker*)calloc(threads, sizeof(worker));
+	b.ev = event_create();
+	t = now_ns();
+
+	for (i = 0; i < threads; i++)
+	{
+		w[i].b = &b;
+		w[i].id = i;
+
+		if ((threads == 1) || !thread_run(&bench_worker, &w[i]))
+			bench_worker(&w[i]);
+	}
+
+	for (;;)
+	{
+		unsigned cnt = event_count(b.ev);
+
+		if (b.done == threads)
+			break;
+
+		event_wait(b.ev, cnt, -1);
+	}
+
+	store_flush(b.st);
+	double secs = (now_ns()-t)/1e9;
+	hist rd = {0}, wr = {0};
+
+	for (i = 0; i < threads; i++)
+	{
+		hist_merge(&rd, &w[i].rd);
+		hist_merge(&wr, &w[i].wr);
+	}
+
+	printf("run: %llu ops in %.3fs (%.0f/s)\n", (unsigned long long)(rd.cnt+wr.cnt), secs, (rd.cnt+wr.cnt)/secs);
+	hist_print("write", &wr);
+	hist_print("read", &rd);
+	unsigned long cnt = store_count(b.st);
+	store_close(b.st);
+	event_destroy(b.ev);
+	free(w);
+
+	// Recovery, from the checkpoint written on close, and then by
+	// replaying every log...
+
+	t = now_ns();
+	b.st = store_open(path, NULL, parallel?STORE_PARALLEL:0);
+	printf("recover: %lu keys in %.3fs (checkpoint)\n", store_count(b.st), (now_ns()-t)/1e9);
+	store_close(b.st);
+
+	char filename[1100];
+	sprintf(filename, "%s/index.ckp", path);
+	remove(filename);
+
+	t = now_ns();
+	b.st = store_open(path, NULL, parallel?STORE_PARALLEL:0);
+	printf("recover: %lu keys in %.3fs (replay)\n", store_count(b.st), (now_ns()-t)/1e9);
+	int ok = store_count(b.st) == cnt;
+	store_close(b.st);
+	return ok ? 0 : 1;
+}
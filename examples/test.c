@@ -11,8 +11,11 @@
 #include <base64.h>
 #include <tree.h>
 #include <store.h>
+#include <shard.h>
 #include <linda.h>
 #include <network.h>
+#include <replica.h>
+#include <thread.h>
 #include <scriptlet.h>
 #include <skipbuck_int.h>
 #include <uncle.h>
@@ -23,6 +26,11 @@
 #define sleep _sleep
 #else
 #include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 #endif
 
 static int g_debug = 0, g_quiet = 1;
@@ -244,9 +252,9 @@ static void do_linda_in()
 	linda_close(l);
 }
 
-static void do_store(long cnt, int vfy, int compact, int tran)
+static void do_store(long cnt, int vfy, int flags, int tran)
 {
-	store *st = store_open("./db", 0, compact);
+	store *st = store_open("./db", 0, flags);
 	time_t t = time(NULL);
 	printf("Store: %ld items\n", (long)store_count(st));
 
@@ -330,6 +338,2327 @@ static void do_store(long cnt, int vfy, int compact, int tran)
 	store_close(st);
 }
 
+static int do_shard(long cnt, int shards, int vfy, int flags, int tran)
+{
+	shard *sh = shard_open("./db", shards, flags);
+	if (!sh) return 1;
+	time_t t = time(NULL);
+	printf("Shard: %ld items\n", (long)shard_count(sh));
+
+	printf("Writing...\n");
+	hshard *h = tran ? shard_begin(sh) : NULL;
+	int bad = 0;
+	long i;
+
+	for (i = 1; i <= cnt; i++)
+	{
+		char tmpbuf[1024];
+		int len = sprintf(tmpbuf, "{'name':'test','i':%ld}\n", i);
+		uuid u = {i, t};
+
+		if (tran)
+		{
+			if (!shard_hadd(h, &u, tmpbuf, len))
+			{
+				printf("ADD failed: %ld\n", i);
+				bad++;
+			}
+		}
+		else
+		{
+			if (!shard_add(sh, &u, tmpbuf, len))
+			{
+				printf("ADD failed: %ld\n", i);
+				bad++;
+			}
+		}
+
+		if (tran && !(i%10))
+		{
+			if (!shard_end(h, 0))
+			{
+				printf("END failed: %ld\n", i);
+				bad++;
+			}
+
+			h = shard_begin(sh);
+		}
+	}
+
+	if (h && !shard_end(h, 0))
+	{
+		printf("END failed\n");
+		bad++;
+	}
+
+	printf("Shard: %ld items\n", (long)shard_count(sh));
+
+	if (vfy)
+	{
+		printf("Verifying...\n");
+
+		for (i = 1; i <= cnt; i++)
+		{
+			char tmpbuf[1024];
+			void *buf = &tmpbuf;
+			size_t len = sizeof(tmpbuf);
+			uuid u = {i, t};
+
+			if (!shard_get(sh, &u, &buf, &len))
+			{
+				printf("GET failed: %ld\n", i);
+				bad++;
+			}
+		}
+	}
+
+	shard_close(sh);
+	return bad;
+}
+
+// Store tests each start from an empty directory, keep what every
+// key should hold in 'vers' (0 for none, else a version number) and
+// check it all, returning the number of failures.
+
+static void store_clean(const char *path)
+{
+#ifndef _WIN32
+	DIR *dir = opendir(path);
+	struct dirent *e;
+
+	if (!dir)
+		return;
+
+	while ((e = readdir(dir)) != NULL)
+	{
+		char filename[1024];
+
+		if (e->d_name[0] == '.')
+			continue;
+
+		snprintf(filename, sizeof(filename), "%s/%s", path, e->d_name);
+		remove(filename);
+	}
+
+	closedir(dir);
+#endif
+}
+
+static int store_logs(const char *path)
+{
+	int cnt = 0;
+#ifndef _WIN32
+	DIR *dir = opendir(path);
+	struct dirent *e;
+
+	if (!dir)
+		return 0;
+
+	while ((e = readdir(dir)) != NULL)
+	{
+		const char *ext = strrchr(e->d_name, '.');
+		cnt += ext && !strcmp(ext, ".log");
+	}
+
+	closedir(dir);
+#endif
+	return cnt;
+}
+
+static long store_logbytes(const char *path, char *biggest)
+{
+	long nbytes = 0, most = 0;
+#ifndef _WIN32
+	DIR *dir = opendir(path);
+	struct dirent *e;
+
+	if (!dir)
+		return 0;
+
+	while ((e = readdir(dir)) != NULL)
+	{
+		const char *ext = strrchr(e->d_name, '.');
+		char filename[1024];
+		struct stat s;
+
+		if (!ext || strcmp(ext, ".log"))
+			continue;
+
+		snprintf(filename, sizeof(filename), "%s/%s", path, e->d_name);
+
+		if (stat(filename, &s))
+			continue;
+
+		nbytes += (long)s.st_size;
+
+		if (biggest && ((long)s.st_size > most))
+		{
+			most = (long)s.st_size;
+			strcpy(biggest, filename);
+		}
+	}
+
+	closedir(dir);
+#endif
+	return nbytes;
+}
+
+static int store_value(char *tmpbuf, long k, int ver)
+{
+	return sprintf(tmpbuf, "{'name':'test','i':%ld,'v':%d}", k, ver);
+}
+
+static int store_put(store *st, long k, int ver, int *vers)
+{
+	char tmpbuf[256];
+	int len = store_value(tmpbuf, k, ver);
+	uuid u = uuid_set(k, 1);
+
+	if (!store_add(st, &u, tmpbuf, len))
+	{
+		printf("ADD failed: %ld\n", k);
+		return 0;
+	}
+
+	vers[k] = ver;
+	return 1;
+}
+
+static int store_del(store *st, long k, int *vers)
+{
+	uuid u = uuid_set(k, 1);
+
+	if (!store_rem(st, &u) != !vers[k])
+	{
+		printf("REM failed: %ld\n", k);
+		return 0;
+	}
+
+	vers[k] = 0;
+	return 1;
+}
+
+static int store_verify(store *st, const char *what, long cnt, const int *vers)
+{
+	void *buf = NULL;
+	size_t len = 0;
+	unsigned long live = 0;
+	int bad = 0;
+	long k;
+
+	for (k = 1; k <= cnt; k++)
+	{
+		char tmpbuf[256];
+		int n = vers[k] ? store_value(tmpbuf, k, vers[k]) : 0;
+		uuid u = uuid_set(k, 1);
+		int nbytes = store_get(st, &u, &buf, &len);
+		live += vers[k] != 0;
+
+		if (vers[k] ? ((nbytes < n) || memcmp(buf, tmpbuf, n)) : (nbytes > 0))
+		{
+			if (bad++ < 10)
+				printf("%s: key %ld wrong (version %d, got %d bytes)\n", what, k, vers[k], nbytes);
+		}
+	}
+
+	if (store_count(st) != live)
+	{
+		printf("%s: count %lu, expected %lu\n", what, store_count(st), live);
+		bad++;
+	}
+
+	free(buf);
+	printf("%s: %s\n", what, bad ? "FAILED" : "ok");
+	return bad;
+}
+
+static char *file_load(const char *filename, long *len)
+{
+	FILE *fp = fopen(filename, "rb");
+	if (!fp) return NULL;
+	fseek(fp, 0, SEEK_END);
+	*len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	char *buf = (char*)malloc(*len ? *len : 1);
+
+	if (buf && (fread(buf, 1, *len, fp) != (size_t)*len))
+	{
+		free(buf);
+		buf = NULL;
+	}
+
+	fclose(fp);
+	return buf;
+}
+
+static int file_save(const char *filename, const char *buf, long len)
+{
+	FILE *fp = fopen(filename, "wb");
+	if (!fp) return 0;
+	int ok = fwrite(buf, 1, len, fp) == (size_t)len;
+	return (fclose(fp) == 0) && ok;
+}
+
+// Checkpoint, then add, overwrite and delete. Putting that checkpoint
+// back after closing is as if it had crashed just after, so the rest
+// must be replayed from the logs. A damaged one must be ignored in
+// favour of replaying everything.
+
+// Writers keeping transactions open back to back, each on keys of
+// its own, until told to stop.
+
+#define CKP_WRITERS 2
+
+typedef struct
+{
+	store *st;
+	int *vers;
+	long cnt;
+	int w, stop, bad;
+	event *ev;
+}
+ ckp_writer;
+
+static int checkpoint_writer(void *p1)
+{
+	ckp_writer *cw = (ckp_writer*)p1;
+	long k = cw->w + 1;
+
+	while (!cw->stop)
+	{
+		hstore *h = store_begin(cw->st);
+		long batch[10];
+		int i, ok = h != NULL;
+
+		for (i = 0; ok && (i < 10); i++)
+		{
+			char tmpbuf[256];
+			batch[i] = k;
+			int len = store_value(tmpbuf, k, cw->vers[k]+1);
+			uuid u = uuid_set(k, 1);
+			ok = store_hadd(h, &u, tmpbuf, len);
+			usleep(200);
+
+			if ((k += CKP_WRITERS) > cw->cnt)
+				k = cw->w + 1;
+		}
+
+		if (!ok || !store_end(h, 0))
+		{
+			cw->bad++;
+			break;
+		}
+
+		for (i = 0; i < 10; i++)
+			cw->vers[batch[i]]++;
+	}
+
+	event_signal(cw->ev);
+	return 0;
+}
+
+static int do_checkpoint(long cnt)
+{
+	const char *path = "./db-ckp", *ckp = "./db-ckp/index.ckp";
+	int *vers = (int*)calloc(cnt*2+1, sizeof(int));
+	int bad = 0;
+	long k, len = 0;
+
+	store_clean(path);
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+
+	for (k = 1; k <= cnt; k++)
+		bad += !store_put(st, k, 1, vers);
+
+	if (!store_checkpoint(st))
+	{
+		printf("Checkpoint failed\n");
+		bad++;
+	}
+
+	char *saved = file_load(ckp, &len);
+
+	if (!saved)
+	{
+		printf("Checkpoint missing\n");
+		store_close(st);
+		return bad + 1;
+	}
+
+	for (k = cnt+1; k <= cnt*2; k++)
+		bad += !store_put(st, k, 1, vers);
+
+	for (k = 1; k <= cnt; k += 3)
+		bad += !store_put(st, k, 2, vers);
+
+	for (k = 2; k <= cnt*2; k += 5)
+		bad += !store_del(st, k, vers);
+
+	bad += store_verify(st, "Before close", cnt*2, vers);
+	store_close(st);
+
+	file_save(ckp, saved, len);
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Checkpoint and replay", cnt*2, vers);
+	store_close(st);
+
+	saved[len/2] ^= 0x55;
+	file_save(ckp, saved, len);
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Corrupt checkpoint", cnt*2, vers);
+	store_close(st);
+
+	saved[len/2] ^= 0x55;
+	file_save(ckp, saved, len/2);
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Truncated checkpoint", cnt*2, vers);
+	free(saved);
+
+	// Under steady transactional load, a checkpoint must still be
+	// taken, and be good...
+
+	ckp_writer cw[CKP_WRITERS];
+	event *ev = event_create();
+	unsigned done;
+	int i;
+
+	for (i = 0; i < CKP_WRITERS; i++)
+	{
+		ckp_writer tmp = {st, vers, cnt, i, 0, 0, ev};
+		cw[i] = tmp;
+		thread_run(&checkpoint_writer, &cw[i]);
+	}
+
+	usleep(20*1000);
+
+	for (i = 0; i < 3; i++)
+	{
+		if (!store_checkpoint(st))
+		{
+			printf("Checkpoint under load failed\n");
+			bad++;
+		}
+
+		usleep(10*1000);
+	}
+
+	saved = file_load(ckp, &len);
+
+	for (i = 0; i < CKP_WRITERS; i++)
+		cw[i].stop = 1;
+
+	while ((done = event_count(ev)) < CKP_WRITERS)
+		event_wait(ev, done, -1);
+
+	for (i = 0; i < CKP_WRITERS; i++)
+		bad += cw[i].bad;
+
+	event_destroy(ev);
+	store_close(st);
+
+	if (saved)
+		file_save(ckp, saved, len);
+
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Checkpoint under load", cnt*2, vers);
+	store_close(st);
+
+	free(saved);
+	free(vers);
+	return bad;
+}
+
+// Batched lookup: all the keys in a scrambled order, with some
+// deleted and some never added, across many log files, plus a few
+// records too big for a single coalesced read.
+
+#define MGET_BIG 20000
+
+typedef struct
+{
+	long cnt;
+	const int *vers;
+	char *seen;
+	int bad;
+}
+ mget_check;
+
+static void mget_callback(void *p1, const uuid *u, const void *buf, int len)
+{
+	mget_check *mc = (mget_check*)p1;
+	long k = (long)u->u1;
+
+	if ((k < 1) || (k > (mc->cnt+10)) || mc->seen[k]++)
+	{
+		if (mc->bad++ < 10)
+			printf("Mget: key %ld unexpected\n", k);
+
+		return;
+	}
+
+	if (k > mc->cnt)
+	{
+		const char *src = (const char*)buf;
+		int i;
+
+		for (i = 0; (i < len) && (src[i] == (char)('a'+k%26)); i++)
+			;
+
+		if ((len != MGET_BIG) || (i != len))
+			mc->bad++;
+
+		return;
+	}
+
+	char tmpbuf[256];
+	int n = store_value(tmpbuf, k, mc->vers[k]);
+
+	if (!mc->vers[k] || (len < n) || memcmp(buf, tmpbuf, n))
+	{
+		if (mc->bad++ < 10)
+			printf("Mget: key %ld wrong\n", k);
+	}
+}
+
+// Several callers at once share the store's pool of readers.
+
+#define MGET_CALLERS 4
+
+typedef struct
+{
+	store *st;
+	const uuid *uuids;
+	int n, found;
+	mget_check mc;
+	event *ev;
+}
+ mget_caller;
+
+static int mget_caller_run(void *p1)
+{
+	mget_caller *c = (mget_caller*)p1;
+	c->found = store_mget(c->st, c->uuids, c->n, &mget_callback, &c->mc);
+	event_signal(c->ev);
+	return 0;
+}
+
+static int do_mget(long cnt)
+{
+	const char *path = "./db-mget";
+	int *vers = (int*)calloc(cnt+1, sizeof(int));
+	uuid *uuids = (uuid*)malloc((cnt+cnt/10+10)*sizeof(uuid));
+	char *big = (char*)malloc(MGET_BIG);
+	int bad = 0, n = 0, found = 0, expected = 10;
+	long k;
+
+	store_clean(path);
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+	store_set_logsize(st, 256*1024);
+
+	for (k = 1; k <= cnt; k++)
+		bad += !store_put(st, k, 1, vers);
+
+	for (k = cnt+1; k <= cnt+10; k++)
+	{
+		uuid u = uuid_set(k, 1);
+		memset(big, 'a'+k%26, MGET_BIG);
+		bad += !store_add(st, &u, big, MGET_BIG);
+	}
+
+	for (k = 1; k <= cnt; k += 3)
+		bad += !store_put(st, k, 2, vers);
+
+	for (k = 2; k <= cnt; k += 5)
+		bad += !store_del(st, k, vers);
+
+	for (k = 1; k <= cnt; k++)
+	{
+		long j = ((k*7919) % cnt) + 1;
+		uuids[n++] = uuid_set(j, 1);
+		expected += vers[j] != 0;
+
+		if (!(k % 10))
+			uuids[n++] = uuid_set(cnt*2+k, 1);
+	}
+
+	for (k = cnt+1; k <= cnt+10; k++)
+		uuids[n++] = uuid_set(k, 1);
+
+	mget_check mc = {cnt, vers, (char*)calloc(cnt+11, 1), 0};
+	found = store_mget(st, uuids, n, &mget_callback, &mc);
+
+	if ((found != expected) || mc.bad)
+	{
+		printf("Mget: found %d of %d, %d bad\n", found, expected, mc.bad);
+		bad++;
+	}
+
+	printf("Mget: %s\n", bad ? "FAILED" : "ok");
+
+	// And just the one...
+
+	memset(mc.seen, 0, cnt+11);
+	uuid one = uuid_set(1, 1);
+
+	if ((store_mget(st, &one, 1, &mget_callback, &mc) != 1) || mc.bad)
+	{
+		printf("Mget: single key failed\n");
+		bad++;
+	}
+
+	// And several at once...
+
+	mget_caller callers[MGET_CALLERS];
+	event *ev = event_create();
+	int i, round;
+
+	for (round = 0; round < 10; round++)
+	{
+		unsigned done;
+
+		for (i = 0; i < MGET_CALLERS; i++)
+		{
+			mget_caller tmp = {st, uuids, n, 0, {cnt, vers, (char*)calloc(cnt+11, 1), 0}, ev};
+			callers[i] = tmp;
+		}
+
+		unsigned start = event_count(ev);
+
+		for (i = 0; i < MGET_CALLERS; i++)
+		{
+			if (!thread_run(&mget_caller_run, &callers[i]))
+				mget_caller_run(&callers[i]);
+		}
+
+		while ((done = event_count(ev)) < (start+MGET_CALLERS))
+			event_wait(ev, done, -1);
+
+		for (i = 0; i < MGET_CALLERS; i++)
+		{
+			if ((callers[i].found != expected) || callers[i].mc.bad)
+			{
+				printf("Mget: caller %d found %d of %d, %d bad\n", i, callers[i].found, expected, callers[i].mc.bad);
+				bad++;
+			}
+
+			free(callers[i].mc.seen);
+		}
+	}
+
+	printf("Mget concurrent: %s\n", bad ? "FAILED" : "ok");
+	event_destroy(ev);
+	store_close(st);
+	free(mc.seen);
+	free(big);
+	free(uuids);
+	free(vers);
+	return bad;
+}
+
+// Write-behind: records read back while still buffered, a buffer's
+// worth at a time written, one too big for it written directly, and
+// a timed flush.
+
+static int do_write_behind(long cnt)
+{
+	const char *path = "./db-wb";
+	int *vers = (int*)calloc(cnt+1, sizeof(int));
+	char *big = (char*)malloc(20000);
+	void *buf = NULL;
+	size_t len = 0;
+	int bad = 0;
+	long k;
+
+	store_clean(path);
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+	store_set_buffer(st, 8*1024, 0);
+	uuid u = uuid_set(cnt+1, 1);
+
+	for (k = 1; k <= cnt; k++)
+	{
+		bad += !store_put(st, k, 1, vers);
+
+		if (k == cnt/2)
+		{
+			memset(big, 'x', 20000);
+			bad += !store_add(st, &u, big, 20000);
+		}
+	}
+
+	for (k = 1; k <= cnt; k += 3)
+		bad += !store_put(st, k, 2, vers);
+
+	for (k = 2; k <= cnt; k += 5)
+		bad += !store_del(st, k, vers);
+
+	if ((store_get(st, &u, &buf, &len) < 20000) || memcmp(buf, big, 20000))
+	{
+		printf("Write-behind: big record wrong\n");
+		bad++;
+	}
+
+	store_rem(st, &u);
+	bad += store_verify(st, "Buffered", cnt, vers);
+
+	if (!store_flush(st))
+	{
+		printf("Flush failed\n");
+		bad++;
+	}
+
+	bad += store_verify(st, "Flushed", cnt, vers);
+	store_close(st);
+	remove("./db-wb/index.ckp");
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Reopened", cnt, vers);
+
+	// Written out on a timer, without a flush...
+
+	store_set_buffer(st, 64*1024, 20);
+	long before = store_logbytes(path, NULL);
+
+	for (k = 1; k <= 10; k++)
+		bad += !store_put(st, k, 3, vers);
+
+	sleep(1);
+
+	if (store_logbytes(path, NULL) <= before)
+	{
+		printf("Write-behind: not written after a second\n");
+		bad++;
+	}
+
+	store_set_buffer(st, 0, 0);
+	bad += store_verify(st, "Timed", cnt, vers);
+	store_close(st);
+	free(buf);
+	free(big);
+	free(vers);
+	return bad;
+}
+
+// Tail cursors: everything logged, in order, across log files and
+// including removals and committed (but not cancelled) transactions.
+// Then resuming from a kept position, waiting for more, and stopping.
+
+typedef struct
+{
+	long *keys;
+	long n, max, stop;
+	int bad;
+}
+ tail_check;
+
+static int tail_callback(void *p1, const uuid *u, const void *buf, int len)
+{
+	tail_check *tc = (tail_check*)p1;
+	long k = (long)u->u1;
+
+	if ((tc->n >= tc->max) || (tc->keys[tc->n++] != k))
+	{
+		if (tc->bad++ < 10)
+			printf("Tail: record %ld is key %ld\n", tc->n-1, k);
+	}
+
+	return !tc->stop || (tc->n < tc->stop);
+}
+
+static int tail_writer(void *p1)
+{
+	store *st = (store*)p1;
+	uuid u = uuid_set(1, 1);
+	sleep(1);
+	store_add(st, &u, "late", 4);
+	return 1;
+}
+
+static int do_tail(long cnt)
+{
+	const char *path = "./db-tail";
+	int *vers = (int*)calloc(cnt+1, sizeof(int));
+	long *keys = (long*)malloc((cnt*3+10)*sizeof(long));
+	long k, n = 0;
+	int bad = 0;
+
+	store_clean(path);
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+	store_set_logsize(st, 64*1024);
+
+	for (k = 1; k <= cnt; k++)
+	{
+		bad += !store_put(st, k, 1, vers);
+		keys[n++] = k;
+	}
+
+	for (k = 2; k <= cnt; k += 5)
+	{
+		bad += !store_del(st, k, vers);
+		keys[n++] = k;
+	}
+
+	hstore *h = store_begin(st);
+
+	for (k = 1; k <= 3; k++)
+	{
+		char tmpbuf[256];
+		int len = store_value(tmpbuf, k, 2);
+		uuid u = uuid_set(k, 1);
+		store_hadd(h, &u, tmpbuf, len);
+		keys[n++] = k;
+	}
+
+	store_end(h, 0);
+	h = store_begin(st);
+
+	for (k = 4; k <= 6; k++)
+	{
+		char tmpbuf[256];
+		int len = store_value(tmpbuf, k, 2);
+		uuid u = uuid_set(k, 1);
+		store_hadd(h, &u, tmpbuf, len);
+	}
+
+	store_cancel(h);
+
+	uuid z = {0};
+	store_cursor *c = store_tail_open(st, &z);
+	tail_check tc = {keys, 0, n, 0, 0};
+
+	while (store_tail_next(c, 0, &tail_callback, &tc) > 0)
+		;
+
+	if ((tc.n != n) || tc.bad)
+	{
+		printf("Tail: %ld of %ld records, %d bad\n", tc.n, n, tc.bad);
+		bad++;
+	}
+
+	if (store_tail_next(c, 100, &tail_callback, &tc) != 0)
+	{
+		printf("Tail: records from nowhere\n");
+		bad++;
+	}
+
+	// Resume from where it got to...
+
+	uint64_t pos = store_tail_pos(c);
+	store_tail_close(c);
+
+	for (k = 10; k <= 20; k++)
+	{
+		bad += !store_put(st, k, 3, vers);
+		keys[n++] = k;
+	}
+
+	c = store_tail_open2(st, pos);
+	tc.max = n;
+
+	while (c && (store_tail_next(c, 0, &tail_callback, &tc) > 0))
+		;
+
+	if ((tc.n != n) || tc.bad)
+	{
+		printf("Tail: resumed to %ld of %ld records, %d bad\n", tc.n, n, tc.bad);
+		bad++;
+	}
+
+	// Waiting for a record yet to be added...
+
+	keys[n++] = 1;
+	tc.max = n;
+	time_t t = time(NULL);
+	thread_run(&tail_writer, st);
+
+	if ((store_tail_next(c, 10000, &tail_callback, &tc) != 1) || (tc.n != n) || ((time(NULL)-t) > 5))
+	{
+		printf("Tail: wait failed\n");
+		bad++;
+	}
+
+	store_tail_close(c);
+
+	// Stopped by the callback...
+
+	c = store_tail_open(st, &z);
+	tc.n = 0;
+	tc.stop = 10;
+
+	if ((store_tail_next(c, 0, &tail_callback, &tc) != -1) || (tc.n != 10))
+	{
+		printf("Tail: not stopped\n");
+		bad++;
+	}
+
+	store_tail_close(c);
+	printf("Tail: %s\n", bad ? "FAILED" : "ok");
+	store_close(st);
+	free(keys);
+	free(vers);
+	return bad;
+}
+
+// Range scans: exactly the live keys in range, in order and with
+// their latest contents, whether all at once or in batches, and
+// stopping when told to.
+
+typedef struct
+{
+	const int *vers;
+	long last, n, stop;
+	int bad;
+}
+ scan_check;
+
+static int scan_callback(void *p1, const uuid *u, const void *buf, int len)
+{
+	scan_check *sc = (scan_check*)p1;
+	long k = (long)u->u1;
+	char tmpbuf[256];
+	int n = store_value(tmpbuf, k, sc->vers[k]);
+
+	// Any live key skipped is caught by the count...
+
+	if ((k <= sc->last) || !sc->vers[k] || (len < n) || memcmp(buf, tmpbuf, n))
+	{
+		if (sc->bad++ < 10)
+			printf("Scan: key %ld wrong\n", k);
+	}
+
+	sc->last = k;
+	sc->n++;
+	return !sc->stop || (sc->n < sc->stop);
+}
+
+static long scan_expected(const int *vers, long cnt, long from, long to)
+{
+	long k, n = 0;
+
+	for (k = from ? from : 1; (k <= cnt) && (!to || (k < to)); k++)
+		n += vers[k] != 0;
+
+	return n;
+}
+
+static int do_scan(long cnt)
+{
+	const char *path = "./db-scan";
+	int *vers = (int*)calloc(cnt+1, sizeof(int));
+	long ranges[][2] = {{0,0}, {100,2000}, {cnt/2,cnt/2+10}, {cnt,0}, {cnt+1,0}, {5,5}};
+	int bad = 0, i;
+	long k;
+
+	store_clean(path);
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+	store_set_logsize(st, 64*1024);
+
+	for (k = cnt; k > 0; k--)
+		bad += !store_put(st, k, 1, vers);
+
+	for (k = 1; k <= cnt; k += 3)
+		bad += !store_put(st, k, 2, vers);
+
+	for (k = 2; k <= cnt; k += 5)
+		bad += !store_del(st, k, vers);
+
+	for (i = 0; i < (int)(sizeof(ranges)/sizeof(ranges[0])); i++)
+	{
+		long from = ranges[i][0], to = ranges[i][1];
+		long expected = scan_expected(vers, cnt, from, to);
+		scan_check sc = {vers, 0, 0, 0, 0};
+		int n = store_scan(st, from, to, &scan_callback, &sc);
+
+		if ((n != expected) || (sc.n != expected) || sc.bad)
+		{
+			printf("Scan [%ld,%ld): %d (%ld) of %ld, %d bad\n", from, to, n, sc.n, expected, sc.bad);
+			bad++;
+		}
+	}
+
+	// In batches...
+
+	store_range *r = store_scan_open(st, 0, 0);
+	scan_check sc = {vers, 0, 0, 0, 0};
+	int n, batches = 0;
+
+	while ((n = store_scan_next(r, 100, &scan_callback, &sc)) > 0)
+	{
+		if (n > 100)
+			bad++;
+
+		batches++;
+	}
+
+	store_scan_close(r);
+
+	if ((n != 0) || (sc.n != scan_expected(vers, cnt, 0, 0)) || sc.bad || (batches < 2))
+	{
+		printf("Scan: cursor got %ld in %d batches, %d bad\n", sc.n, batches, sc.bad);
+		bad++;
+	}
+
+	// Stopped by the callback...
+
+	r = store_scan_open(st, 0, 0);
+	scan_check sc2 = {vers, 0, 0, 10, 0};
+
+	if ((store_scan_next(r, 0, &scan_callback, &sc2) != -1) || (sc2.n != 10))
+	{
+		printf("Scan: not stopped\n");
+		bad++;
+	}
+
+	store_scan_close(r);
+	printf("Scan: %s\n", bad ? "FAILED" : "ok");
+	store_close(st);
+	free(vers);
+	return bad;
+}
+
+// A torn write at the end of the active log: the last record
+// damaged and garbage after it, as a crash mid-write might leave.
+// It is lost, and the rest truncated, but all before it kept.
+
+static int do_torn(long cnt)
+{
+	const char *path = "./db-torn";
+	int *vers = (int*)calloc(cnt+1, sizeof(int));
+	char filename[1024] = {0};
+	int bad = 0;
+	long k;
+
+	store_clean(path);
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+
+	for (k = 1; k <= cnt; k++)
+		bad += !store_put(st, k, 1, vers);
+
+	store_close(st);
+	remove("./db-torn/index.ckp");
+	long before = store_logbytes(path, filename);
+	FILE *fp = fopen(filename, "r+b");
+
+	if (!fp)
+	{
+		printf("Torn: no log file\n");
+		return bad + 1;
+	}
+
+	fseek(fp, -5, SEEK_END);
+	fputc('Z', fp);
+	fseek(fp, 0, SEEK_END);
+
+	for (k = 0; k < 37; k++)
+		fputc(rand(), fp);
+
+	fclose(fp);
+	vers[cnt] = 0;
+
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Torn", cnt, vers);
+
+	if (store_logbytes(path, NULL) >= before)
+	{
+		printf("Torn: not truncated\n");
+		bad++;
+	}
+
+	for (k = 1; k <= 10; k++)
+		bad += !store_put(st, k, 2, vers);
+
+	bad += !store_put(st, cnt, 2, vers);
+	store_close(st);
+
+	remove("./db-torn/index.ckp");
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Reopened", cnt, vers);
+	store_close(st);
+	free(vers);
+	return bad;
+}
+
+// Cross-shard atomicity: a child process commits transactions that
+// each write the same version to keys on every shard, and is killed
+// part way through. Reopening completes any intent left behind, so
+// every key must then hold the last version the child reported as
+// committed, or the one after (never a mix).
+
+#define SC_KEYS 16
+#define SC_ROUNDS 8
+
+static void shard_clean(const char *path, int shards)
+{
+	char filename[1024];
+	int i;
+
+	for (i = 0; i < shards; i++)
+	{
+		snprintf(filename, sizeof(filename), "%s/%d", path, i);
+		store_clean(filename);
+	}
+
+	snprintf(filename, sizeof(filename), "%s/intent", path);
+	store_clean(filename);
+	snprintf(filename, sizeof(filename), "%s/shards", path);
+	remove(filename);
+}
+
+#ifndef _WIN32
+static void shard_crash_writer(const char *path, int shards, int ver, int fd)
+{
+	shard *sh = shard_open(path, shards, 0);
+
+	if (!sh)
+		_exit(1);
+
+	for (;;)
+	{
+		hshard *h = shard_begin(sh);
+		long k;
+		ver++;
+
+		for (k = 1; k <= SC_KEYS; k++)
+		{
+			char tmpbuf[256];
+			int len = store_value(tmpbuf, k, ver);
+			uuid u = uuid_set(k, 1);
+			shard_hadd(h, &u, tmpbuf, len);
+		}
+
+		if (!shard_end(h, 1) || (write(fd, &ver, sizeof(ver)) != sizeof(ver)))
+			_exit(1);
+	}
+}
+
+// The version all the keys hold, or -1 if they differ.
+
+static int shard_crash_version(shard *sh)
+{
+	void *buf = NULL;
+	size_t len = 0;
+	int ver = -1;
+	long k;
+
+	for (k = 1; k <= SC_KEYS; k++)
+	{
+		uuid u = uuid_set(k, 1);
+		long i = 0;
+		int v = 0;
+
+		if ((shard_get(sh, &u, &buf, &len) > 0) && ((sscanf((char*)buf, "{'name':'test','i':%ld,'v':%d}", &i, &v) != 2) || (i != k)))
+			v = -1;
+
+		if ((k > 1) && (v != ver))
+			ver = -1;
+		else
+			ver = v;
+
+		if (ver < 0)
+			break;
+	}
+
+	free(buf);
+	return ver;
+}
+#endif
+
+static int do_shard_crash(int shards)
+{
+	const char *path = "./db-shard";
+	int bad = 0;
+
+#ifndef _WIN32
+	int ver = 0, round, replayed = 0;
+	long k;
+
+	shard_clean(path, shards);
+	shard *sh = shard_open(path, shards, 0);
+	if (!sh) return 1;
+	char touched[SHARD_MAX] = {0};
+	int spread = 0;
+
+	for (k = 1; k <= SC_KEYS; k++)
+	{
+		uuid u = uuid_set(k, 1);
+		int i = shard_of(sh, &u);
+		spread += !touched[i];
+		touched[i] = 1;
+	}
+
+	shard_close(sh);
+
+	if (spread < 2)
+	{
+		printf("Shard crash: keys on only %d shard\n", spread);
+		return 1;
+	}
+
+	for (round = 0; round < SC_ROUNDS; round++)
+	{
+		int fds[2], done = ver, tmp;
+
+		if (pipe(fds))
+			return bad + 1;
+
+		pid_t pid = fork();
+
+		if (pid < 0)
+			return bad + 1;
+
+		if (!pid)
+		{
+			close(fds[0]);
+			shard_crash_writer(path, shards, ver, fds[1]);
+		}
+
+		close(fds[1]);
+		usleep(20000 + (rand() % 50000));
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+
+		while (read(fds[0], &tmp, sizeof(tmp)) == sizeof(tmp))
+			done = tmp;
+
+		close(fds[0]);
+
+		if (!(sh = shard_open(path, shards, 0)))
+		{
+			printf("Shard crash: reopen failed\n");
+			return bad + 1;
+		}
+
+		int v = shard_crash_version(sh);
+		shard_close(sh);
+
+		if ((v != done) && (v != (done+1)))
+		{
+			printf("Shard crash: round %d, version %d after %d committed\n", round, v, done);
+			bad++;
+		}
+
+		replayed += v == (done+1);
+		ver = v > done ? v : done;
+	}
+
+	printf("Shard crash: %d commits, %d found ahead of the last reported\n", ver, replayed);
+#endif
+
+	printf("Shard crash: %s\n", bad ? "FAILED" : "ok");
+	return bad;
+}
+
+// Recovery: the same logs (many of them, with overwrites, deletes and
+// committed and cancelled transactions) replayed serially and then in
+// parallel must give the same store, and present the open callback
+// with a history that ends in the same state.
+
+typedef struct
+{
+	int *vers;
+	long cnt;
+	int bad;
+}
+ recover_check;
+
+static void recover_callback(void *p1, const uuid *u, const void *buf, int len)
+{
+	recover_check *rc = (recover_check*)p1;
+	long k = (long)u->u1, i = 0;
+	int v = 0;
+
+	if ((k < 1) || (k > rc->cnt))
+	{
+		rc->bad++;
+		return;
+	}
+
+	if ((len > 0) && ((sscanf((const char*)buf, "{'name':'test','i':%ld,'v':%d}", &i, &v) != 2) || (i != k)))
+		rc->bad++;
+
+	rc->vers[k] = len > 0 ? v : 0;
+}
+
+static int do_recover(long cnt)
+{
+	const char *path = "./db-recover";
+	int *vers = (int*)calloc(cnt+1, sizeof(int));
+	int *seen = (int*)calloc(cnt+1, sizeof(int));
+	int bad = 0, round;
+	long k;
+
+	store_clean(path);
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+	store_set_logsize(st, 32*1024);
+
+	for (k = 1; k <= cnt; k++)
+		bad += !store_put(st, k, 1, vers);
+
+	for (k = 1; k <= cnt; k += 3)
+		bad += !store_put(st, k, 2, vers);
+
+	for (k = 2; k <= cnt; k += 5)
+		bad += !store_del(st, k, vers);
+
+	hstore *h = store_begin(st);
+
+	for (k = 1; k <= cnt; k += 7)
+	{
+		char tmpbuf[256];
+		int len = store_value(tmpbuf, k, 3);
+		uuid u = uuid_set(k, 1);
+		bad += !store_hadd(h, &u, tmpbuf, len);
+		vers[k] = 3;
+	}
+
+	bad += !store_end(h, 1);
+	h = store_begin(st);
+
+	for (k = 1; k <= cnt; k += 11)
+	{
+		uuid u = uuid_set(k, 1);
+		store_hrem(h, &u);
+	}
+
+	store_cancel(h);
+	store_close(st);
+
+	if (store_logs(path) < 4)
+	{
+		printf("Recover: only %d log files\n", store_logs(path));
+		bad++;
+	}
+
+	for (round = 0; round < 5; round++)
+	{
+		int flags = round ? STORE_PARALLEL : 0;
+		const char *what = round ? "Parallel" : "Serial";
+		recover_check rc = {seen, cnt, 0};
+
+		memset(seen, 0, (cnt+1)*sizeof(int));
+		remove("./db-recover/index.ckp");
+		st = store_open2(path, 0, flags, &recover_callback, &rc);
+		bad += store_verify(st, what, cnt, vers);
+
+		if (rc.bad || memcmp(seen, vers, (cnt+1)*sizeof(int)))
+		{
+			printf("%s: callback history wrong\n", what);
+			bad++;
+		}
+
+		store_close(st);
+	}
+
+	free(seen);
+	free(vers);
+	return bad;
+}
+
+// Bulk load: the callback hands out keys 'from' to 'to' in order,
+// at version 'ver', padded out to 'pad' bytes, then key 'from' again
+// if 'reorder' (out of order, where loading stops).
+
+#define BULK_PAD (64*1024)
+#define BULK_LIMIT (10*1024*1024)
+
+typedef struct
+{
+	long k, to;
+	int ver, reorder, pad;
+	char *buf;
+}
+ bulk_src;
+
+static int bulk_next(void *p1, uuid *u, const void **buf, size_t *len)
+{
+	bulk_src *b = (bulk_src*)p1;
+	long k = b->k++;
+
+	if (k > b->to)
+	{
+		if (!b->reorder)
+			return 0;
+
+		k = b->reorder;
+		b->reorder = 0;
+	}
+
+	int n = store_value(b->buf, k, b->ver);
+
+	if (n < b->pad)
+	{
+		memset(b->buf+n, ' ', b->pad-n);
+		n = b->pad;
+	}
+
+	*u = uuid_set(k, 1);
+	*buf = b->buf;
+	*len = n;
+	return 1;
+}
+
+static int bulk_check(store *st, bulk_src *b, long from, unsigned long want, int want_err, int *vers, const char *what)
+{
+	int err = -1;
+	unsigned long n = store_bulk_load(st, &bulk_next, b, &err);
+	long k;
+
+	if ((n != want) || (err != want_err))
+	{
+		printf("%s: loaded %lu (error %d), expected %lu (error %d)\n", what, n, err, want, want_err);
+		return 1;
+	}
+
+	for (k = from; k < from+(long)n; k++)
+		vers[k] = b->ver;
+
+	return 0;
+}
+
+static int do_bulk(long cnt)
+{
+	const char *path = "./db-bulk";
+	long total = cnt + BULK_LIMIT/BULK_PAD*2;
+	int *vers = (int*)calloc(total+1, sizeof(int));
+	char *buf = (char*)malloc(BULK_PAD);
+	int bad = 0;
+	long k;
+
+	store_clean(path);
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+
+	// All in order, into an empty store...
+
+	bulk_src b = {1, cnt, 1, 0, 0, buf};
+	bad += bulk_check(st, &b, 1, cnt, 0, vers, "Sorted");
+	bad += store_verify(st, "Sorted", total, vers);
+
+	// Half rewritten, then a key out of order: what came before it
+	// stays loaded...
+
+	bulk_src b2 = {1, cnt/2, 2, 1, 0, buf};
+	bad += bulk_check(st, &b2, 1, cnt/2, STORE_BULK_ORDER, vers, "Order");
+	bad += store_verify(st, "Order", total, vers);
+
+#ifndef _WIN32
+	// A write fails part way through (the file size limit), leaving
+	// the batches written before it loaded, and none of the rest...
+
+	struct rlimit rl, lim;
+	getrlimit(RLIMIT_FSIZE, &rl);
+	lim = rl;
+	lim.rlim_cur = BULK_LIMIT;
+	signal(SIGXFSZ, SIG_IGN);
+
+	if (setrlimit(RLIMIT_FSIZE, &lim) == 0)
+	{
+		bulk_src b3 = {cnt+1, total, 3, 0, BULK_PAD, buf};
+		int err = -1;
+		unsigned long n = store_bulk_load(st, &bulk_next, &b3, &err);
+		setrlimit(RLIMIT_FSIZE, &rl);
+
+		if ((err != STORE_BULK_WRITE) || !n || (n >= (unsigned long)(total-cnt)))
+		{
+			printf("Write error: loaded %lu (error %d)\n", n, err);
+			bad++;
+		}
+
+		for (k = cnt+1; k <= cnt+(long)n; k++)
+			vers[k] = 3;
+
+		bad += store_verify(st, "Write error", total, vers);
+	}
+#endif
+
+	store_close(st);
+	remove("./db-bulk/index.ckp");
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Reopened", total, vers);
+	store_close(st);
+	free(buf);
+	free(vers);
+	return bad;
+}
+
+// Compression: a log of plain records, then compressed ones (and
+// removal payloads) mixed in with short ones left plain, read back
+// whole by get, mget, view and tail, before and after reopening.
+
+#define LZ_MIN 64
+#define LZ_TOMB 9
+
+static int lz_value(char *tmpbuf, long k, int ver)
+{
+	int n = store_value(tmpbuf, k, ver);
+
+	if (!(k % 2))
+		return n;
+
+	int len = 200 + (int)(k % 7) * 50;
+
+	for (; n < len; n++)
+		tmpbuf[n] = '0' + n % 10;
+
+	tmpbuf[n] = 0;
+	return n;
+}
+
+static int lz_check(long k, int ver, const void *buf, int len)
+{
+	char tmpbuf[1024];
+	int n = lz_value(tmpbuf, k, ver);
+	return (len == n) && !memcmp(buf, tmpbuf, n);
+}
+
+typedef struct
+{
+	const int *vers;
+	long cnt, n;
+	int bad;
+}
+ lz_reader;
+
+static void lz_mget_callback(void *p1, const uuid *u, const void *buf, int len)
+{
+	lz_reader *r = (lz_reader*)p1;
+	long k = (long)u->u1;
+	r->n++;
+
+	if ((k < 1) || (k > r->cnt) || !lz_check(k, r->vers[k], buf, len))
+	{
+		if (r->bad++ < 10)
+			printf("Compress: mget key %ld wrong\n", k);
+	}
+}
+
+static int lz_tail_callback(void *p1, const uuid *u, const void *buf, int len)
+{
+	lz_reader *r = (lz_reader*)p1;
+	long k = (long)u->u1, i = 0;
+	int v = 0;
+	r->n++;
+
+	if (len < 0)
+		len = -len;
+
+	if (len && ((sscanf((const char*)buf, "{'name':'test','i':%ld,'v':%d}", &i, &v) != 2) || (i != k) || !lz_check(k, v, buf, len)))
+	{
+		if (r->bad++ < 10)
+			printf("Compress: tail record %ld (key %ld) wrong\n", r->n, k);
+	}
+
+	return 1;
+}
+
+static int lz_put(store *st, long k, int ver, int *vers)
+{
+	char tmpbuf[1024];
+	int len = lz_value(tmpbuf, k, ver);
+	uuid u = uuid_set(k, 1);
+
+	if (!store_add(st, &u, tmpbuf, len))
+	{
+		printf("ADD failed: %ld\n", k);
+		return 0;
+	}
+
+	vers[k] = ver;
+	return 1;
+}
+
+static int lz_verify(store *st, const char *what, long cnt, const int *vers, long writes)
+{
+	uuid *uuids = (uuid*)malloc(cnt*sizeof(uuid));
+	lz_reader r = {vers, cnt, 0, 0};
+	void *buf = NULL;
+	size_t len = 0;
+	long k, live = 0;
+	int bad = 0;
+
+	for (k = 1; k <= cnt; k++)
+	{
+		uuid u = uuid_set(k, 1);
+		int nbytes = store_get(st, &u, &buf, &len);
+		store_view v;
+
+		if (vers[k] ? !lz_check(k, vers[k], buf, nbytes) : (nbytes > 0))
+		{
+			if (bad++ < 10)
+				printf("%s: key %ld wrong (version %d, got %d bytes)\n", what, k, vers[k], nbytes);
+		}
+
+		nbytes = store_get_view(st, &u, &v);
+
+		if (vers[k] ? (nbytes <= 0) || !lz_check(k, vers[k], v.data, (int)v.len) : (nbytes > 0))
+		{
+			if (bad++ < 10)
+				printf("%s: key %ld view wrong\n", what, k);
+		}
+
+		if (nbytes > 0)
+			store_unpin(&v);
+
+		if (vers[k])
+			uuids[live++] = u;
+	}
+
+	if ((store_mget(st, uuids, (int)live, &lz_mget_callback, &r) != live) || (r.n != live) || r.bad)
+	{
+		printf("%s: mget found %ld of %ld, %d bad\n", what, r.n, live, r.bad);
+		bad++;
+	}
+
+	uuid z = {0};
+	store_cursor *c = store_tail_open(st, &z);
+	lz_reader t = {vers, cnt, 0, 0};
+
+	while (c && (store_tail_next(c, 0, &lz_tail_callback, &t) > 0))
+		;
+
+	store_tail_close(c);
+
+	if ((t.n != writes) || t.bad)
+	{
+		printf("%s: tail %ld of %ld records, %d bad\n", what, t.n, writes, t.bad);
+		bad++;
+	}
+
+	free(buf);
+	free(uuids);
+	printf("%s: %s\n", what, bad ? "FAILED" : "ok");
+	return bad;
+}
+
+static int do_compress(long cnt)
+{
+	const char *path = "./db-lz";
+	int *vers = (int*)calloc(cnt+1, sizeof(int));
+	long k, writes = 0, plain = 0, packed = 0;
+	int bad = 0;
+
+	store_clean(path);
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+
+	for (k = 1; k <= cnt; k++, writes++)
+		bad += !lz_put(st, k, 1, vers);
+
+	long before = store_logbytes(path, NULL);
+	store_set_compress(st, LZ_MIN);
+
+	for (k = 1; k <= cnt; k += 2, writes++)
+	{
+		char tmpbuf[1024];
+		plain += lz_value(tmpbuf, k, 2);
+		bad += !lz_put(st, k, 2, vers);
+	}
+
+	for (k = 3; k <= cnt; k += 10, writes++)
+	{
+		char tmpbuf[1024];
+		int len = lz_value(tmpbuf, k, LZ_TOMB);
+		uuid u = uuid_set(k, 1);
+		bad += !store_rem2(st, &u, tmpbuf, len);
+		vers[k] = 0;
+	}
+
+	for (k = 4; k <= cnt; k += 10, writes++)
+		bad += !store_del(st, k, vers);
+
+	for (k = 2; k <= cnt; k += 6, writes++)
+		bad += !lz_put(st, k, 3, vers);
+
+	packed = store_logbytes(path, NULL) - before;
+
+	if (packed*2 > plain)
+	{
+		printf("Compress: %ld bytes written for %ld\n", packed, plain);
+		bad++;
+	}
+
+	bad += lz_verify(st, "Compress", cnt, vers, writes);
+	store_close(st);
+
+	remove("./db-lz/index.ckp");
+	st = store_open(path, 0, 0);
+	bad += lz_verify(st, "Reopened", cnt, vers, writes);
+	store_close(st);
+	free(vers);
+	return bad;
+}
+
+// Record cache: the hit and miss counters follow exactly which keys
+// should be cached, as reads fill it, writes replace entries, and
+// removals and commits drop them (but a cancel doesn't), with every
+// read returning the latest contents. Then shrunk, and turned off.
+
+#define CACHE_SMALL (16*1024)
+
+static int cache_pass(store *st, const char *what, long cnt, const int *vers, char *cached, uint64_t *hits, uint64_t *misses)
+{
+	uint64_t h = 0, m = 0, want_h = *hits, want_m = *misses;
+	long k;
+
+	for (k = 1; k <= cnt; k++)
+	{
+		if (vers[k] && cached[k])
+			want_h++;
+		else
+			want_m++;
+
+		cached[k] = vers[k] != 0;
+	}
+
+	int bad = store_verify(st, what, cnt, vers);
+	store_cache_stats(st, &h, &m, NULL);
+
+	if ((h != want_h) || (m != want_m))
+	{
+		printf("%s: %llu hits, %llu misses, expected %llu and %llu\n", what, (unsigned long long)h, (unsigned long long)m, (unsigned long long)want_h, (unsigned long long)want_m);
+		bad++;
+	}
+
+	*hits = h;
+	*misses = m;
+	return bad;
+}
+
+static int do_cache(long cnt)
+{
+	const char *path = "./db-cache";
+	int *vers = (int*)calloc(cnt+1, sizeof(int));
+	char *cached = (char*)calloc(cnt+1, 1);
+	uint64_t hits = 0, misses = 0;
+	size_t nbytes = 0;
+	int bad = 0;
+	long k;
+
+	store_clean(path);
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+
+	for (k = 1; k <= cnt; k++)
+		bad += !store_put(st, k, 1, vers);
+
+	store_set_cache(st, 64*1024*1024);
+	bad += cache_pass(st, "Cache fill", cnt, vers, cached, &hits, &misses);
+	bad += cache_pass(st, "Cache hits", cnt, vers, cached, &hits, &misses);
+
+	// Overwritten records are cached afresh, removed ones dropped...
+
+	for (k = 1; k <= cnt; k += 3)
+	{
+		bad += !store_put(st, k, 2, vers);
+		cached[k] = 1;
+	}
+
+	for (k = 2; k <= cnt; k += 5)
+		bad += !store_del(st, k, vers);
+
+	bad += cache_pass(st, "Cache overwrite", cnt, vers, cached, &hits, &misses);
+
+	// Committed records are dropped, cancelled ones left alone...
+
+	hstore *h = store_begin(st);
+
+	for (k = 1; k <= cnt; k += 7)
+	{
+		char tmpbuf[256];
+		int len = store_value(tmpbuf, k, 3);
+		uuid u = uuid_set(k, 1);
+		bad += !store_hadd(h, &u, tmpbuf, len);
+		vers[k] = 3;
+		cached[k] = 0;
+	}
+
+	for (k = 3; k <= cnt; k += 11)
+	{
+		uuid u = uuid_set(k, 1);
+		store_hrem(h, &u);
+		vers[k] = 0;
+		cached[k] = 0;
+	}
+
+	bad += !store_end(h, 0);
+	h = store_begin(st);
+
+	for (k = 4; k <= cnt; k += 13)
+	{
+		char tmpbuf[256];
+		int len = store_value(tmpbuf, k, 4);
+		uuid u = uuid_set(k, 1);
+		store_hadd(h, &u, tmpbuf, len);
+	}
+
+	store_cancel(h);
+	bad += cache_pass(st, "Cache commit", cnt, vers, cached, &hits, &misses);
+
+	// Shrunk, it keeps within budget...
+
+	store_set_cache(st, CACHE_SMALL);
+	bad += store_verify(st, "Cache small", cnt, vers);
+	store_cache_stats(st, NULL, NULL, &nbytes);
+
+	if (!nbytes || (nbytes > CACHE_SMALL))
+	{
+		printf("Cache small: %lu bytes cached\n", (unsigned long)nbytes);
+		bad++;
+	}
+
+	// Off, it isn't consulted...
+
+	store_set_cache(st, 0);
+	store_cache_stats(st, &hits, &misses, NULL);
+	bad += !store_put(st, 1, 5, vers);
+	bad += store_verify(st, "Cache off", cnt, vers);
+	uint64_t hits2 = 0, misses2 = 0;
+	store_cache_stats(st, &hits2, &misses2, &nbytes);
+
+	if ((hits2 != hits) || (misses2 != misses) || nbytes)
+	{
+		printf("Cache off: still in use\n");
+		bad++;
+	}
+
+	store_close(st);
+	free(cached);
+	free(vers);
+	return bad;
+}
+
+// Preallocation and direct writes: the same writes, with and without
+// them, read back the same while active, sealed and after reopening,
+// and leave log files of the same sizes once trimmed.
+
+#define PRE_ALLOC (64*1024)
+
+static int prealloc_run(const char *path, const char *what, long cnt, int *vers, int tuned)
+{
+	int bad = 0;
+	long k;
+
+	store_clean(path);
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+	store_set_logsize(st, 32*1024);
+
+	if (tuned && !store_set_prealloc(st, PRE_ALLOC))
+		printf("%s: preallocation unsupported\n", what);
+
+	if (tuned && !store_set_direct(st, 1))
+		printf("%s: direct writes unsupported\n", what);
+
+	for (k = 1; k <= cnt; k++)
+		bad += !store_put(st, k, 1, vers);
+
+	for (k = 1; k <= cnt; k += 3)
+		bad += !store_put(st, k, 2, vers);
+
+	for (k = 2; k <= cnt; k += 5)
+		bad += !store_del(st, k, vers);
+
+	bad += store_verify(st, what, cnt, vers);
+
+	if (store_logs(path) < 3)
+	{
+		printf("%s: only %d log files\n", what, store_logs(path));
+		bad++;
+	}
+
+	store_close(st);
+	return bad;
+}
+
+static int do_prealloc(long cnt)
+{
+	const char *path = "./db-prealloc";
+	int *vers = (int*)calloc(cnt+1, sizeof(int));
+	int bad = 0;
+	long k;
+
+	bad += prealloc_run(path, "Plain", cnt, vers, 0);
+	long plain = store_logbytes(path, NULL);
+	bad += prealloc_run(path, "Tuned", cnt, vers, 1);
+	long tuned = store_logbytes(path, NULL);
+
+	if (tuned != plain)
+	{
+		printf("Tuned: %ld bytes of logs, plain %ld\n", tuned, plain);
+		bad++;
+	}
+
+	// Replayed from the sealed logs, then written to some more...
+
+	remove("./db-prealloc/index.ckp");
+	store *st = store_open(path, 0, 0);
+	if (!st) return bad + 1;
+	bad += store_verify(st, "Reopened", cnt, vers);
+	store_set_prealloc(st, PRE_ALLOC);
+	store_set_direct(st, 1);
+
+	for (k = 1; k <= cnt; k += 7)
+		bad += !store_put(st, k, 3, vers);
+
+	store_close(st);
+	remove("./db-prealloc/index.ckp");
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Reopened again", cnt, vers);
+	store_close(st);
+	free(vers);
+	return bad;
+}
+
+// Conversion: a fixture log of text-format records, as older stores
+// wrote them (adds, overwrites, removals with and without payload, a
+// committed and a cancelled transaction), read as is, then converted
+// to the binary format and read again. Converting twice does nothing.
+
+static const int convert_vers[] = {0, 1, 2, 0, 0, 3, 0, 1, 2};
+
+static int do_convert(const char *fixture)
+{
+	const char *path = "./db-convert", *filename = "./db-convert/0.log";
+	long cnt = sizeof(convert_vers)/sizeof(convert_vers[0]) - 1, len = 0;
+	int bad = 0, n;
+
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+	store_close(st);
+	store_clean(path);
+
+	char *buf = file_load(fixture, &len);
+
+	if (!buf || !len || (buf[0] != '[') || !file_save(filename, buf, len))
+	{
+		printf("Convert: no fixture '%s'\n", fixture);
+		free(buf);
+		return 1;
+	}
+
+	free(buf);
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Text", cnt, convert_vers);
+	store_close(st);
+
+	if ((n = store_convert(path, NULL)) != 1)
+	{
+		printf("Convert: %d files converted\n", n);
+		bad++;
+	}
+
+	buf = file_load(filename, &len);
+
+	if (!buf || !len || (buf[0] == '['))
+	{
+		printf("Convert: '%s' not converted\n", filename);
+		bad++;
+	}
+
+	free(buf);
+	remove("./db-convert/index.ckp");
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Converted", cnt, convert_vers);
+	store_close(st);
+
+	if ((n = store_convert(path, NULL)) != 0)
+	{
+		printf("Convert: %d files converted again\n", n);
+		bad++;
+	}
+
+	remove("./db-convert/index.ckp");
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Reconverted", cnt, convert_vers);
+	store_close(st);
+	return bad;
+}
+
+// Group commit: several threads each committing small durable
+// transactions at once, of keys of their own.
+
+#define GC_THREADS 8
+#define GC_BATCH 10
+
+typedef struct
+{
+	store *st;
+	int *vers;
+	long first, cnt;
+	int bad;
+	event *ev;
+}
+ gc_writer;
+
+static int group_writer(void *p1)
+{
+	gc_writer *w = (gc_writer*)p1;
+	long k;
+
+	for (k = w->first; k < (w->first+w->cnt); k += GC_BATCH)
+	{
+		hstore *h = store_begin(w->st);
+		long j;
+
+		for (j = k; (j < (k+GC_BATCH)) && (j < (w->first+w->cnt)); j++)
+		{
+			char tmpbuf[256];
+			int len = store_value(tmpbuf, j, 1);
+			uuid u = uuid_set(j, 1);
+
+			if (!store_hadd(h, &u, tmpbuf, len))
+				w->bad++;
+		}
+
+		if (store_end(h, 1))
+		{
+			for (j = k; (j < (k+GC_BATCH)) && (j < (w->first+w->cnt)); j++)
+				w->vers[j] = 1;
+		}
+		else
+			w->bad++;
+	}
+
+	event_signal(w->ev);
+	return 1;
+}
+
+static int do_group_commit(long cnt)
+{
+	const char *path = "./db-gc";
+	int *vers = (int*)calloc(cnt+1, sizeof(int));
+	gc_writer w[GC_THREADS];
+	event *ev = event_create();
+	long per = cnt / GC_THREADS;
+	int bad = 0, i;
+	unsigned done;
+
+	store_clean(path);
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+	store_set_group_commit(st, 1000, GC_THREADS);
+	time_t t = time(NULL);
+
+	for (i = 0; i < GC_THREADS; i++)
+	{
+		gc_writer tmp = {st, vers, 1+(i*per), per, 0, ev};
+		w[i] = tmp;
+		thread_run(&group_writer, &w[i]);
+	}
+
+	while ((done = event_count(ev)) < GC_THREADS)
+		event_wait(ev, done, 1000);
+
+	for (i = 0; i < GC_THREADS; i++)
+		bad += w[i].bad;
+
+	printf("Group commit: %ld transactions in %lds\n", (per/GC_BATCH)*GC_THREADS, (long)(time(NULL)-t));
+	bad += store_verify(st, "Group commit", cnt, vers);
+	store_close(st);
+
+	remove("./db-gc/index.ckp");
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Reopened", cnt, vers);
+	store_close(st);
+	event_destroy(ev);
+	free(vers);
+	return bad;
+}
+
+// Rotate through many small log files, with overwrites and deletes
+// of records in those already sealed, then reopen.
+
+static int do_rotate(long cnt)
+{
+	const char *path = "./db-rot";
+	int *vers = (int*)calloc(cnt+1, sizeof(int));
+	int bad = 0;
+	long k;
+
+	store_clean(path);
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+	store_set_logsize(st, 16*1024);
+
+	for (k = 1; k <= cnt; k++)
+		bad += !store_put(st, k, 1, vers);
+
+	for (k = 1; k <= cnt; k += 3)
+		bad += !store_put(st, k, 2, vers);
+
+	for (k = 2; k <= cnt; k += 5)
+		bad += !store_del(st, k, vers);
+
+	int logs = store_logs(path);
+
+	if (logs < 10)
+	{
+		printf("Rotate: only %d log files\n", logs);
+		bad++;
+	}
+
+	bad += store_verify(st, "Rotated", cnt, vers);
+	store_close(st);
+
+	// Without a checkpoint, so everything is replayed...
+
+	remove("./db-rot/index.ckp");
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Reopened", cnt, vers);
+	store_close(st);
+	free(vers);
+	return bad;
+}
+
+// Compact log files mostly overwritten or deleted, twice over, with
+// views pinned from before. Small log files make for plenty of them.
+
+static int do_compaction(long cnt)
+{
+	const char *path = "./db-cmp";
+	int *vers = (int*)calloc(cnt+1, sizeof(int));
+	long k, part = cnt * 4 / 10;
+	int bad = 0, done = 0;
+
+	store_clean(path);
+	store *st = store_open(path, 0, 0);
+	if (!st) return 1;
+	store_set_logsize(st, 64*1024);
+
+	for (k = 1; k <= cnt; k++)
+		bad += !store_put(st, k, 1, vers);
+
+	// Nothing to do yet, but from now on obsolete records count...
+
+	bad += store_compact(st);
+
+	store_view v1, v2;
+	char tmpbuf[256];
+	int len = store_value(tmpbuf, 5, 1);
+	uuid u = uuid_set(5, 1);
+
+	if (!store_get_view(st, &u, &v1))
+	{
+		printf("View failed\n");
+		bad++;
+	}
+
+	for (k = 1; k <= part; k++)
+	{
+		if (k % 10)
+			bad += !store_put(st, k, 2, vers);
+
+		if (!(k % 7))
+			bad += !store_del(st, k, vers);
+	}
+
+	while (store_compact(st))
+		done++;
+
+	if (!done)
+	{
+		printf("Compaction: nothing compacted\n");
+		bad++;
+	}
+
+	bad += store_verify(st, "Compacted", cnt, vers);
+	u = uuid_set(10, 1);
+
+	if (!store_get_view(st, &u, &v2))
+	{
+		printf("View failed\n");
+		bad++;
+	}
+
+	for (k = 10; k <= part; k += 10)
+		bad += !store_put(st, k, 3, vers);
+
+	for (k = part+1; k <= cnt/2; k++)
+		bad += !store_put(st, k, 2, vers);
+
+	for (done = 0; store_compact(st); done++)
+		;
+
+	if (!done)
+	{
+		printf("Compaction: nothing compacted again\n");
+		bad++;
+	}
+
+	bad += store_verify(st, "Compacted again", cnt, vers);
+
+	if ((v1.len < (size_t)len) || memcmp(v1.data, tmpbuf, len))
+	{
+		printf("Compaction: pinned view changed\n");
+		bad++;
+	}
+
+	len = store_value(tmpbuf, 10, 1);
+
+	if ((v2.len < (size_t)len) || memcmp(v2.data, tmpbuf, len))
+	{
+		printf("Compaction: pinned view changed\n");
+		bad++;
+	}
+
+	store_unpin(&v1);
+	store_unpin(&v2);
+	store_close(st);
+
+	st = store_open(path, 0, 0);
+	bad += store_verify(st, "Reopened", cnt, vers);
+	store_close(st);
+	free(vers);
+	return bad;
+}
+
+// Count the records logged in a store, leaving the position after.
+
+static int store_records_cb(void *p1, const uuid *u, const void *buf, int len)
+{
+	(*(long*)p1)++;
+	return 1;
+}
+
+static long store_records(store *st, uint64_t *pos)
+{
+	uuid u = {0};
+	store_cursor *c = store_tail_open(st, &u);
+	long n = 0;
+
+	if (!c)
+		return -1;
+
+	while (store_tail_next(c, 0, &store_records_cb, &n) > 0)
+		;
+
+	if (pos)
+		*pos = store_tail_pos(c);
+
+	store_tail_close(c);
+	return n;
+}
+
+static int replica_wait(void *p1)
+{
+	handler_wait((handler*)p1);
+	return 1;
+}
+
+// Wait for the replica to acknowledge all the primary has logged.
+
+static int replica_caught_up(store *st, replica *r2)
+{
+	uint64_t pos = 0;
+	int secs;
+
+	store_records(st, &pos);
+
+	for (secs = 0; secs < 30; secs++)
+	{
+		if (replica_position(r2) >= pos)
+			return 1;
+
+		sleep(1);
+	}
+
+	printf("Replica stuck at %llu of %llu\n", (unsigned long long)replica_position(r2), (unsigned long long)pos);
+	return 0;
+}
+
+// Replicate over loopback: add, overwrite and delete on the primary,
+// and once acknowledged the replica must match. Then disconnect, do
+// more and reconnect: it must pick up from where it was acknowledged
+// rather than the start, so log the same records as the primary.
+
+static int do_replica(long cnt)
+{
+	const unsigned short port = REPLICA_DEFAULT_PORT;
+	int *vers = (int*)calloc(cnt*2+1, sizeof(int));
+	int bad = 0;
+	long k;
+
+	store_clean("./db-rp");
+	store_clean("./db-rr");
+	store *st = store_open("./db-rp", 0, 0);
+	store *st2 = store_open("./db-rr", 0, 0);
+	if (!st || !st2) return 1;
+
+	handler *h = handler_create(0);
+	replica *r = replica_create(st);
+
+	if (!handler_add_server(h, &replica_handler, r, NULL, port, 1, 0, NULL))
+	{
+		printf("Replica server failed\n");
+		return 1;
+	}
+
+	thread_run(&replica_wait, h);
+
+	for (k = 1; k <= cnt; k++)
+		bad += !store_put(st, k, 1, vers);
+
+	bad += !store_del(st, cnt/2, vers);
+
+	handler *h2 = handler_create(0);
+	replica *r2 = replica_create(st2);
+
+	if (!replica_follow(h2, r2, "localhost", port, 0))
+	{
+		printf("Replica follow failed\n");
+		return 1;
+	}
+
+	thread_run(&replica_wait, h2);
+	bad += !replica_caught_up(st, r2);
+	bad += store_verify(st2, "Replicated", cnt*2, vers);
+
+	handler_destroy(h2);
+
+	for (k = cnt+1; k <= cnt*2; k++)
+		bad += !store_put(st, k, 1, vers);
+
+	for (k = 1; k <= cnt; k += 3)
+		bad += !store_put(st, k, 2, vers);
+
+	for (k = 2; k <= cnt*2; k += 5)
+		bad += !store_del(st, k, vers);
+
+	h2 = handler_create(0);
+
+	if (!replica_follow(h2, r2, "localhost", port, 0))
+	{
+		printf("Replica follow failed\n");
+		return 1;
+	}
+
+	thread_run(&replica_wait, h2);
+	bad += !replica_caught_up(st, r2);
+	bad += store_verify(st2, "Resumed", cnt*2, vers);
+
+	long n = store_records(st, NULL), n2 = store_records(st2, NULL);
+
+	if (n != n2)
+	{
+		printf("Resumed: replica logged %ld records, primary %ld\n", n2, n);
+		bad++;
+	}
+
+	handler_destroy(h2);
+	handler_destroy(h);
+	replica_destroy(r2);
+	replica_destroy(r);
+	store_close(st2);
+	store_close(st);
+	free(vers);
+	return bad;
+}
+
 #define SKIP_RANDOM 0
 
 static void do_skipbuck(long cnt)
@@ -421,19 +2750,128 @@ static void do_skipbuck(long cnt)
 	sb_destroy(sl);
 }
 
+// The keys the tree ought to hold, as present in 'have', for
+// checking cursors against: the first from 'k' up to 'to', or the
+// last from 'k' down to 'from', or zero if none.
+
+static long tree_expect_next(const char *have, long k, long to)
+{
+	for (; k < to; k++)
+	{
+		if (have[k])
+			return k;
+	}
+
+	return 0;
+}
+
+static long tree_expect_prev(const char *have, long k, long from)
+{
+	for (; k >= from; k--)
+	{
+		if (have[k])
+			return k;
+	}
+
+	return 0;
+}
+
+static int tree_expect(tree_cursor *c, int ok, long k, const char *what)
+{
+	uuid u = {0};
+	unsigned long long v = 0;
+
+	if (!k)
+	{
+		if (!ok && !tree_cursor_get(c, &u, &v))
+			return 0;
+
+		printf("Cursor %s: got %llu, expected the end\n", what, (unsigned long long)u.u1);
+		return 1;
+	}
+
+	if (ok && tree_cursor_get(c, &u, &v) && (u.u1 == (uint64_t)k) && (u.u2 == 1) && (v == (uint64_t)k))
+		return 0;
+
+	printf("Cursor %s: got %llu, expected %ld\n", what, ok ? (unsigned long long)u.u1 : 0ULL, k);
+	return 1;
+}
+
+// Walk a bounded range both ways, seek to keys present and absent,
+// step back from a seek_after, and start over from either end.
+
+static int tree_cursor_check(const tree *tptr, const char *have, long cnt)
+{
+	long lo = cnt/4+1, hi = cnt*3/4+1, k, j;
+	uuid from = uuid_set(lo, 1), to = uuid_set(hi, 1);
+	tree_cursor *c = tree_cursor_open(tptr, &from, &to);
+	int bad = 0, i;
+
+	if (!c)
+		return 1;
+
+	for (k = tree_expect_next(have, lo, hi); k; k = tree_expect_next(have, k+1, hi))
+		bad += tree_expect(c, tree_next(c), k, "forward");
+
+	bad += tree_expect(c, tree_next(c), 0, "forward");
+	bad += tree_expect(c, tree_next(c), tree_expect_next(have, lo, hi), "restart next");
+	tree_cursor_close(c);
+
+	c = tree_cursor_open(tptr, &from, &to);
+
+	for (k = tree_expect_prev(have, hi-1, lo); k; k = tree_expect_prev(have, k-1, lo))
+		bad += tree_expect(c, tree_prev(c), k, "backward");
+
+	bad += tree_expect(c, tree_prev(c), 0, "backward");
+	bad += tree_expect(c, tree_prev(c), tree_expect_prev(have, hi-1, lo), "restart prev");
+
+	// Seeks: to each key (present or not), just past it (never
+	// present), and below the range...
+
+	for (i = 0; i < 1000; i++)
+	{
+		j = lo + rand() % (hi-lo);
+		uuid u = uuid_set(j, 1), u2 = uuid_set(j, 2);
+
+		bad += tree_expect(c, tree_seek(c, &u), tree_expect_next(have, j, hi), "seek");
+		bad += tree_expect(c, tree_seek(c, &u2), tree_expect_next(have, j+1, hi), "seek absent");
+
+		// After the key, then back to the one before that...
+
+		k = tree_expect_next(have, j+1, hi);
+		bad += tree_expect(c, tree_seek_after(c, &u), k, "seek_after");
+
+		if (k)
+			bad += tree_expect(c, tree_prev(c), tree_expect_prev(have, k-1, lo), "seek_after prev");
+	}
+
+	uuid u = uuid_set(1, 0);
+	bad += tree_expect(c, tree_seek(c, &u), tree_expect_next(have, lo, hi), "seek below");
+	bad += tree_expect(c, tree_seek(c, &to), 0, "seek end");
+	bad += tree_expect(c, tree_next(c), tree_expect_next(have, lo, hi), "restart after seek");
+	tree_cursor_close(c);
+	return bad;
+}
+
 #define TREE_RANDOM 0
 
-void do_tree(long cnt, int rnd)
+int do_tree(long cnt, int rnd)
 {
 	tree *tptr = tree_create();
+	char *have = (char*)calloc(cnt+2, 1);
+	int bad = 0;
 	long i;
 
+	if (!tptr || !have)
+		return 1;
+
 	if (!rnd)
 	{
 		for (i = 1; i <= cnt; i++)
 		{
 			uuid u = uuid_set(i, 1);
 			tree_add(tptr, &u, u.u1);
+			have[i] = 1;
 		}
 	}
 	else
@@ -443,6 +2881,7 @@ void do_tree(long cnt, int rnd)
 			uint64_t k = rand()%10;
 			uuid u = uuid_set(((i+k)%cnt)+1, 1);
 			tree_add(tptr, &u, u.u1);
+			have[u.u1] = 1;
 		}
 	}
 
@@ -455,18 +2894,55 @@ void do_tree(long cnt, int rnd)
 
 		if (!tree_get(tptr, &u, &v))
 		{
-			if (!rnd)
+			if (have[u.u1])
+			{
 				printf("Get failed: %llu\n", (unsigned long long)u.u1);
+				bad++;
+			}
 		}
 		else if (u.u1 != v)
+		{
 			printf("Get bad match: k=%llu v=%llu\n", (unsigned long long)u.u1, (unsigned long long)v);
+			bad++;
+		}
 		else
 			;//printf("Get k=%llu v=%llu\n", (unsigned long long)u.u1, (unsigned long long)v);
 	}
 
-	size_t trunks, branches, leafs;
-	tree_stats(tptr, &trunks, &branches, &leafs);
-	printf("Stats: Trunks: %lld, Branches: %lld, Leafs: %lld\n", (long long)trunks, (long long)branches, (long long)leafs);
+	// Walk in order...
+
+	tree_cursor *c = tree_cursor_open(tptr, NULL, NULL);
+	uuid last = {0};
+	long n = 0;
+
+	while (tree_next(c))
+	{
+		uuid u;
+		tree_cursor_get(c, &u, NULL);
+
+		if (n++ && (uuid_compare(&u, &last) <= 0))
+		{
+			printf("Cursor out of order: %llu\n", (unsigned long long)u.u1);
+			bad++;
+		}
+
+		last = u;
+	}
+
+	tree_cursor_close(c);
+
+	if (n != (long)tree_count(tptr))
+	{
+		printf("Cursor count: %ld != %ld\n", n, (long)tree_count(tptr));
+		bad++;
+	}
+
+	if (cnt >= 4)
+		bad += tree_cursor_check(tptr, have, cnt);
+
+	size_t trunks, branches, leafs, slots, bytes;
+	tree_stats2(tptr, &trunks, &branches, &leafs, &slots, &bytes);
+	printf("Stats: Trunks: %lld, Branches: %lld, Leafs: %lld, Fill: %.2f, Bytes: %lld\n", (long long)trunks, (long long)branches, (long long)leafs, slots?(double)leafs/slots:0.0, (long long)bytes);
 
 	// Random deletes...
 
@@ -485,11 +2961,18 @@ void do_tree(long cnt, int rnd)
 				;//printf("Del k=%llu\n", (unsigned long long)u.u1);
 		}
 
-		tree_stats(tptr, &trunks, &branches, &leafs);
-		printf("Stats: Trunks: %lld, Branches: %lld, Leafs: %lld\n", (long long)trunks, (long long)branches, (long long)leafs);
+		tree_stats2(tptr, &trunks, &branches, &leafs, &slots, &bytes);
+		printf("Stats: Trunks: %lld, Branches: %lld, Leafs: %lld, Fill: %.2f, Bytes: %lld\n", (long long)trunks, (long long)branches, (long long)leafs, slots?(double)leafs/slots:0.0, (long long)bytes);
+
+		size_t freed = tree_compact(tptr);
+		tree_stats2(tptr, &trunks, &branches, &leafs, &slots, &bytes);
+		printf("Compact: Freed: %lld, Fill: %.2f, Bytes: %lld\n", (long long)freed, slots?(double)leafs/slots:0.0, (long long)bytes);
 	}
 
 	tree_destroy(tptr);
+	free(have);
+	printf("Tree: %s\n", bad ? "FAILED" : "ok");
+	return bad;
 }
 
 static void do_base64()
@@ -589,7 +3072,14 @@ int main(int ac, char *av[])
 	int test_json = 0, test_base64 = 0, rnd = 0, test_skipbuck = 0;
 	int broadcast = 0, threads = 0, test_script = 0, test_jsonq = 0;
 	int discovery = 0, test_linda_out = 0, test_linda_in = 0;
-	int tran = 0;
+	int tran = 0, convert = 0, parallel = 0, shards = 0;
+	int test_checkpoint = 0, test_replica = 0, test_compaction = 0;
+	int test_rotate = 0, test_group_commit = 0, test_mget = 0;
+	int test_write_behind = 0, test_tail = 0, test_scan = 0;
+	int test_torn = 0, test_shard_crash = 0, test_recover = 0;
+	int test_bulk = 0, test_compress = 0, test_cache = 0;
+	int test_prealloc = 0;
+	const char *fixture = NULL;
 	unsigned short port = SERVER_PORT;
 	int i;
 
@@ -629,6 +3119,9 @@ int main(int ac, char *av[])
 			port = (unsigned short)tmp_port;
 		}
 
+		if (!strncmp(av[i], "--shards=", 9))
+			sscanf(av[i], "%*[^=]=%d", &shards);
+
 		if (!strncmp(av[i], "--threads=", 10))
 			sscanf(av[i], "%*[^=]=%d", &threads);
 
@@ -653,6 +3146,54 @@ int main(int ac, char *av[])
 		if (!strcmp(av[i], "--store"))
 			test_store = 1;
 
+		if (!strcmp(av[i], "--checkpoint"))
+			test_checkpoint = 1;
+
+		if (!strcmp(av[i], "--replica"))
+			test_replica = 1;
+
+		if (!strcmp(av[i], "--compaction"))
+			test_compaction = 1;
+
+		if (!strcmp(av[i], "--rotate"))
+			test_rotate = 1;
+
+		if (!strcmp(av[i], "--group-commit"))
+			test_group_commit = 1;
+
+		if (!strcmp(av[i], "--mget"))
+			test_mget = 1;
+
+		if (!strcmp(av[i], "--write-behind"))
+			test_write_behind = 1;
+
+		if (!strcmp(av[i], "--tail"))
+			test_tail = 1;
+
+		if (!strcmp(av[i], "--scan"))
+			test_scan = 1;
+
+		if (!strcmp(av[i], "--torn"))
+			test_torn = 1;
+
+		if (!strcmp(av[i], "--shard-crash"))
+			test_shard_crash = 1;
+
+		if (!strcmp(av[i], "--recover"))
+			test_recover = 1;
+
+		if (!strcmp(av[i], "--bulk"))
+			test_bulk = 1;
+
+		if (!strcmp(av[i], "--compress"))
+			test_compress = 1;
+
+		if (!strcmp(av[i], "--cache"))
+			test_cache = 1;
+
+		if (!strcmp(av[i], "--prealloc"))
+			test_prealloc = 1;
+
 		if (!strcmp(av[i], "--base64"))
 			test_base64 = 1;
 
@@ -671,9 +3212,18 @@ int main(int ac, char *av[])
 		if (!strcmp(av[i], "--compact"))
 			compact = 1;
 
+		if (!strcmp(av[i], "--parallel"))
+			parallel = 1;
+
 		if (!strcmp(av[i], "--tran"))
 			tran = 1;
 
+		if (!strcmp(av[i], "--convert"))
+			convert = 1;
+
+		if (!strncmp(av[i], "--convert=", 10))
+			fixture = av[i]+10;
+
 		if (!strcmp(av[i], "--srvr"))
 			srvr = 1;
 
@@ -743,9 +3293,69 @@ int main(int ac, char *av[])
 		return 0;
 	}
 
+	if (fixture)
+		return do_convert(fixture) ? 1 : 0;
+
+	if (convert)
+	{
+		printf("Store: %d files converted\n", store_convert("./db", NULL));
+		return 0;
+	}
+
+	if (test_checkpoint)
+		return do_checkpoint(loops) ? 1 : 0;
+
+	if (test_replica)
+		return do_replica(loops) ? 1 : 0;
+
+	if (test_compaction)
+		return do_compaction(loops) ? 1 : 0;
+
+	if (test_rotate)
+		return do_rotate(loops) ? 1 : 0;
+
+	if (test_group_commit)
+		return do_group_commit(loops) ? 1 : 0;
+
+	if (test_mget)
+		return do_mget(loops) ? 1 : 0;
+
+	if (test_write_behind)
+		return do_write_behind(loops) ? 1 : 0;
+
+	if (test_tail)
+		return do_tail(loops) ? 1 : 0;
+
+	if (test_scan)
+		return do_scan(loops) ? 1 : 0;
+
+	if (test_torn)
+		return do_torn(loops) ? 1 : 0;
+
+	if (test_shard_crash)
+		return do_shard_crash(shards ? shards : 4) ? 1 : 0;
+
+	if (test_recover)
+		return do_recover(loops) ? 1 : 0;
+
+	if (test_bulk)
+		return do_bulk(loops) ? 1 : 0;
+
+	if (test_compress)
+		return do_compress(loops) ? 1 : 0;
+
+	if (test_cache)
+		return do_cache(loops) ? 1 : 0;
+
+	if (test_prealloc)
+		return do_prealloc(loops) ? 1 : 0;
+
+	if (test_store && shards)
+		return do_shard(loops, shards, vfy, (compact?STORE_COMPACT:0)|(parallel?STORE_PARALLEL:0), tran) ? 1 : 0;
+
 	if (test_store)
 	{
-		do_store(loops, vfy, compact, tran);
+		do_store(loops, vfy, (compact?STORE_COMPACT:0)|(parallel?STORE_PARALLEL:0), tran);
 		return 0;
 	}
 
@@ -757,8 +3367,7 @@ int main(int ac, char *av[])
 
 	if (test_tree)
 	{
-		do_tree(loops, rnd);
-		return 0;
+		return do_tree(loops, rnd) ? 1 : 0;
 	}
 
 	if (test_script)
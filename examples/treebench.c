@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <tree.h>
+
+// Tree benchmark: insert throughput by key order, against plain
+// appends, with the fill factor and memory it leaves behind.
+//
+//	--keys=1000000
+//	--run=256			length of each late run (for 'runs')
+//
+//	seq		in order, so every add is an append
+//	rnd		random order
+//	runs	half appended spaced out, then the rest arriving late
+//			in ascending runs into random gaps (eg. replicated or
+//			merged data)
+//	rev		descending order
+//
+// A random get is also timed, being the least any add not at the
+// end can cost.
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t mix64(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static void report(const char *name, long n, uint64_t ns, double base, tree *tptr)
+{
+	size_t trunks, branches, leafs, slots, bytes;
+	tree_stats2(tptr, &trunks, &branches, &leafs, &slots, &bytes);
+	double rate = n / (ns/1e9);
+
+	printf("%-6s %10ld %9.3fs %9.2f %8.1fx %6.2f %10.1f\n",
+		name, n, ns/1e9, rate/1e6, base/rate,
+		slots ? (double)leafs/slots : 0.0, leafs ? (double)bytes/leafs : 0.0);
+}
+
+int main(int ac, char *av[])
+{
+	long keys = 1000000, run = 256, i;
+
+	for (i = 1; i < ac; i++)
+	{
+		if (!strncmp(av[i], "--keys=", 7))
+			sscanf(av[i], "%*[^=]=%ld", &keys);
+
+		if (!strncmp(av[i], "--run=", 6))
+			sscanf(av[i], "%*[^=]=%ld", &run);
+	}
+
+	if (keys < 4)
+		keys = 4;
+
+	if ((run < 1) || (run >= keys))
+		run = 1;
+
+	printf("order        keys      time    Mops/s   vs seq   fill  bytes/key\n");
+
+	// In order...
+
+	tree *tptr = tree_create();
+	uint64_t t0 = now_ns();
+
+	for (i = 1; i <= keys; i++)
+	{
+		uuid u = uuid_set(i, 1);
+		tree_add(tptr, &u, i);
+	}
+
+	uint64_t ns = now_ns() - t0;
+	double base = keys / (ns/1e9);
+	report("seq", keys, ns, base, tptr);
+	tree_destroy(tptr);
+
+	// Random...
+
+	tptr = tree_create();
+	t0 = now_ns();
+
+	for (i = 0; i < keys; i++)
+	{
+		uuid u = uuid_set(mix64(i)|1, 1);
+		tree_add(tptr, &u, i);
+	}
+
+	report("rnd", keys, now_ns()-t0, base, tptr);
+	t0 = now_ns();
+
+	for (i = 0; i < keys; i++)
+	{
+		uuid u = uuid_set(mix64((i*7919)%keys)|1, 1);
+		unsigned long long v;
+		tree_get(tptr, &u, &v);
+	}
+
+	ns = now_ns() - t0;
+	printf("%-6s %10ld %9.3fs %9.2f\n", "get", keys, ns/1e9, keys/(ns/1e9)/1e6);
+	tree_destroy(tptr);
+
+	// Late runs into the gaps...
+
+	long half = keys / 2, runs = (keys - half) / run;
+	tptr = tree_create();
+
+	for (i = 1; i <= half; i++)
+	{
+		uuid u = uuid_set(i*keys, 1);
+		tree_add(tptr, &u, i);
+	}
+
+	t0 = now_ns();
+
+	for (i = 0; i < runs; i++)
+	{
+		uint64_t gap = 1 + mix64(i) % (half-1);
+		long j;
+
+		for (j = 0; j < run; j++)
+		{
+			uuid u = uuid_set(gap*keys+1+j, 1);
+			tree_add(tptr, &u, j);
+		}
+	}
+
+	report("runs", runs*run, now_ns()-t0, base, tptr);
+	tree_destroy(tptr);
+
+	// Backwards...
+
+	tptr = tree_create();
+	t0 = now_ns();
+
+	for (i = keys; i > 0; i--)
+	{
+		uuid u = uuid_set(i, 1);
+		tree_add(tptr, &u, i);
+	}
+
+	report("rev", keys, now_ns()-t0, base, tptr);
+	tree_destroy(tptr);
+	return 0;
+}
@@ -19,7 +19,7 @@ static size_t encode_base64(char *ostr, unsigned char *inbuf, int *inbuf_size, i
 	*ostr++ = (*inbuf_size > 1 ? vec[out] : padding);
 	out = (unsigned char)(*(inbuf+2) & 0x3F);
 	*ostr++ = (*inbuf_size > 2 ? vec[out] : padding);
-	line_len += 4;
+	*line_len += 4;
 	len = 4;
 
 	if ((*line_len >= 76) && line_breaks)
@@ -134,15 +134,15 @@ static int conv_to_number(unsigned char inbyte)
 	return -1;
 }
 
-void parse_base64(const char *s, size_t nbytes, char **pdst)
+size_t parse_base64(const char *s, size_t nbytes, char **pdst)
 {
-	if (!pdst) return;
+	if (!pdst) return 0;
 	size_t max_len = 0, bytes_left = 0;
 
 	if (!*pdst)
 	{
 		*pdst = (char*)malloc(max_len=bytes_left=1024);
-		if (!*pdst) return;
+		if (!*pdst) return 0;
 	}
 
 	char *dst = *pdst;
@@ -170,7 +170,7 @@ void parse_base64(const char *s, size_t nbytes, char **pdst)
 			size_t nbytes = dst - *pdst;
 			bytes_left = max_len - nbytes;
 			*pdst = (char*)realloc(*pdst, max_len);
-			if (!*pdst) return;
+			if (!*pdst) return 0;
 			dst = *pdst + nbytes;
 		}
 	}
@@ -186,5 +186,6 @@ void parse_base64(const char *s, size_t nbytes, char **pdst)
 	}
 
 	*dst = 0;
+	return dst - *pdst;
 }
 
@@ -6,8 +6,10 @@
 // stack-based buffer in controlled circumstances. If '*pdst' is zero
 // a buffer will be allocated which must subsequently be freed by the
 // caller...
+//
+// Parsing returns the number of bytes decoded (zero on failure).
 
 void format_base64(const char *src, size_t nbytes, char **pdst, int line_breaks, int cr);
-void parse_base64(const char *src, size_t nbytes, char **pdst);
+size_t parse_base64(const char *src, size_t nbytes, char **pdst);
 
 #endif
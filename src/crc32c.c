@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#define POLY 0x82F63B78		// reflected Castagnoli
+
+// The CRC32 instruction (SSE4.2 on x86-64, or the ARMv8 CRC
+// extension) does 8 bytes at a time. Otherwise slice by 8 bytes
+// through tables.
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32C_SSE42 1
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CRC32C_ARM 1
+#include <arm_acle.h>
+#endif
+
+// The tables are built, and the implementation chosen, once before
+// any thread can be checksumming: at load time where the compiler
+// allows, otherwise on first use but only the once.
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CRC32C_CTOR 1
+#elif defined(_WIN32)
+#include <windows.h>
+static INIT_ONCE s_once = INIT_ONCE_STATIC_INIT;
+#else
+#include <pthread.h>
+static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+#endif
+
+static uint32_t s_table[8][256];
+static int s_hw = 0;
+
+#if CRC32C_CTOR
+__attribute__((constructor))
+#endif
+static void crc32c_init(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		int j;
+
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+
+		s_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+	{
+		int j;
+
+		for (j = 1; j < 8; j++)
+			s_table[j][i] = s_table[0][s_table[j-1][i] & 0xFF] ^ (s_table[j-1][i] >> 8);
+	}
+
+#if CRC32C_SSE42
+	__builtin_cpu_init();
+	s_hw = __builtin_cpu_supports("sse4.2");
+#elif CRC32C_ARM
+	s_hw = 1;
+#endif
+}
+
+#if !CRC32C_CTOR && defined(_WIN32)
+static BOOL CALLBACK crc32c_init_once(PINIT_ONCE once, PVOID p1, PVOID *p2)
+{
+	crc32c_init();
+	return TRUE;
+}
+#endif
+
+#if CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *src, size_t len)
+{
+	uint64_t crc64 = crc;
+
+	while (len && ((uintptr_t)src & 7))
+	{
+		crc64 = _mm_crc32_u8((uint32_t)crc64, *src++);
+		len--;
+	}
+
+	while (len >= 8)
+	{
+		uint64_t v;
+		memcpy(&v, src, sizeof(v));
+		crc64 = _mm_crc32_u64(crc64, v);
+		src += 8;
+		len -= 8;
+	}
+
+	crc = (uint32_t)crc64;
+
+	while (len--)
+		crc = _mm_crc32_u8(crc, *src++);
+
+	return crc;
+}
+#elif CRC32C_ARM
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *src, size_t len)
+{
+	while (len && ((uintptr_t)src & 7))
+	{
+		crc = __crc32cb(crc, *src++);
+		len--;
+	}
+
+	while (len >= 8)
+	{
+		uint64_t v;
+		memcpy(&v, src, sizeof(v));
+		crc = __crc32cd(crc, v);
+		src += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = __crc32cb(crc, *src++);
+
+	return crc;
+}
+#endif
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *src, size_t len)
+{
+	while (len && ((uintptr_t)src & 7))
+	{
+		crc = s_table[0][(crc ^ *src++) & 0xFF] ^ (crc >> 8);
+		len--;
+	}
+
+	while (len >= 8)
+	{
+		uint32_t lo, hi;
+		memcpy(&lo, src, sizeof(lo));
+		memcpy(&hi, src+4, sizeof(hi));
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+		lo = __builtin_bswap32(lo);
+		hi = __builtin_bswap32(hi);
+#endif
+
+		lo ^= crc;
+		crc = s_table[7][lo & 0xFF] ^ s_table[6][(lo >> 8) & 0xFF] ^
+			s_table[5][(lo >> 16) & 0xFF] ^ s_table[4][lo >> 24] ^
+			s_table[3][hi & 0xFF] ^ s_table[2][(hi >> 8) & 0xFF] ^
+			s_table[1][(hi >> 16) & 0xFF] ^ s_table[0][hi >> 24];
+		src += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = s_table[0][(crc ^ *src++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *src = (const unsigned char*)buf;
+
+#if !CRC32C_CTOR && defined(_WIN32)
+	InitOnceExecuteOnce(&s_once, &crc32c_init_once, NULL, NULL);
+#elif !CRC32C_CTOR
+	pthread_once(&s_once, &crc32c_init);
+#endif
+
+#if CRC32C_SSE42 || CRC32C_ARM
+	if (s_hw)
+		return ~crc32c_hw(~crc, src, len);
+#endif
+
+	return ~crc32c_sw(~crc, src, len);
+}
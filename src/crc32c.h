@@ -0,0 +1,12 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli) as used by iSCSI, ext4, etc. Pass the previous
+// result as 'crc' to checksum non-contiguous data, starting with zero.
+
+extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define LAST_LITERALS 5		// the block must end with these...
+#define MATCH_LIMIT 12		// ...so no match starts this near the end
+#define SKIP_SHIFT 6		// go faster through incompressible data
+
+// A sequence is a token (literal run length in the high nibble, match
+// length less MIN_MATCH in the low), more length bytes if 15, the
+// literals, a 2-byte little-endian offset, and more length bytes if
+// 15. The last sequence is just literals.
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *dst, size_t len)
+{
+	while (len >= 255)
+	{
+		*dst++ = 255;
+		len -= 255;
+	}
+
+	*dst++ = (uint8_t)len;
+	return dst;
+}
+
+static uint8_t *put_sequence(uint8_t *dst, const uint8_t *end, const uint8_t *lit, size_t nlit, unsigned off, size_t mlen)
+{
+	size_t need = 1 + nlit/255 + 1 + nlit + (off ? 2 + mlen/255 + 1 : 0);
+
+	if (need > (size_t)(end - dst))
+		return NULL;
+
+	uint8_t *token = dst++;
+	*token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+
+	if (nlit >= 15)
+		dst = put_length(dst, nlit - 15);
+
+	memcpy(dst, lit, nlit);
+	dst += nlit;
+
+	if (!off)
+		return dst;
+
+	*dst++ = (uint8_t)off;
+	*dst++ = (uint8_t)(off >> 8);
+	mlen -= MIN_MATCH;
+	*token |= (uint8_t)(mlen < 15 ? mlen : 15);
+
+	if (mlen >= 15)
+		dst = put_length(dst, mlen - 15);
+
+	return dst;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t max)
+{
+	const uint8_t *base = (const uint8_t*)src, *ip = base, *anchor = base;
+	const uint8_t *end = base + len;
+	uint8_t *op = (uint8_t*)dst, *oend = op + max;
+
+	if (len > MATCH_LIMIT)
+	{
+		uint32_t table[1 << HASH_BITS];
+		const uint8_t *mflimit = end - MATCH_LIMIT, *mlimit = end - LAST_LITERALS;
+		unsigned misses = 0;
+		memset(table, 0, sizeof(table));
+		ip++;
+
+		while (ip < mflimit)
+		{
+			uint32_t seq = read32(ip);
+			unsigned h = hash(seq);
+			const uint8_t *ref = base + table[h];
+			table[h] = (uint32_t)(ip - base);
+
+			if ((ref >= ip) || ((ip - ref) > MAX_OFFSET) || (read32(ref) != seq))
+			{
+				ip += 1 + (misses++ >> SKIP_SHIFT);
+				continue;
+			}
+
+			misses = 0;
+
+			// Extend forwards and then back...
+
+			const uint8_t *m = ip + MIN_MATCH, *r = ref + MIN_MATCH;
+
+			while ((m < mlimit) && (*m == *r))
+				m++, r++;
+
+			while ((ip > anchor) && (ref > base) && (ip[-1] == ref[-1]))
+				ip--, ref--;
+
+			if (!(op = put_sequence(op, oend, anchor, ip - anchor, (unsigned)(ip - ref), m - ip)))
+				return 0;
+
+			anchor = ip = m;
+		}
+	}
+
+	if (!(op = put_sequence(op, oend, anchor, end - anchor, 0, 0)))
+		return 0;
+
+	return op - (uint8_t*)dst;
+}
+
+static int get_length(const uint8_t **src, const uint8_t *end, size_t *len)
+{
+	unsigned b;
+
+	do
+	{
+		if (*src >= end)
+			return 0;
+
+		b = *(*src)++;
+		*len += b;
+	}
+	 while (b == 255);
+
+	return 1;
+}
+
+size_t lz_decompress(const void *src, size_t len, void *dst, size_t max)
+{
+	const uint8_t *ip = (const uint8_t*)src, *iend = ip + len;
+	uint8_t *base = (uint8_t*)dst, *op = base, *oend = base + max;
+
+	while (ip < iend)
+	{
+		unsigned token = *ip++;
+		size_t nlit = token >> 4;
+
+		if ((nlit == 15) && !get_length(&ip, iend, &nlit))
+			return 0;
+
+		if ((nlit > (size_t)(iend - ip)) || (nlit > (size_t)(oend - op)))
+			return 0;
+
+		memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+
+		if (ip == iend)
+			break;
+
+		if ((iend - ip) < 2)
+			return 0;
+
+		size_t off = ip[0] | (ip[1] << 8);
+		size_t mlen = token & 15;
+		ip += 2;
+
+		if ((mlen == 15) && !get_length(&ip, iend, &mlen))
+			return 0;
+
+		mlen += MIN_MATCH;
+
+		if (!off || (off > (size_t)(op - base)) || (mlen > (size_t)(oend - op)))
+			return 0;
+
+		const uint8_t *ref = op - off;
+
+		if (off >= mlen)
+		{
+			memcpy(op, ref, mlen);
+			op += mlen;
+		}
+		else
+		{
+			while (mlen--)
+				*op++ = *ref++;
+		}
+	}
+
+	return op - base;
+}
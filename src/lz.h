@@ -0,0 +1,20 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+// A fast LZ77 compressor in the manner of LZ4 (its block format, in
+// fact): byte-aligned literal runs and matches within 64KB, found by
+// hashing 4-byte sequences. Favours speed over ratio.
+
+// The most a compressed 'len' bytes can take.
+
+#define LZ_BOUND(len) ((len) + (len)/255 + 16)
+
+// Both return the number of bytes written to 'dst', or zero if it
+// would not fit in 'max' (or the input is corrupt).
+
+extern size_t lz_compress(const void *src, size_t len, void *dst, size_t max);
+extern size_t lz_decompress(const void *src, size_t len, void *dst, size_t max);
+
+#endif
@@ -131,7 +131,7 @@ struct handler_
 	struct pollfd rpollfds[FD_POLLSIZE];
 #endif
 	void *ctx;
-	int cnt, hi, fd, threads, uncs;
+	int cnt, hi, fd, threads, uncs, waiting;
 	volatile int halt, use;
 };
 
@@ -1237,6 +1237,7 @@ static int handler_accept(handler *h, server *srv, session **v)
 	s->src = s->srcbuf;
 	s->f = srv->f;
 	s->v = srv->v;
+	sl_init(&s->stash, 0, &strcmp, &free);
 	*v = s;
 
 	if (srv->ssl)
@@ -1773,15 +1774,19 @@ int handler_wait_select(handler *h)
 
 int handler_wait(handler *h)
 {
+	int ok;
+	atomic_inc(&h->waiting);
 #if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__bsdi__)
-	return handler_wait_kqueue(h);
+	ok = handler_wait_kqueue(h);
 #elif defined(__linux__)
-	return handler_wait_epoll(h);
+	ok = handler_wait_epoll(h);
 #elif defined(POLLIN) && WANT_POLL
-	return handler_wait_poll(h);
+	ok = handler_wait_poll(h);
 #else
-	return handler_wait_select(h);
+	ok = handler_wait_select(h);
 #endif
+	atomic_dec(&h->waiting);
+	return ok;
 }
 
 int handler_set_tls(handler *h, const char *keyfile)
@@ -2171,6 +2176,11 @@ int handler_destroy(handler *h)
 	msleep(100);
 	int i;
 
+	// Waiting in another thread...
+
+	while (h->waiting)
+		msleep(10);
+
 	for (i = 0; i < h->uncs; i++)
 		uncle_destroy(h->u[i]);
 
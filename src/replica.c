@@ -0,0 +1,506 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "base64.h"
+#include "thread.h"
+#include "replica.h"
+
+// The protocol is line-based. A replica opens with:
+//
+//    REPLICATE <epoch> <pos>
+//
+// The primary answers with its own epoch and then streams:
+//
+//    @ <epoch>
+//    + <uuid> <len> <base64>		(add)
+//    - <uuid> <len> [<base64>]	(remove)
+//    = <pos>						(end of batch)
+//
+// and the replica answers each batch, once applied durably, with:
+//
+//    ACK <pos>
+
+#define REPLICA_BATCH (64*1024)			// bytes per write
+
+typedef struct feed_ feed;
+
+struct feed_
+{
+	feed *next;
+	replica *r;
+	session *s;
+	store_cursor *c;
+	lock *lk;
+	char *buf;
+	size_t len, size;
+	uint64_t acked;
+	int refs, stop, done;
+};
+
+struct replica_
+{
+	store *st;
+	uuid epoch;
+	uint64_t pos;
+	hstore *h;
+	feed *feeds;
+	lock *lk;
+	event *ev;
+};
+
+// A feed is shared by its feeder thread and its session, the last
+// to let go of it frees it.
+
+static void replica_unfeed(feed *fd, int done)
+{
+	replica *r = fd->r;
+	lock_lock(r->lk);
+
+	if (done)
+	{
+		fd->done = 1;
+		event_signal(r->ev);
+	}
+
+	if (--fd->refs)
+	{
+		lock_unlock(r->lk);
+		return;
+	}
+
+	feed **prev = &r->feeds;
+
+	while (*prev && (*prev != fd))
+		prev = &(*prev)->next;
+
+	if (*prev)
+		*prev = fd->next;
+
+	lock_unlock(r->lk);
+	lock_destroy(fd->lk);
+	free(fd->buf);
+	free(fd);
+}
+
+// Writing stops for good once the session has gone.
+
+static int replica_send(feed *fd)
+{
+	int ok = 1;
+	lock_lock(fd->lk);
+
+	if (fd->stop)
+		ok = 0;
+	else if (fd->len)
+		ok = session_write(fd->s, fd->buf, fd->len) > 0;
+
+	lock_unlock(fd->lk);
+	fd->len = 0;
+	return ok;
+}
+
+static int replica_append(feed *fd, const char *src, size_t len)
+{
+	if ((fd->len+len+1) > fd->size)
+	{
+		size_t size = (fd->len+len+1) * 2;
+		char *tmp = (char*)realloc(fd->buf, size);
+
+		if (!tmp)
+			return 0;
+
+		fd->buf = tmp;
+		fd->size = size;
+	}
+
+	memcpy(fd->buf+fd->len, src, len);
+	fd->len += len;
+	return 1;
+}
+
+static int replica_record(void *p1, const uuid *u, const void *buf, int len)
+{
+	feed *fd = (feed*)p1;
+	char tmpbuf[256], tmpbuf2[256];
+	size_t nbytes = len < 0 ? -len : len;
+	sprintf(tmpbuf, "%c %s %u ", len <= 0 ? '-' : '+', uuid_to_string(u, tmpbuf2), (unsigned)nbytes);
+
+	if (!replica_append(fd, tmpbuf, strlen(tmpbuf)))
+		return 0;
+
+	if (nbytes)
+	{
+		char *dst = (char*)malloc(((nbytes+2)/3)*4+1);
+
+		if (!dst)
+			return 0;
+
+		format_base64((const char*)buf, nbytes, &dst, 0, 0);
+		int ok = replica_append(fd, dst, strlen(dst));
+		free(dst);
+
+		if (!ok)
+			return 0;
+	}
+
+	if (!replica_append(fd, "\n", 1))
+		return 0;
+
+	if (fd->len < REPLICA_BATCH)
+		return 1;
+
+	return replica_send(fd);
+}
+
+static int replica_feed(void *data)
+{
+	feed *fd = (feed*)data;
+	char tmpbuf[256];
+
+	while (!fd->stop)
+	{
+		int n = store_tail_next(fd->c, 100, &replica_record, fd);
+
+		if (n < 0)
+			break;
+
+		if (!n)
+			continue;
+
+		sprintf(tmpbuf, "= %llu\n", (unsigned long long)store_tail_pos(fd->c));
+
+		if (!replica_append(fd, tmpbuf, strlen(tmpbuf)) || !replica_send(fd))
+			break;
+	}
+
+	store_tail_close(fd->c);
+	replica_unfeed(fd, 1);
+	return 1;
+}
+
+static feed *replica_start(replica *r, session *s, const char *msg)
+{
+	char tmpbuf[256];
+	unsigned long long pos = 0;
+	uuid epoch = {0};
+
+	if (sscanf(msg, "%*s %255s %llu", tmpbuf, &pos) == 2)
+		uuid_from_string(tmpbuf, &epoch);
+
+	feed *fd = (feed*)calloc(1, sizeof(feed));
+
+	if (!fd)
+		return NULL;
+
+	// Positions are only good for as long as the store is open.
+
+	if (pos && !uuid_compare(&epoch, &r->epoch))
+		fd->c = store_tail_open2(r->st, pos);
+
+	if (!fd->c)
+	{
+		uuid u = {0};
+		fd->c = store_tail_open(r->st, &u);
+	}
+
+	if (!fd->c)
+	{
+		free(fd);
+		return NULL;
+	}
+
+	fd->r = r;
+	fd->s = s;
+	fd->lk = lock_create();
+	fd->refs = 2;				// feeder & session
+	sprintf(tmpbuf, "@ ");
+	uuid_to_string(&r->epoch, tmpbuf+2);
+	strcat(tmpbuf, "\n");
+	replica_append(fd, tmpbuf, strlen(tmpbuf));
+
+	lock_lock(r->lk);
+	fd->next = r->feeds;
+	r->feeds = fd;
+	lock_unlock(r->lk);
+
+	if (!thread_run(&replica_feed, fd))
+	{
+		store_tail_close(fd->c);
+		fd->refs = 1;
+		replica_unfeed(fd, 0);
+		return NULL;
+	}
+
+	return fd;
+}
+
+int replica_handler(session *s, void *p1)
+{
+	replica *r = (replica*)p1;
+	feed *fd = (feed*)(size_t)session_get_udata_int(s);
+
+	if (session_on_connect(s))
+		return 1;
+
+	if (session_on_disconnect(s))
+	{
+		if (fd)
+		{
+			lock_lock(fd->lk);
+			fd->stop = 1;
+			lock_unlock(fd->lk);
+			replica_unfeed(fd, 0);
+		}
+
+		return 0;
+	}
+
+	char *msg;
+
+	if (!session_readmsg(s, &msg))
+		return 0;
+
+	if (!strncmp(msg, "REPLICATE ", 10) && !fd)
+	{
+		if (!(fd = replica_start(r, s, msg)))
+			return 0;
+
+		session_set_udata_int(s, (size_t)fd);
+	}
+	else if (!strncmp(msg, "ACK ", 4) && fd)
+		fd->acked = strtoull(msg+4, NULL, 10);
+
+	return 1;
+}
+
+static int replica_apply(replica *r, const char *msg)
+{
+	char tmpbuf[256];
+	unsigned len = 0;
+	int n = 0;
+	uuid u;
+
+	if (strlen(msg) <= 2)
+		return 0;
+
+	if (sscanf(msg+2, "%255s %u %n", tmpbuf, &len, &n) < 2)
+		return 0;
+
+	if ((*msg == '+') && !len)
+		return 0;
+
+	uuid_from_string(tmpbuf, &u);
+	const char *src = msg+2+n;
+	size_t nbytes = strcspn(src, "\r\n");
+	char *dst = NULL;
+
+	if (len)
+	{
+		if (!(dst = (char*)malloc((nbytes/4+1)*3+1)))
+			return 0;
+
+		if (parse_base64(src, nbytes, &dst) != len)
+		{
+			free(dst);
+			return 0;
+		}
+	}
+
+	if (!r->h && !(r->h = store_begin(r->st)))
+	{
+		free(dst);
+		return 0;
+	}
+
+	int ok;
+
+	if (*msg == '+')
+		ok = store_hadd(r->h, &u, dst, len);
+	else if (len)
+		ok = store_hrem2(r->h, &u, dst, len);
+	else
+		ok = store_hrem(r->h, &u);
+
+	free(dst);
+	return ok;
+}
+
+static int replica_follower(session *s, void *p1)
+{
+	replica *r = (replica*)p1;
+
+	if (session_on_disconnect(s))
+	{
+		if (r->h)
+			store_cancel(r->h);
+
+		r->h = NULL;
+		return 0;
+	}
+
+	char *msg;
+
+	if (!session_readmsg(s, &msg))
+		return 0;
+
+	if (strlen(msg) <= 2)
+		printf("replica: bad message: %.40s\n", msg);
+	else if (*msg == '@')
+		uuid_from_string(msg+2, &r->epoch);
+	else if ((*msg == '+') || (*msg == '-'))
+	{
+		// Rather than acknowledge a batch missing a record, drop it
+		// and the connection, to resume from the last acknowledged...
+
+		if (!replica_apply(r, msg))
+		{
+			printf("replica: apply failed: %.40s\n", msg);
+
+			if (r->h)
+				store_cancel(r->h);
+
+			r->h = NULL;
+			return 0;
+		}
+	}
+	else if (*msg == '=')
+	{
+		uint64_t pos = strtoull(msg+2, NULL, 10);
+
+		if (r->h && !store_end(r->h, 1))
+		{
+			printf("replica: commit failed, pos=%llu\n", (unsigned long long)pos);
+			r->h = NULL;
+			return 0;
+		}
+
+		r->h = NULL;
+		r->pos = pos;
+		char tmpbuf[256];
+		sprintf(tmpbuf, "ACK %llu\n", (unsigned long long)pos);
+		return session_writemsg(s, tmpbuf) > 0;
+	}
+
+	return 1;
+}
+
+int replica_follow(handler *h, replica *r, const char *host, unsigned short port, int ssl)
+{
+	if (!h || !r || !host)
+		return 0;
+
+	session *s = session_open(host, port, 1, ssl);
+
+	if (!s)
+		return 0;
+
+	char tmpbuf[256], tmpbuf2[256];
+	sprintf(tmpbuf, "REPLICATE %s %llu\n", uuid_to_string(&r->epoch, tmpbuf2), (unsigned long long)r->pos);
+
+	if (session_writemsg(s, tmpbuf) <= 0)
+	{
+		session_close(s);
+		return 0;
+	}
+
+	handler_add_client(h, &replica_follower, r, s);
+	return 1;
+}
+
+uint64_t replica_position(replica *r)
+{
+	if (!r)
+		return 0;
+
+	if (!r->feeds)
+		return r->pos;
+
+	uint64_t pos = 0;
+	int first = 1;
+	lock_lock(r->lk);
+	feed *fd;
+
+	for (fd = r->feeds; fd; fd = fd->next)
+	{
+		if (fd->stop || fd->done)
+			continue;
+
+		if (first || (fd->acked < pos))
+			pos = fd->acked;
+
+		first = 0;
+	}
+
+	lock_unlock(r->lk);
+	return pos;
+}
+
+replica *replica_create(store *st)
+{
+	if (!st)
+		return NULL;
+
+	replica *r = (replica*)calloc(1, sizeof(replica));
+
+	if (!r)
+		return NULL;
+
+	r->st = st;
+	r->lk = lock_create();
+	r->ev = event_create();
+	uuid_gen(&r->epoch);
+	return r;
+}
+
+void replica_destroy(replica *r)
+{
+	if (!r)
+		return;
+
+	feed *fd;
+	lock_lock(r->lk);
+
+	for (fd = r->feeds; fd; fd = fd->next)
+	{
+		lock_lock(fd->lk);
+		fd->stop = 1;
+		lock_unlock(fd->lk);
+	}
+
+	lock_unlock(r->lk);
+
+	// The handler is gone, so only the feeders are left to finish.
+
+	for (;;)
+	{
+		unsigned seq = event_count(r->ev);
+		int busy = 0;
+		lock_lock(r->lk);
+
+		for (fd = r->feeds; fd; fd = fd->next)
+			busy += !fd->done;
+
+		lock_unlock(r->lk);
+
+		if (!busy)
+			break;
+
+		event_wait(r->ev, seq, 100);
+	}
+
+	while ((fd = r->feeds) != NULL)
+	{
+		r->feeds = fd->next;
+		lock_destroy(fd->lk);
+		free(fd->buf);
+		free(fd);
+	}
+
+	if (r->h)
+		store_cancel(r->h);
+
+	event_destroy(r->ev);
+	lock_destroy(r->lk);
+	free(r);
+}
@@ -0,0 +1,45 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+// Log-shipping replication of a store. A primary streams committed
+// records, in batches, to each replica that connects. A replica
+// applies each batch to its own store as a single durable
+// transaction (so its tree and any tail readers follow along) and
+// then acknowledges the position reached. On reconnecting it resumes
+// from there, or from the start if the primary has since re-opened.
+//
+// Primary:
+//
+//    replica *r = replica_create(st);
+//    handler_add_server(h, &replica_handler, r, NULL, port, 1, 0, NULL);
+//
+// Replica:
+//
+//    replica *r = replica_create(st2);
+//    replica_follow(h2, r, "primary", port, 0);
+//
+// Destroy a replica only after its handler.
+
+#include <stdint.h>
+
+#include "network.h"
+#include "store.h"
+
+#define REPLICA_DEFAULT_PORT 7070
+
+typedef struct replica_ replica;
+
+extern replica *replica_create(store *st);
+extern int replica_follow(handler *h, replica *r, const char *host, unsigned short port, int ssl);
+
+// The durable position: on a primary the lowest acknowledged by any
+// connected replica (zero if none), on a replica the last applied.
+
+extern uint64_t replica_position(replica *r);
+extern void replica_destroy(replica *r);
+
+// The primary's session handler...
+
+extern int replica_handler(session*, void*);
+
+#endif
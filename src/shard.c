@@ -0,0 +1,672 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(p1,p2) _mkdir(p1)
+#endif
+
+#include "thread.h"
+#include "shard.h"
+
+#define INTENT_DIR "intent"
+#define SHARDS_FILE "shards"
+
+typedef char string[1024];
+
+// Intents still present on open, ie. not known to be complete.
+
+typedef struct intent_ intent;
+
+struct intent_
+{
+	intent *next;
+	uuid u;
+	size_t len;
+	char data[1];
+};
+
+struct shard_
+{
+	store *st[SHARD_MAX], *intent;
+	void (*f)(void*,const uuid*,const void*,int);
+	void *p1;
+	intent *pending;
+	uint64_t seq;
+	int n, loaded;
+};
+
+typedef struct
+{
+	uuid u;
+	unsigned rm, len;
+	const char *data;
+}
+ sh_item;
+
+struct hshard_
+{
+	shard *sh;
+	sh_item *items;
+	int cnt, max;
+};
+
+// An intent is the write set of a transaction, in order, each item
+// framed by this header. Its key, with a zero timestamp, is also
+// that of the marker left on each shard once committed there.
+
+typedef struct
+{
+	uint32_t rm, len;
+	uuid u;
+}
+ intent_hdr;
+
+static const char s_marker[] = "1";
+
+static uint64_t shard_hash(const uuid *u)
+{
+	uint64_t h = (u->u1 * 0x9E3779B97F4A7C15ULL) ^ u->u2;
+	return h ^ (h >> 29);
+}
+
+int shard_of(const shard *sh, const uuid *u)
+{
+	if (!sh || !u)
+		return -1;
+
+	return (int)(((shard_hash(u) >> 32) * sh->n) >> 32);
+}
+
+store *shard_store(shard *sh, int i)
+{
+	if (!sh || (i < 0) || (i >= sh->n))
+		return NULL;
+
+	return sh->st[i];
+}
+
+static void shard_callback(void *p1, const uuid *u, const void *buf, int len)
+{
+	shard *sh = (shard*)p1;
+
+	if (!u->u1)
+		return;
+
+	sh->f(sh->p1, u, buf, len);
+}
+
+int shard_get(const shard *sh, const uuid *u, void **buf, size_t *len)
+{
+	if (!sh || !u)
+		return 0;
+
+	return store_get(sh->st[shard_of(sh, u)], u, buf, len);
+}
+
+int shard_add(shard *sh, const uuid *u, const void *buf, size_t len)
+{
+	if (!sh || !u)
+		return 0;
+
+	return store_add(sh->st[shard_of(sh, u)], u, buf, len);
+}
+
+int shard_rem(shard *sh, const uuid *u)
+{
+	if (!sh || !u)
+		return 0;
+
+	return store_rem(sh->st[shard_of(sh, u)], u);
+}
+
+int shard_rem2(shard *sh, const uuid *u, const void *buf, size_t len)
+{
+	if (!sh || !u)
+		return 0;
+
+	return store_rem2(sh->st[shard_of(sh, u)], u, buf, len);
+}
+
+unsigned long shard_count(const shard *sh)
+{
+	unsigned long cnt = 0;
+	int i;
+
+	for (i = 0; sh && (i < sh->n); i++)
+		cnt += store_count(sh->st[i]);
+
+	return cnt;
+}
+
+hshard *shard_begin(shard *sh)
+{
+	if (!sh)
+		return 0;
+
+	hshard *h = (hshard*)calloc(1, sizeof(struct hshard_));
+
+	if (!h)
+		return 0;
+
+	h->sh = sh;
+	return h;
+}
+
+static void shard_hfree(hshard *h)
+{
+	int i;
+
+	for (i = 0; i < h->cnt; i++)
+		free((char*)h->items[i].data);
+
+	free(h->items);
+	free(h);
+}
+
+static int shard_hrecord(hshard *h, const uuid *u, unsigned rm, const void *buf, size_t len)
+{
+	if (h->cnt == h->max)
+	{
+		int max = h->max ? h->max*2 : 16;
+		sh_item *tmp = (sh_item*)realloc(h->items, max*sizeof(sh_item));
+
+		if (!tmp)
+			return 0;
+
+		h->items = tmp;
+		h->max = max;
+	}
+
+	sh_item *item = &h->items[h->cnt];
+	char *data = NULL;
+
+	if (buf && len)
+	{
+		if (!(data = (char*)malloc(len)))
+			return 0;
+
+		memcpy(data, buf, len);
+	}
+
+	item->u = *u;
+	item->rm = rm;
+	item->len = buf ? len : 0;
+	item->data = data;
+	h->cnt++;
+	return 1;
+}
+
+int shard_hget(hshard *h, const uuid *u, void **buf, size_t *len)
+{
+	if (!h)
+		return 0;
+
+	return shard_get(h->sh, u, buf, len);
+}
+
+int shard_hadd(hshard *h, const uuid *u, const void *buf, size_t len)
+{
+	if (!h || !u || !buf || !len)
+		return 0;
+
+	return shard_hrecord(h, u, 0, buf, len);
+}
+
+int shard_hrem2(hshard *h, const uuid *u, const void *buf, size_t len)
+{
+	if (!h || !u)
+		return 0;
+
+	return shard_hrecord(h, u, 1, buf, len);
+}
+
+int shard_hrem(hshard *h, const uuid *u)
+{
+	if (!h || !u)
+		return 0;
+
+	return shard_hrecord(h, u, 1, NULL, 0);
+}
+
+int shard_cancel(hshard *h)
+{
+	if (!h)
+		return 0;
+
+	shard_hfree(h);
+	return 1;
+}
+
+// Commit to one shard those items that belong there, leaving a
+// marker if part of an intent.
+
+static int shard_apply(shard *sh, int i, const sh_item *items, int cnt, const uuid *marker, int dbsync)
+{
+	hstore *hs = store_begin(sh->st[i]);
+	int j, ok = hs != NULL;
+
+	for (j = 0; ok && (j < cnt); j++)
+	{
+		const sh_item *item = &items[j];
+
+		if (shard_of(sh, &item->u) != i)
+			continue;
+
+		if (!item->rm)
+			ok = store_hadd(hs, &item->u, item->data, item->len);
+		else if (item->data)
+			ok = store_hrem2(hs, &item->u, item->data, item->len);
+		else
+			ok = store_hrem(hs, &item->u);
+	}
+
+	if (ok && marker)
+		ok = store_hadd(hs, marker, s_marker, sizeof(s_marker)-1);
+
+	if (!ok)
+	{
+		store_cancel(hs);
+		return 0;
+	}
+
+	return store_end(hs, dbsync);
+}
+
+// The shards committed to, each once and in order. Markers go only
+// after the intent is durably gone, else a replay could follow.
+
+static int shard_complete(shard *sh, const uuid *key, const sh_item *items, int cnt)
+{
+	char touched[SHARD_MAX] = {0};
+	int i, ok = 1;
+
+	for (i = 0; i < cnt; i++)
+		touched[shard_of(sh, &items[i].u)] = 1;
+
+	for (i = 0; ok && (i < sh->n); i++)
+	{
+		if (!touched[i])
+			continue;
+
+		void *buf = NULL;
+		size_t len = 0;
+
+		if (store_get(sh->st[i], key, &buf, &len) > 0)
+		{
+			free(buf);
+			continue;
+		}
+
+		ok = shard_apply(sh, i, items, cnt, key, 1);
+	}
+
+	if (!ok)
+		return 0;
+
+	hstore *hs = store_begin(sh->intent);
+
+	if (!store_hrem(hs, key))
+	{
+		store_cancel(hs);
+		return 0;
+	}
+
+	store_end(hs, 1);
+
+	for (i = 0; i < sh->n; i++)
+	{
+		if (touched[i])
+			store_rem(sh->st[i], key);
+	}
+
+	return 1;
+}
+
+static int shard_encode(const hshard *h, char **buf, size_t *len)
+{
+	size_t nbytes = 0;
+	int i;
+
+	for (i = 0; i < h->cnt; i++)
+		nbytes += sizeof(intent_hdr) + h->items[i].len;
+
+	char *dst = *buf = (char*)malloc(nbytes);
+
+	if (!dst)
+		return 0;
+
+	for (i = 0; i < h->cnt; i++)
+	{
+		const sh_item *item = &h->items[i];
+		intent_hdr hdr;
+		hdr.rm = item->rm | (item->data ? 0 : 2);
+		hdr.len = item->len;
+		hdr.u = item->u;
+		memcpy(dst, &hdr, sizeof(intent_hdr));
+		dst += sizeof(intent_hdr);
+
+		if (item->len)
+			memcpy(dst, item->data, item->len);
+
+		dst += item->len;
+	}
+
+	*len = nbytes;
+	return 1;
+}
+
+// The items point into the intent itself.
+
+static int shard_decode(const char *buf, size_t len, sh_item **items)
+{
+	const char *src = buf, *end = buf + len;
+	int cnt = 0, max = 0;
+	*items = NULL;
+
+	while ((end - src) >= sizeof(intent_hdr))
+	{
+		intent_hdr hdr;
+		memcpy(&hdr, src, sizeof(intent_hdr));
+		src += sizeof(intent_hdr);
+
+		if ((end - src) < hdr.len)
+			break;
+
+		if (cnt == max)
+		{
+			max = max ? max*2 : 16;
+			sh_item *tmp = (sh_item*)realloc(*items, max*sizeof(sh_item));
+			if (!tmp) break;
+			*items = tmp;
+		}
+
+		sh_item *item = &(*items)[cnt++];
+		item->u = hdr.u;
+		item->rm = hdr.rm & 1;
+		item->len = hdr.len;
+		item->data = hdr.rm & 2 ? NULL : src;
+		src += hdr.len;
+	}
+
+	return cnt;
+}
+
+int shard_end(hshard *h, int dbsync)
+{
+	if (!h)
+		return 0;
+
+	shard *sh = h->sh;
+	int i, first = -1, ok = 1;
+
+	for (i = 0; i < h->cnt; i++)
+	{
+		int idx = shard_of(sh, &h->items[i].u);
+
+		if (first < 0)
+			first = idx;
+		else if (idx != first)
+			break;
+	}
+
+	if (first < 0)
+		;
+	else if (i == h->cnt)
+		ok = shard_apply(sh, first, h->items, h->cnt, NULL, dbsync);
+	else
+	{
+		char *buf = NULL;
+		size_t len = 0;
+		uuid key = uuid_set(0, atomic_addu64(&sh->seq, 1));
+		hstore *hs = store_begin(sh->intent);
+		ok = hs && shard_encode(h, &buf, &len) && store_hadd(hs, &key, buf, len);
+		free(buf);
+
+		if (!ok)
+			store_cancel(hs);
+		else if (store_end(hs, 1))
+			ok = shard_complete(sh, &key, h->items, h->cnt);
+		else
+			ok = 0;
+	}
+
+	shard_hfree(h);
+	return ok;
+}
+
+static void shard_intent(void *p1, const uuid *u, const void *buf, int len)
+{
+	shard *sh = (shard*)p1;
+
+	if (sh->loaded)
+		return;
+
+	intent **prev = &sh->pending;
+
+	while (*prev && uuid_compare(&(*prev)->u, u))
+		prev = &(*prev)->next;
+
+	if (*prev)
+	{
+		intent *tmp = *prev;
+		*prev = tmp->next;
+		free(tmp);
+	}
+
+	if (u->u2 > sh->seq)
+		sh->seq = u->u2;
+
+	if ((len <= 0) || !buf)
+		return;
+
+	intent *in = (intent*)malloc(sizeof(intent)+len);
+
+	if (!in)
+		return;
+
+	in->u = *u;
+	in->len = len;
+	memcpy(in->data, buf, len);
+	in->next = sh->pending;
+	sh->pending = in;
+}
+
+typedef struct
+{
+	shard *sh;
+	const char *path;
+	int flags, idx;
+	event *ev;
+}
+ open_job;
+
+static int shard_open_worker(void *p1)
+{
+	open_job *job = (open_job*)p1;
+	shard *sh = job->sh;
+	sh->st[job->idx] = store_open2(job->path, NULL, job->flags, sh->f?&shard_callback:NULL, sh);
+	event_signal(job->ev);
+	return 0;
+}
+
+// The number of shards is recorded on creation.
+
+static int shard_check(const char *path, int n)
+{
+	string filename;
+
+	if (snprintf(filename, sizeof(filename), "%s/%s", path, SHARDS_FILE) >= (int)sizeof(filename))
+	{
+		printf("shard_open: '%s' path too long\n", path);
+		return 0;
+	}
+
+	FILE *fp = fopen(filename, "r");
+	int cnt = 0;
+
+	if (fp)
+	{
+		if (fscanf(fp, "%d", &cnt) != 1)
+			cnt = 0;
+
+		fclose(fp);
+	}
+
+	if (cnt)
+		return cnt == n;
+
+	if (!(fp = fopen(filename, "w")))
+		return 0;
+
+	fprintf(fp, "%d\n", n);
+	fclose(fp);
+	return 1;
+}
+
+shard *shard_open2(const char *path, const char **paths, int n, int flags, void (*f)(void*,const uuid*,const void*,int), void *p1)
+{
+	if (!path || (n < 1) || (n > SHARD_MAX))
+		return NULL;
+
+	if ((mkdir(path, 0777) < 0) && (errno != EEXIST))
+	{
+		printf("shard_open: mkdir '%s' error: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (!shard_check(path, n))
+	{
+		printf("shard_open: '%s' not %d shards\n", path, n);
+		return NULL;
+	}
+
+	shard *sh = (shard*)calloc(1, sizeof(struct shard_));
+
+	if (!sh)
+		return NULL;
+
+	sh->n = n;
+	sh->f = f;
+	sh->p1 = p1;
+
+	// Recover the shards concurrently.
+
+	string *names = (string*)malloc(n*sizeof(string));
+	open_job *jobs = (open_job*)calloc(n, sizeof(open_job));
+	event *ev = event_create();
+	int i, started = 0, ok = names && jobs && ev;
+	unsigned done;
+
+	for (i = 0; ok && (i < n); i++)
+	{
+		int len;
+
+		if (paths && paths[i])
+			len = snprintf(names[i], sizeof(string), "%s", paths[i]);
+		else
+			len = snprintf(names[i], sizeof(string), "%s/%d", path, i);
+
+		if (len >= (int)sizeof(string))
+		{
+			printf("shard_open: shard %d path too long\n", i);
+			ok = 0;
+		}
+	}
+
+	for (i = 0; ok && (i < n); i++)
+	{
+		open_job *job = &jobs[i];
+		job->sh = sh;
+		job->path = names[i];
+		job->flags = flags;
+		job->idx = i;
+		job->ev = ev;
+
+		if (!thread_run(&shard_open_worker, job))
+			shard_open_worker(job);
+
+		started++;
+	}
+
+	// Each worker signals as its last act, so once all have the
+	// jobs and the event can go.
+
+	while ((done = event_count(ev)) < (unsigned)started)
+		event_wait(ev, done, -1);
+
+	event_destroy(ev);
+	free(jobs);
+	free(names);
+
+	for (i = 0; i < n; i++)
+	{
+		if (!sh->st[i])
+		{
+			shard_close(sh);
+			return NULL;
+		}
+	}
+
+	// Then finish any transaction that was interrupted.
+
+	string filename;
+
+	if (snprintf(filename, sizeof(filename), "%s/%s", path, INTENT_DIR) >= (int)sizeof(filename))
+	{
+		printf("shard_open: '%s' path too long\n", path);
+		shard_close(sh);
+		return NULL;
+	}
+
+	sh->seq = (uint64_t)time(NULL) << 32;
+
+	if (!(sh->intent = store_open2(filename, NULL, 0, &shard_intent, sh)))
+	{
+		shard_close(sh);
+		return NULL;
+	}
+
+	sh->loaded = 1;
+
+	while (sh->pending)
+	{
+		intent *in = sh->pending;
+		sh_item *items;
+		int cnt = shard_decode(in->data, in->len, &items);
+
+		if (!shard_complete(sh, &in->u, items, cnt))
+			printf("shard_open: intent incomplete\n");
+
+		free(items);
+		sh->pending = in->next;
+		free(in);
+	}
+
+	return sh;
+}
+
+shard *shard_open(const char *path, int n, int flags)
+{
+	return shard_open2(path, NULL, n, flags, NULL, NULL);
+}
+
+int shard_close(shard *sh)
+{
+	if (!sh)
+		return 0;
+
+	int i;
+
+	for (i = 0; i < sh->n; i++)
+		store_close(sh->st[i]);
+
+	store_close(sh->intent);
+	free(sh);
+	return 1;
+}
@@ -0,0 +1,58 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+// A store partitioned by key across a number of independent stores
+// (shards), each with its own logs, index and locks, and ideally its
+// own disk. Writers to different shards never contend. The API
+// mirrors that of the store.
+//
+// A transaction touching only one shard is just a store transaction
+// there. One touching several is first recorded durably as an intent
+// (in 'path/intent'), then committed to each shard in turn, each
+// leaving a marker, and finally the intent is removed. Should that
+// be interrupted, opening again completes it on the shards without a
+// marker. So it is atomic across a crash, but readers can see it
+// applied to one shard before another. Should a shard fail to commit
+// the intent stays, and the next open retries it.
+//
+// Keys with a zero timestamp (u1), which uuid_gen never produces,
+// are reserved for the markers.
+//
+// Shard 'i' lives in 'paths[i]', or by default 'path/i'. The number
+// of shards can't be changed once created.
+
+#include "store.h"
+
+#define SHARD_MAX 64
+
+typedef struct shard_ shard;
+typedef struct hshard_ hshard;
+
+// Open callbacks may be made from several threads at once, as the
+// shards are recovered concurrently.
+
+extern shard *shard_open(const char *path, int n, int flags);
+extern shard *shard_open2(const char *path, const char **paths, int n, int flags, void (*)(void*,const uuid*,const void*,int), void *p1);
+
+extern int shard_get(const shard *sh, const uuid *u, void **buf, size_t *len);
+extern int shard_add(shard *sh, const uuid *u, const void *buf, size_t len);
+extern int shard_rem(shard *sh, const uuid *u);
+extern int shard_rem2(shard *sh, const uuid *u, const void *buf, size_t len);
+extern unsigned long shard_count(const shard *sh);
+
+// The shard a key belongs to, and its store (eg. to tune it).
+
+extern int shard_of(const shard *sh, const uuid *u);
+extern store *shard_store(shard *sh, int i);
+
+extern hshard *shard_begin(shard *sh);
+extern int shard_hget(hshard *h, const uuid *u, void **buf, size_t *len);
+extern int shard_hadd(hshard *h, const uuid *u, const void *buf, size_t len);
+extern int shard_hrem(hshard *h, const uuid *u);
+extern int shard_hrem2(hshard *h, const uuid *u, const void *buf, size_t len);
+extern int shard_cancel(hshard *h);
+extern int shard_end(hshard *h, int dbsync);
+
+extern int shard_close(shard *sh);
+
+#endif
@@ -1,4 +1,5 @@
 #define _LARGEFILE64_SOURCE		// for 32-bit builds
+#define _GNU_SOURCE					// O_DIRECT, fallocate
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -17,6 +18,8 @@
 #else
 #include <unistd.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/param.h>
 #include <dirent.h>
@@ -24,53 +27,250 @@
 
 #ifdef _WIN32
 #define fsync _commit
+#define fdatasync _commit
 #define mkdir(p1,p2) _mkdir(p1)
 #define msleep Sleep
+#define usleep(us) Sleep(((us)+999)/1000)
 #else
 #define msleep(ms) usleep(ms*1000)
+#ifdef __APPLE__
+#define fdatasync fsync
 #endif
+#endif
+
+#define SCAN_BUFSIZE (4*1024*1024)	// parallel recovery reads
+#define MGET_GAP (64*1024)			// coalesce multi-get reads...
+#define MGET_SPAN (1024*1024)		// ...up to this much
+#define MGET_TAIL 4096				// guess at the last record's size
+#define MGET_THREADS 8
+#define CACHE_SHARDS 16				// record cache
+#define RANGE_BATCH 256				// range scan keys per batch
+#define DIO_ALIGN 4096				// direct write block size
+#define DEAD_MAX (1024*1024)		// obsolete records awaiting sizing
 
 #include "store.h"
 #include "tree.h"
 #include "thread.h"
+#include "crc32c.h"
+#include "lz.h"
 
 #define MAX_LOGFILE_SIZE (1L*1024*1024*1024)
 
-#define MAX_LOGFILES 256			// 8 bits +
-#define POS_BITS 56					// 56 bits = 64 bits
+#define MAX_LOGFILES (1<<20)		// 20 bits +
+#define POS_BITS 44					// 44 bits = 64 bits
 
 #define MAKE_FILEPOS(idx,pos) (((uint64_t)idx << POS_BITS) | POS(pos))
 #define FILEIDX(fp) (unsigned)((fp) >> POS_BITS)
-#define POS(fp) ((fp) & ~(0xffULL<<POS_BITS))
+#define POS(fp) ((fp) & ((1ULL<<POS_BITS)-1))
+
+#define SEG(st,idx) ((st)->segs->seg[idx])
 
 #define FLAG_RM		1
 #define TR_BEGIN	2
 #define TR_END		4
 #define TR_CANCEL	(TR_END|FLAG_RM)
+#define FLAG_LZ		8				// payload compressed
+
+// Records are framed by a fixed-width binary header, followed by
+// the payload. The CRC covers the header (less the CRC itself) and
+// the payload. Older text-format records ("[ nbr flags uuid len ] ")
+// are still understood when reading, and can be converted offline.
+
+#define REC_MAGIC	0xA5
+#define REC_VERSION	1
+
+typedef struct
+{
+	uint8_t magic, version;
+	uint16_t flags;
+	uint32_t nbr;
+	uuid u;
+	uint32_t len;
+	uint32_t crc;
+}
+ rec_hdr;
+
+#define REC_HDR_SIZE sizeof(rec_hdr)
+#define REC_CRC_OFFSET (REC_HDR_SIZE-sizeof(uint32_t))
 
 typedef char string[1024];
 
 #define ZEROTH_LOG "0.log"
 #define FIRST_LOG "1.log"
+#define CHECKPOINT "index.ckp"
+
+// An index checkpoint is a header, then the end-of-data position of
+// each log file (by name), then the tree as key/filepos pairs in key
+// order. The CRC covers everything after the header.
+
+#define CKP_MAGIC	0x504B4359
+#define CKP_VERSION	2
+#define CKP_WAIT	1000		// msecs to wait for transactions to finish
+
+typedef struct
+{
+	uint32_t magic, version, segments, crc;
+	uint64_t keys;
+}
+ ckp_hdr;
+
+typedef struct
+{
+	char name[256];
+	uint64_t eodpos;
+}
+ ckp_seg;
+
+typedef struct
+{
+	uuid k;
+	uint64_t v;
+}
+ ckp_key;
+
+// The record cache is split into shards by key, each with its own
+// lock, hash table, byte budget and CLOCK ring. A shard's generation
+// changes on every invalidation, so that a reader can tell whether a
+// record it just read may already be stale before caching it.
+
+typedef struct cache_entry_ cache_entry;
+
+struct cache_entry_
+{
+	cache_entry *next;
+	uuid u;
+	unsigned len, slot;
+	int ref;
+	char data[1];
+};
+
+typedef struct
+{
+	lock *lk;
+	cache_entry **buckets, **ring;
+	unsigned nbuckets, nring, maxring, hand, holes, cnt;
+	size_t bytes, budget;
+	uint64_t hits, misses, gen;
+}
+ cache_shard;
+
+// Log files, oldest first. A segment never moves once allocated, and
+// a table outgrown is kept (until closed) for readers still using it.
+
+typedef struct
+{
+	char *filename;
+	uint64_t eodpos, dead, alloc;
+	int fd, text, writers, oldfd, tailing, dfd;
+	int readers[2];
+	unsigned fdgen;
+	char measured, trim;
+	store_map *map;
+}
+ segment;
+
+typedef struct seg_table_
+{
+	struct seg_table_ *prev;
+	int size;
+	segment *seg[];
+}
+ seg_table;
 
 struct store_
 {
 	tree *tptr;
-	string filename[MAX_LOGFILES], path1, path2;
+	seg_table *segs;
+	string path1, path2;
 	void (*f)(void*,const uuid*,const void*,int);
 	void *p1;
-	uint64_t eodpos[MAX_LOGFILES];
-	int fd[MAX_LOGFILES], idx;
+	int idx;
 	int transactions, current;
+	uint64_t ckp_interval, ckp_eodpos, max_logsize;
+	long long last_log;
+	int ckp_idx, ckp_busy, ckp_wanted;
+	unsigned ckp_gen;
+	uint64_t ckp_retry;
+	event *ckp_ev;
 	lock *lk;
+
+	// Online compaction...
+
+	int compacting, cmp_pct, cmp_running;
+	uint64_t *cmp_dead;
+	size_t cmp_ndead, cmp_maxdead;
+	lock *cmp_lk;
+
+	// Group commit...
+
+	uint64_t gc_req, gc_done;
+	unsigned gc_usecs, gc_batch;
+	int gc_leader, gc_lo;
+	lock *gc_lk;
+	event *gc_ev, *gc_join;
+
+	// Sealed log files mapped for views...
+
+	thread_pool *tp;
+
+	// Write-behind (double) buffer...
+
+	char *wb[2];
+	uint64_t wb_pos[2];
+	size_t wb_len[2], wb_size, wb_alloc;
+	int wb_idx[2], wb_cur, wb_msecs, wb_running;
+	lock *wb_lk, *wb_flk;
+
+	// Record cache...
+
+	cache_shard *cache;
+	int cache_on;
+
+	// Tail cursors...
+
+	int tailers;
+	event *ev;
+
+	// Compress payloads from this size (zero for never)...
+
+	size_t lz_min;
+
+	// Preallocation and direct writes of the active log...
+
+	uint64_t prealloc;
+	int direct;
+	char *dio_buf;
+	size_t dio_size;
+	lock *dio_lk;
 };
 
+struct store_map_
+{
+	char *addr;
+	uint64_t len;
+	int refs;
+};
+
+// A transaction's write set, applied from memory on commit. The
+// payload is only kept when there is a callback to give it to.
+
+typedef struct
+{
+	uuid u;
+	uint64_t pos;
+	unsigned flags, len;
+	char *data;
+}
+ tr_item;
+
 struct hstore_
 {
 	store *st;
 	uint64_t start_pos;
-	int wait_for_write;
+	int wait_for_write, idx;
 	unsigned nbr;
+	tr_item *items;
+	int cnt, max, reread;
 };
 
 #ifdef _WIN32
@@ -167,50 +367,206 @@ static int dirlist(const char *path, const char *dotted_ext, int (*f)(void*,cons
 	return cnt;
 }
 
-static int prefix(char *buf, unsigned nbr, const uuid *u, unsigned flags, unsigned len)
+static const uuid kzero = {0};
+
+static int prefix(char *buf, unsigned nbr, const uuid *u, unsigned flags, const void *data, unsigned len)
 {
-	char tmpbuf[256];
-	return sprintf(buf, "[ %u %u %s %u ] ", nbr, flags, uuid_to_string(u, tmpbuf), len);
+	rec_hdr h;
+	h.magic = REC_MAGIC;
+	h.version = REC_VERSION;
+	h.flags = (uint16_t)flags;
+	h.nbr = nbr;
+	h.u = u ? *u : kzero;
+	h.len = len;
+	h.crc = crc32c(crc32c(0, &h, REC_CRC_OFFSET), data, data?len:0);
+	memcpy(buf, &h, REC_HDR_SIZE);
+	return REC_HDR_SIZE;
 }
 
-static int parse(const char *buf, unsigned *nbr, uuid *u, unsigned *flags, unsigned *len)
+static int verify(const rec_hdr *h, const void *data)
 {
-	char tmpbuf[256];
-	tmpbuf[0] = 0;
-	sscanf(buf, "[ %u %u %s %u ]", nbr, flags, tmpbuf, len);
-	tmpbuf[sizeof(tmpbuf)-1] = 0;
-	uuid_from_string(tmpbuf, u);
-	const char *src = buf;
+	return h->crc == crc32c(crc32c(0, h, REC_CRC_OFFSET), data, h->len);
+}
 
-	while (*src++ != ' ')		// [
-		;
+static int parse_text(const char *buf, int buflen, unsigned *nbr, uuid *u, unsigned *flags, unsigned *len)
+{
+	const char *src = buf, *end = buf + buflen;
+
+	while ((src < end) && ((*src == '\n') || (*src == '\r')))
+		src++;
 
-	while (*src++ != ' ')		// skip nbr
-		;
+	if ((src == end) || (*src != '['))
+		return 0;
 
-	while (*src++ != ' ')		// skip flags
-		;
+	char tmpbuf[256], line[256];
+	int n = end - src < sizeof(line)-1 ? end - src : sizeof(line)-1;
+	memcpy(line, src, n);
+	line[n] = 0;
+	n = 0;
 
-	while (*src++ != ' ')		// skip uuid
-		;
+	if ((sscanf(line, "[ %u %u %255s %u ]%n", nbr, flags, tmpbuf, len, &n) != 4) || !n)
+		return 0;
 
-	while (*src++ != ' ')		// skip len
-		;
+	uuid_from_string(tmpbuf, u);
+	src += n;
 
-	src++;						// skip ]
-	src++;						// skip SPACE or NL
+	if ((src < end) && ((*src == ' ') || (*src == '\n')))
+		src++;						// skip SPACE or NL
 
 	return src-buf;
 }
 
+// Decode a record header in either format, returning the number
+// of bytes it occupies or zero if there is no valid header.
+
+static int parse(const char *buf, int buflen, unsigned *nbr, uuid *u, unsigned *flags, unsigned *len, rec_hdr *h)
+{
+	if (buflen <= 0)
+		return 0;
+
+	if ((unsigned char)buf[0] != REC_MAGIC)
+	{
+		if (h) h->magic = 0;
+		return parse_text(buf, buflen, nbr, u, flags, len);
+	}
+
+	rec_hdr tmp;
+
+	if (!h)
+		h = &tmp;
+
+	if (buflen < REC_HDR_SIZE)
+		return 0;
+
+	memcpy(h, buf, REC_HDR_SIZE);
+
+	if (h->version != REC_VERSION)
+		return 0;
+
+	*nbr = h->nbr;
+	*u = h->u;
+	*flags = h->flags;
+	*len = h->len;
+	return REC_HDR_SIZE;
+}
+
+// Return the payload following a header, either from what has
+// already been read into 'tmpbuf' (which must have room for a
+// trailing NUL) or allocated and read separately if big.
+
+static char *payload(int fd, char *tmpbuf, int nread, int skip, unsigned nbytes, uint64_t pos, int *big)
+{
+	char *src = tmpbuf+skip;
+	*big = 0;
+
+	if ((skip+nbytes) > nread)
+	{
+		*big = 1;
+		src = (char*)malloc(nbytes+1);
+
+		if (!src)
+			return NULL;
+
+		if (pread(fd, src, nbytes, pos+skip) != nbytes)
+		{
+			free(src);
+			return NULL;
+		}
+	}
+
+	src[nbytes] = 0;
+	return src;
+}
+
+// A compressed payload is the original length, then the compressed
+// data. Only worth it if that is smaller. Returns the flag to mark
+// it with, with what to write instead (to be freed) in 'tmp'.
+
+static unsigned store_deflate(const store *st, const void **buf, size_t *len, char **tmp)
+{
+	*tmp = NULL;
+
+	if (!st->lz_min || !*buf || (*len < st->lz_min))
+		return 0;
+
+	uint32_t raw = (uint32_t)*len;
+	char *dst = (char*)malloc(sizeof(raw)+LZ_BOUND(*len));
+
+	if (!dst)
+		return 0;
+
+	size_t n = lz_compress(*buf, *len, dst+sizeof(raw), *len-sizeof(raw)-1);
+
+	if (!n)
+	{
+		free(dst);
+		return 0;
+	}
+
+	memcpy(dst, &raw, sizeof(raw));
+	*buf = *tmp = dst;
+	*len = sizeof(raw) + n;
+	return FLAG_LZ;
+}
+
+// Once its CRC is checked, expand a compressed payload into a
+// buffer of its own, which replaces 'src' (freeing it if 'big').
+// The original length is returned in 'len'.
+
+static char *store_inflate(unsigned flags, char *src, unsigned nbytes, unsigned *len, int *big)
+{
+	*len = nbytes;
+
+	if (!(flags & FLAG_LZ) || !src)
+		return src;
+
+	uint32_t raw = 0;
+	char *dst = NULL;
+
+	if (nbytes > sizeof(raw))
+		memcpy(&raw, src, sizeof(raw));
+
+	if (raw && (raw <= STORE_MAX_WRITELEN))
+		dst = (char*)malloc(raw+1);
+
+	if (dst && (lz_decompress(src+sizeof(raw), nbytes-sizeof(raw), dst, raw) != raw))
+	{
+		free(dst);
+		dst = NULL;
+	}
+
+	if (*big)
+		free(src);
+
+	*big = 1;
+
+	if (!dst)
+	{
+		printf("store_inflate failed invalid data\n");
+		return NULL;
+	}
+
+	dst[raw] = 0;
+	*len = raw;
+	return dst;
+}
+
+void store_set_compress(store *st, size_t nbytes)
+{
+	if (!st)
+		return;
+
+	st->lz_min = nbytes > sizeof(uint32_t) ? nbytes : nbytes ? sizeof(uint32_t)+1 : 0;
+}
+
 unsigned long store_count(const store *st)
 {
 	return tree_count(st->tptr);
 }
 
-static int store_write2(store *st, const void *buf, size_t len, const void *buf2, size_t len2, uint64_t pos)
+static long pwrite2(int fd, const void *buf, size_t len, const void *buf2, size_t len2, uint64_t pos)
 {
-	int wlen;
+	long wlen;
 
 #ifdef _WIN32
 	size_t nbytes = len + len2;
@@ -220,12 +576,12 @@ static int store_write2(store *st, const void *buf, size_t len, const void *buf2
 	{
 		memcpy(tmpbuf, buf, len);
 		memcpy(tmpbuf+len, buf2, len2);
-		wlen = (size_t)pwrite(st->fd[st->idx-1], tmpbuf, (size_t)nbytes, pos);
+		wlen = (size_t)pwrite(fd, tmpbuf, (size_t)nbytes, pos);
 	}
 	else
 	{
-		wlen = (size_t)pwrite(st->fd[st->idx-1], buf, (size_t)len, pos);
-		wlen += pwrite(st->fd[st->idx-1], buf2, len2, pos+len2);
+		wlen = (size_t)pwrite(fd, buf, (size_t)len, pos);
+		wlen += pwrite(fd, buf2, len2, pos+len);
 	}
 #else
 	struct iovec iov[2];
@@ -233,34 +589,222 @@ static int store_write2(store *st, const void *buf, size_t len, const void *buf2
 	iov[0].iov_len = len;
 	iov[1].iov_base = (void*)buf2;
 	iov[1].iov_len = len2;
-	wlen = pwritev(st->fd[st->idx-1], iov, 2, pos);
+	wlen = pwritev(fd, iov, 2, pos);
+#endif
+
+	return wlen;
+}
+
+// Grow the log file's allocation (but not its size) a chunk at a
+// time ahead of writes. Racing writers may both do it, harmlessly.
+
+static void store_prealloc(store *st, segment *sp, uint64_t end)
+{
+	uint64_t alloc = sp->alloc;
+
+	if (!st->prealloc || (end <= alloc))
+		return;
+
+	uint64_t to = (end + st->prealloc - 1) / st->prealloc * st->prealloc;
+
+#ifdef FALLOC_FL_KEEP_SIZE
+	if (fallocate(sp->fd, FALLOC_FL_KEEP_SIZE, alloc, to-alloc) < 0)
+		return;
+#endif
+
+	sp->alloc = to;
+	sp->trim = 1;
+}
+
+// A direct write must be of whole aligned blocks, so the record
+// goes out with what else is in the blocks it shares, as it is now
+// (which may be beyond the end). Writers take turns. Returns -1 if
+// the log file is not (or no longer) written directly.
+
+static int store_write_direct(store *st, segment *sp, const void *buf, size_t len, const void *buf2, size_t len2, uint64_t pos)
+{
+#ifndef O_DIRECT
+	return -1;
+#else
+	uint64_t lo = pos & ~(uint64_t)(DIO_ALIGN-1);
+	uint64_t hi = (pos+len+len2+DIO_ALIGN-1) & ~(uint64_t)(DIO_ALIGN-1);
+	size_t nbytes = hi - lo;
+	lock_lock(st->dio_lk);
+
+	if (!sp->dfd)
+	{
+		lock_unlock(st->dio_lk);
+		return -1;
+	}
+
+	if (nbytes > st->dio_size)
+	{
+		void *tmp = NULL;
+
+		if (posix_memalign(&tmp, DIO_ALIGN, nbytes))
+		{
+			lock_unlock(st->dio_lk);
+			return 0;
+		}
+
+		free(st->dio_buf);
+		st->dio_buf = (char*)tmp;
+		st->dio_size = nbytes;
+	}
+
+	char *dst = st->dio_buf;
+	long n;
+
+	if (pos != lo)
+	{
+		n = pread(sp->fd, dst, DIO_ALIGN, lo);
+		n = n > 0 ? n : 0;
+		memset(dst+n, 0, DIO_ALIGN-n);
+	}
+
+	if (((pos+len+len2) != hi) && ((pos == lo) || (nbytes > DIO_ALIGN)))
+	{
+		n = pread(sp->fd, dst+nbytes-DIO_ALIGN, DIO_ALIGN, hi-DIO_ALIGN);
+		n = n > 0 ? n : 0;
+		memset(dst+nbytes-DIO_ALIGN+n, 0, DIO_ALIGN-n);
+	}
+
+	memcpy(dst+(pos-lo), buf, len);
+	memcpy(dst+(pos-lo)+len, buf2, len2);
+	n = pwrite(sp->dfd, dst, nbytes, lo);
+	sp->trim = 1;
+	lock_unlock(st->dio_lk);
+	return n == nbytes;
 #endif
+}
+
+static int store_write2(store *st, int idx, const void *buf, size_t len, const void *buf2, size_t len2, uint64_t pos)
+{
+	segment *sp = SEG(st,idx);
+	store_prealloc(st, sp, pos+len+len2);
+	long wlen = sp->dfd ? store_write_direct(st, sp, buf, len, buf2, len2, pos) : -1;
+
+	if (wlen >= 0)
+		wlen = wlen ? (long)(len+len2) : -1;
+	else
+		wlen = pwrite2(sp->fd, buf, len, buf2, len2, pos);
 
 	if (wlen != (len+len2))
 	{
-		printf("store_write2 pwrite fd=%d data failed, pos=%llu\n", st->fd[st->idx-1], (unsigned long long)pos);
+		printf("store_write2 pwrite fd=%d data failed, pos=%llu\n", SEG(st,idx)->fd, (unsigned long long)pos);
 		return 0;
 	}
 
 	return 1;
 }
 
-static int store_write(store *st, const void *buf, size_t len, uint64_t pos)
+static int store_write(store *st, int idx, const void *buf, size_t len, uint64_t pos)
 {
-	int wlen = pwrite(st->fd[st->idx-1], buf, len, pos);
+	return store_write2(st, idx, buf, len, NULL, 0, pos);
+}
 
-	if (wlen != len)
+static void store_autocheckpoint(store *st);
+static void store_rotate(store *st, int idx);
+
+// Once compaction is in use, count the bytes of each record made
+// obsolete against the log file it lives in. That needs its header,
+// so the position is noted (under the lock) and read later by the
+// compactor. Too many and the log file is measured afresh instead.
+
+static void store_dead(store *st, uint64_t fp)
+{
+	int idx = FILEIDX(fp);
+
+	if (!SEG(st,idx)->measured)
+		return;
+
+	if (st->cmp_ndead == st->cmp_maxdead)
 	{
-		printf("store_write pwrite fd=%d data failed, pos=%llu\n", st->fd[st->idx-1], (unsigned long long)pos);
-		return 0;
+		size_t max = st->cmp_maxdead ? st->cmp_maxdead*2 : 1024;
+		uint64_t *tmp = max <= DEAD_MAX ? (uint64_t*)realloc(st->cmp_dead, max*sizeof(uint64_t)) : NULL;
+
+		if (!tmp)
+		{
+			SEG(st,idx)->measured = 0;
+			return;
+		}
+
+		st->cmp_dead = tmp;
+		st->cmp_maxdead = max;
 	}
 
-	return 1;
+	st->cmp_dead[st->cmp_ndead++] = fp;
 }
 
-static int store_apply(store *st, int n, uint64_t pos)
+static void store_dead_measure(store *st)
 {
-	int fd = st->fd[st->idx-1];
+	lock_lock(st->lk);
+	uint64_t *fps = st->cmp_dead;
+	size_t i, cnt = st->cmp_ndead;
+	st->cmp_dead = NULL;
+	st->cmp_ndead = st->cmp_maxdead = 0;
+	lock_unlock(st->lk);
+
+	for (i = 0; i < cnt; i++)
+	{
+		int idx = FILEIDX(fps[i]);
+
+		if (!SEG(st,idx)->measured)
+			continue;
+
+		char tmpbuf[256];
+		int nread = pread(SEG(st,idx)->fd, tmpbuf, sizeof(tmpbuf), POS(fps[i]));
+		unsigned nbr, flags, nbytes;
+		uuid u;
+		int skip = nread > 0 ? parse(tmpbuf, nread, &nbr, &u, &flags, &nbytes, NULL) : 0;
+
+		if (skip)
+			SEG(st,idx)->dead += skip + nbytes;
+	}
+
+	free(fps);
+}
+
+static void cache_del(const store *st, const uuid *u);
+static void store_notify(store *st);
+static void cache_put(const store *st, const uuid *u, const void *data, unsigned len);
+
+// Later writes win...
+
+static void store_index(store *st, const uuid *u, uint64_t fp)
+{
+	unsigned long long v;
+
+	if (st->cache)
+		cache_del(st, u);
+
+	if (st->compacting && tree_get(st->tptr, u, &v))
+	{
+		store_dead(st, v);
+		tree_set(st->tptr, u, fp);
+		return;
+	}
+
+	if (!tree_add(st->tptr, u, fp))
+		tree_set(st->tptr, u, fp);
+}
+
+static int store_unindex(store *st, const uuid *u)
+{
+	unsigned long long v;
+
+	if (st->cache)
+		cache_del(st, u);
+
+	if (st->compacting && tree_get(st->tptr, u, &v))
+		store_dead(st, v);
+
+	return tree_del(st->tptr, u);
+}
+
+static int store_apply(store *st, int idx, int n, uint64_t pos)
+{
+	int fd = SEG(st,idx)->fd;
 	int cnt = 0;
 
 	if (st->transactions)
@@ -269,14 +813,18 @@ static int store_apply(store *st, int n, uint64_t pos)
 	for (;;)
 	{
 		char tmpbuf[1024];
+		int nread = pread(fd, tmpbuf, sizeof(tmpbuf)-1, pos);
 
-		if (pread(fd, tmpbuf, sizeof(tmpbuf), pos) <= 0)
-			return 0;
+		if (nread <= 0)
+			break;
 
 		unsigned nbr, flags, nbytes;
 		uuid u;
 
-		int skip = parse(tmpbuf, &nbr, &u, &flags, &nbytes);
+		int skip = parse(tmpbuf, nread, &nbr, &u, &flags, &nbytes, NULL);
+
+		if (!skip)
+			break;
 
 		if (flags == TR_BEGIN)
 		{
@@ -297,32 +845,25 @@ static int store_apply(store *st, int n, uint64_t pos)
 			{
 				if (!(flags & FLAG_RM))
 				{
-					int idx = st->idx-1;
 					uint64_t fp = MAKE_FILEPOS(idx,pos);
-					tree_add(st->tptr, &u, fp);
+					store_index(st, &u, fp);
 				}
 				else
-					tree_del(st->tptr, &u);
+					store_unindex(st, &u);
 
 				if (st->f)
 				{
 					if (nbytes)
 					{
-						char *src = tmpbuf+skip;
-						int big = 0;
-
-						if ((src+nbytes) >= (tmpbuf+sizeof(tmpbuf)))
-						{
-							big = 1;
-							src = (char*)malloc(nbytes+1);
+						int big;
+						unsigned len;
+						char *src = payload(fd, tmpbuf, nread, skip, nbytes, pos, &big);
+						src = store_inflate(flags, src, nbytes, &len, &big);
 
-							if (pread(fd, src, nbytes, pos+skip) <= 0)
-								break;
+						if (!src)
+							break;
 
-							src[nbytes] = 0;
-						}
-
-						st->f(st->p1, &u, src, flags&FLAG_RM?-nbytes:nbytes);
+						st->f(st->p1, &u, src, flags&FLAG_RM?-(int)len:(int)len);
 						if (big) free(src);
 					}
 					else
@@ -343,121 +884,251 @@ static int store_apply(store *st, int n, uint64_t pos)
 	return cnt;
 }
 
-int store_add(store *st, const uuid *u, const void *buf, size_t len)
-{
-	if (!st || !u || !buf || !len)
-		return 0;
+// Write the buffer being filled, while the other takes over. Only
+// one is written at a time, so the other is always empty by now.
 
-	if (len > STORE_MAX_WRITELEN)
+int store_flush(store *st)
+{
+	if (!st || !st->wb[0])
 		return 0;
 
-	char tmpbuf[256];
-	char *dst = tmpbuf;
-	unsigned flags = 0;
-	int plen = prefix(dst, 0, u, flags, len);
-	uint64_t pos = st->eodpos[st->idx-1];
+	lock_lock(st->wb_flk);
+	lock_lock(st->wb_lk);
+	int c = st->wb_cur;
 
-	if (!store_write2(st, tmpbuf, plen, buf, len, pos))
-		return 0;
+	if (!st->wb_len[c])
+	{
+		lock_unlock(st->wb_lk);
+		lock_unlock(st->wb_flk);
+		return 1;
+	}
 
-	st->eodpos[st->idx-1] += plen + len;
-	int idx = st->idx-1;
-	uint64_t fp = MAKE_FILEPOS(idx,pos);
-	tree_add(st->tptr, u, fp);
-	return 1;
+	st->wb_cur ^= 1;
+	lock_unlock(st->wb_lk);
+	int ok = store_write(st, st->wb_idx[c], st->wb[c], st->wb_len[c], st->wb_pos[c]);
+	lock_lock(st->wb_lk);
+	st->wb_len[c] = 0;
+	lock_unlock(st->wb_lk);
+	lock_unlock(st->wb_flk);
+	store_notify(st);
+	return ok;
 }
 
-int store_rem2(store *st, const uuid *u, const void *buf, size_t len)
+// Append a record to the write-behind buffer, which holds a single
+// contiguous run of a log file: anything else means a flush first.
+
+static int store_buffer(store *st, int idx, const void *buf, size_t len, const void *buf2, size_t len2, uint64_t *pos)
 {
-	if (!st || !u || !buf || !len)
-		return 0;
+	lock_lock(st->wb_lk);
+	int c = st->wb_cur;
 
-	if (!tree_del(st->tptr, u))
-		return 0;
+	if (st->wb_len[c] && ((st->wb_idx[c] != idx) || ((st->wb_len[c]+len+len2) > st->wb_size) ||
+		(SEG(st,idx)->eodpos != (st->wb_pos[c]+st->wb_len[c]))))
+	{
+		lock_unlock(st->wb_lk);
+		store_flush(st);
+		lock_lock(st->wb_lk);
+		c = st->wb_cur;
+	}
 
-	char tmpbuf[256];
-	unsigned flags = FLAG_RM;
-	int plen = prefix(tmpbuf, 0, u, flags, len);
-	uint64_t pos = st->eodpos[st->idx-1];
+	*pos = atomic_addu64(&SEG(st,idx)->eodpos, len+len2);
 
-	if (!store_write2(st, tmpbuf, plen, buf, len, pos))
-		return 0;
+	// A transaction got in first...
 
-	st->eodpos[st->idx-1] += plen + len;
-	return 1;
+	if (st->wb_len[c] && (*pos != (st->wb_pos[c]+st->wb_len[c])))
+	{
+		lock_unlock(st->wb_lk);
+		return store_write2(st, idx, buf, len, buf2, len2, *pos);
+	}
+
+	if (!st->wb_len[c])
+	{
+		st->wb_idx[c] = idx;
+		st->wb_pos[c] = *pos;
+	}
+
+	memcpy(st->wb[c]+st->wb_len[c], buf, len);
+	memcpy(st->wb[c]+st->wb_len[c]+len, buf2, len2);
+	st->wb_len[c] += len + len2;
+	lock_unlock(st->wb_lk);
+	return 1;
 }
 
-int store_rem(store *st, const uuid *u)
+static int store_flusher(void *p1)
 {
-	if (!st || !u)
+	store *st = (store*)p1;
+
+	while (st->wb_msecs > 0)
+	{
+		msleep(st->wb_msecs);
+		store_flush(st);
+	}
+
+	st->wb_running = 0;
+	return 0;
+}
+
+void store_set_buffer(store *st, size_t nbytes, int msecs)
+{
+	if (!st)
+		return;
+
+	if (nbytes && !st->wb[0])
+	{
+		st->wb[0] = (char*)malloc(nbytes);
+		st->wb[1] = (char*)malloc(nbytes);
+
+		if (!st->wb[0] || !st->wb[1])
+		{
+			free(st->wb[0]);
+			free(st->wb[1]);
+			st->wb[0] = st->wb[1] = NULL;
+			return;
+		}
+
+		st->wb_alloc = nbytes;
+	}
+
+	st->wb_size = nbytes < st->wb_alloc ? nbytes : st->wb_alloc;
+	st->wb_msecs = st->wb_size ? msecs : 0;
+
+	if (!st->wb_size)
+		store_flush(st);
+	else if ((st->wb_msecs > 0) && !st->wb_running)
+	{
+		st->wb_running = 1;
+
+		if (!thread_run(&store_flusher, st))
+			st->wb_running = 0;
+	}
+}
+
+int store_add(store *st, const uuid *u, const void *buf, size_t len)
+{
+	if (!st || !u || !buf || !len)
 		return 0;
 
-	if (!tree_del(st->tptr, u))
+	if (len > STORE_MAX_WRITELEN)
 		return 0;
 
 	char tmpbuf[256];
-	unsigned flags = FLAG_RM;
-	int plen = prefix(tmpbuf, 0, u, flags, 0);
-	tmpbuf[plen++] = '\n';
-	uint64_t pos = st->eodpos[st->idx-1];
+	char *dst = tmpbuf, *lz;
+	const void *data = buf;
+	size_t nbytes = len;
+	unsigned flags = store_deflate(st, &data, &nbytes, &lz);
+	int plen = prefix(dst, 0, u, flags, data, nbytes);
+	int idx = st->idx-1;
+	uint64_t pos;
+	int ok = 1;
+
+	if (!st->wb_size || ((plen+nbytes) > st->wb_size))
+	{
+		pos = SEG(st,idx)->eodpos;
 
-	if (!store_write(st, tmpbuf, plen, pos))
+		if ((ok = store_write2(st, idx, tmpbuf, plen, data, nbytes, pos)))
+			SEG(st,idx)->eodpos += plen + nbytes;
+	}
+	else
+		ok = store_buffer(st, idx, tmpbuf, plen, data, nbytes, &pos);
+
+	free(lz);
+
+	if (!ok)
 		return 0;
 
-	st->eodpos[st->idx-1] += plen;
+	uint64_t fp = MAKE_FILEPOS(idx,pos);
+	int locked = st->transactions || st->compacting;
+
+	if (locked)
+		lock_lock(st->lk);
+
+	store_index(st, u, fp);
+
+	if (locked)
+		lock_unlock(st->lk);
+
+	if (st->cache_on)
+		cache_put(st, u, buf, len);
+
+	store_notify(st);
+	store_rotate(st, idx);
+	store_autocheckpoint(st);
 	return 1;
 }
 
-int store_get(const store *st, const uuid *u, void **buf, size_t *len)
+int store_rem2(store *st, const uuid *u, const void *buf, size_t len)
 {
 	if (!st || !u || !buf || !len)
-	{
-		printf("store_get failed invalid args\n");
 		return 0;
-	}
 
-	unsigned long long v;
+	int locked = st->transactions || st->compacting;
 
-	if (st->transactions)
+	if (locked)
 		lock_lock(st->lk);
 
-	int ok = tree_get(st->tptr, u, &v);
+	int ok = store_unindex(st, u);
 
-	if (st->transactions)
+	if (locked)
 		lock_unlock(st->lk);
 
 	if (!ok)
 		return 0;
 
-	int idx = FILEIDX(v);
-	int fd = st->fd[idx];
-	uint64_t pos = POS(v);
-	char tmpbuf[1024];
+	char tmpbuf[256], *lz;
+	unsigned flags = FLAG_RM | store_deflate(st, &buf, &len, &lz);
+	int plen = prefix(tmpbuf, 0, u, flags, buf, len);
+	int idx = st->idx-1;
+	uint64_t pos = SEG(st,idx)->eodpos;
+	ok = store_write2(st, idx, tmpbuf, plen, buf, len, pos);
+	free(lz);
 
-	if (pread(fd, tmpbuf, sizeof(tmpbuf)-1, pos) <= 0)
-	{
-		printf("store_get pread fd=%d prefix failed, pos=%llu\n", fd, (unsigned long long)pos);
+	if (!ok)
 		return 0;
-	}
 
-	unsigned nbr, flags, nbytes;
-	uuid tmp_u;
-	int skip = parse(tmpbuf, &nbr, &tmp_u, &flags, &nbytes);
+	SEG(st,idx)->eodpos += plen + len;
+	store_notify(st);
+	store_rotate(st, idx);
+	store_autocheckpoint(st);
+	return 1;
+}
 
-	if (uuid_compare(u, &tmp_u) != 0)	// CHECK uuid match
-	{
-		char tmpbuf1[256], tmpbuf2[256];
-		printf("store_get failed uuid=%s !=%s failed\n", uuid_to_string(u, tmpbuf1), uuid_to_string(&tmp_u, tmpbuf2));
+int store_rem(store *st, const uuid *u)
+{
+	if (!st || !u)
 		return 0;
-	}
 
-	if (nbytes == 0)					// CHECK has length
-	{
-		printf("store_get failed invalid length\n");
+	int locked = st->transactions || st->compacting;
+
+	if (locked)
+		lock_lock(st->lk);
+
+	int ok = store_unindex(st, u);
+
+	if (locked)
+		lock_unlock(st->lk);
+
+	if (!ok)
 		return 0;
-	}
 
-	if (*buf && (*len < (nbytes-1)))	// CHECK buffer big enough
+	char tmpbuf[256];
+	unsigned flags = FLAG_RM;
+	int plen = prefix(tmpbuf, 0, u, flags, NULL, 0);
+	int idx = st->idx-1;
+	uint64_t pos = SEG(st,idx)->eodpos;
+
+	if (!store_write(st, idx, tmpbuf, plen, pos))
+		return 0;
+
+	SEG(st,idx)->eodpos += plen;
+	store_notify(st);
+	store_rotate(st, idx);
+	store_autocheckpoint(st);
+	return 1;
+}
+
+static int store_get_buffer(void **buf, size_t *len, unsigned nbytes)
+{
+	if (*buf && (*len < (nbytes+1)))	// CHECK buffer big enough
 	{
 		free(*buf);
 		*buf = 0;
@@ -470,447 +1141,3388 @@ int store_get(const store *st, const uuid *u, void **buf, size_t *len)
 		if (!*buf) return 0;
 	}
 
-	char *bufptr = (char*)*buf;
+	return 1;
+}
 
-	// If wholely within tmpbuf then
-	// we already have it all!
+// Swap a compressed record, as read into the caller's buffer, for
+// the original.
 
-	if ((skip+nbytes) <= sizeof(tmpbuf))
-	{
-		memcpy(bufptr, tmpbuf+skip, nbytes);
-		bufptr[nbytes] = 0;
-		return nbytes;
-	}
+static int store_get_inflated(void **buf, size_t *len, unsigned flags, unsigned nbytes)
+{
+	int big = 0;
+	unsigned n;
+	char *src = store_inflate(flags, (char*)*buf, nbytes, &n, &big);
 
-	if (pread(fd, bufptr, nbytes, pos+skip) != nbytes)
+	if (!src)
+		return 0;
+
+	if (!store_get_buffer(buf, len, n))
 	{
-		printf("store_get pread fd=%d data failed, pos=%llu\n", fd, (unsigned long long)pos+skip);
+		free(src);
 		return 0;
 	}
 
-	bufptr[nbytes] = 0;
-	return nbytes;
+	memcpy(*buf, src, n+1);
+	free(src);
+	return n;
 }
 
-hstore *store_begin(store *st)
-{
-	if (!st)
-		return 0;
-
-	hstore *h = (hstore*)calloc(1, sizeof(struct hstore_));
-
-	if (!h)
-		return 0;
-
-	h->nbr = atomic_inc(&st->current);
-	atomic_inc(&st->transactions);
-	h->st = st;
-	h->wait_for_write = 1;
-	return h;
-}
+// Look for a record not yet written out.
 
-int store_hget(hstore *h, const uuid *u, void **buf, size_t *len)
+static int store_get_buffered(const store *st, int idx, uint64_t pos, const uuid *u, void **buf, size_t *len)
 {
-	if (!h)
-		return 0;
-
-	return store_get(h->st, u, buf, len);
-}
+	int c, found = -1;
+	lock_lock(st->wb_lk);
 
-int store_hadd(hstore *h, const uuid *u, const void *buf, size_t len)
-{
-	if (!h || !u || !buf || !len)
-		return 0;
+	for (c = 0; c < 2; c++)
+	{
+		if (!st->wb_len[c] || (st->wb_idx[c] != idx))
+			continue;
 
-	char tmpbuf[256];
-	char *dst = tmpbuf;
+		if ((pos < st->wb_pos[c]) || (pos >= (st->wb_pos[c]+st->wb_len[c])))
+			continue;
 
-	if (h->wait_for_write)
-		dst += sprintf(dst, "[ %u %u 0 0 ]\n", h->nbr, TR_BEGIN);
+		const char *src = st->wb[c] + (pos - st->wb_pos[c]);
+		rec_hdr hdr;
+		memcpy(&hdr, src, REC_HDR_SIZE);
 
-	unsigned flags = 0;
-	int plen = dst - tmpbuf;
-	plen += prefix(dst, h->nbr, u, flags, len);
-	uint64_t pos = atomic_addu64(&h->st->eodpos[h->st->idx-1], plen+len);
+		if (uuid_compare(u, &hdr.u) || !hdr.len || !store_get_buffer(buf, len, hdr.len))
+		{
+			found = 0;
+			break;
+		}
 
-	if (h->wait_for_write)
-	{
-		h->wait_for_write = 0;
-		h->start_pos = pos;
+		memcpy(*buf, src+REC_HDR_SIZE, hdr.len);
+		((char*)*buf)[hdr.len] = 0;
+		found = hdr.flags & FLAG_LZ ? store_get_inflated(buf, len, hdr.flags, hdr.len) : hdr.len;
+		break;
 	}
 
-	int ok = store_write2(h->st, tmpbuf, plen, buf, len, pos);
-	return ok;
+	lock_unlock(st->wb_lk);
+	return found;
 }
 
-int store_hrem2(hstore *h, const uuid *u, const void *buf, size_t len)
-{
-	if (!h || !u)
-		return 0;
-
-	char tmpbuf[256];
-	char *dst = tmpbuf;
-
-	if (h->wait_for_write)
-		dst += sprintf(dst, "[ %u %u 0 %u ] ", h->nbr, TR_BEGIN, (unsigned)len);
-
-	unsigned flags = FLAG_RM;
-	int plen = dst - tmpbuf;
-	plen += prefix(dst, h->nbr, u, flags, 0);
-	uint64_t pos = atomic_addu64(&h->st->eodpos[h->st->idx-1], plen+len);
+// A compacted log file is replaced under lock, but the old one stays
+// open for readers like these. Each counts itself against the
+// generation of descriptor it took (under the same lock), and the one
+// replaced is only closed, at the next compaction, once none are left.
 
-	if (h->wait_for_write)
-	{
-		h->wait_for_write = 0;
-		h->start_pos = pos;
-	}
+static int store_fd_pin(const store *st, int idx, int *gen)
+{
+	*gen = SEG(st,idx)->fdgen & 1;
+	atomic_inc(&SEG(st,idx)->readers[*gen]);
+	return SEG(st,idx)->fd;
+}
 
-	int ok = store_write2(h->st, tmpbuf, plen, buf, len, pos);
-	return ok;
+static void store_fd_unpin(const store *st, int idx, int gen)
+{
+	atomic_dec(&SEG(st,idx)->readers[gen]);
 }
 
-int store_hrem(hstore *h, const uuid *u)
+static int store_read2(const store *st, int idx, int fd, int text, uint64_t pos, const uuid *u, void **buf, size_t *len);
+
+static int store_read(const store *st, const uuid *u, void **buf, size_t *len)
 {
-	if (!h || !u)
-		return 0;
+	unsigned long long v;
+	int locked = st->transactions || st->compacting;
 
-	char tmpbuf[256];
-	char *dst = tmpbuf;
+	if (locked)
+		lock_lock(st->lk);
 
-	if (h->wait_for_write)
-		dst += sprintf(dst, "[ %u %u 0 0 ]\n", h->nbr, TR_BEGIN);
+	int ok = tree_get(st->tptr, u, &v);
+	int idx = FILEIDX(v), gen = 0;
+	int fd = ok ? store_fd_pin(st, idx, &gen) : -1;
+	int text = ok ? SEG(st,idx)->text : 0;
 
-	unsigned flags = FLAG_RM;
-	int plen = dst - tmpbuf;
-	plen += prefix(dst, h->nbr, u, flags, 0);
-	tmpbuf[plen++] = '\n';
-	uint64_t pos = atomic_addu64(&h->st->eodpos[h->st->idx-1], plen);
+	if (locked)
+		lock_unlock(st->lk);
 
-	if (h->wait_for_write)
-	{
-		h->wait_for_write = 0;
-		h->start_pos = pos;
-	}
+	if (!ok)
+		return 0;
 
-	int ok = store_write(h->st, tmpbuf, plen, pos);
-	return ok;
+	int nbytes = store_read2(st, idx, fd, text, POS(v), u, buf, len);
+	store_fd_unpin(st, idx, gen);
+	return nbytes;
 }
 
-int store_cancel(hstore *h)
+static int store_read2(const store *st, int idx, int fd, int text, uint64_t pos, const uuid *u, void **buf, size_t *len)
 {
-	if (!h)
-		return 0;
 
-	if (!h->wait_for_write)
+	if (st->wb[0])
 	{
-		char tmpbuf[256];
-		int len = sprintf(tmpbuf, "[ %u %u 0 0 ]\n", h->nbr, TR_CANCEL);
-		uint64_t pos = atomic_addu64(&h->st->eodpos[h->st->idx-1], len);
-		int ok2 = store_write(h->st, tmpbuf, len, pos);
+		int nbytes = store_get_buffered(st, idx, pos, u, buf, len);
 
-		if (!ok2)
-		{
-			free(h);
-			return 0;
-		}
+		if (nbytes >= 0)
+			return nbytes;
 	}
 
-	atomic_dec_and_zero(&h->st->transactions, &h->st->current);
-	free(h);
-	return 1;
-}
+	char tmpbuf[1024];
+	rec_hdr hdr;
+	int nread, skip;
+	char *bufptr;
 
-int store_end(hstore *h, int dbsync)
-{
-	if (!h)
-		return 0;
+#ifndef _WIN32
+	// With a fixed-width header and a caller-supplied buffer we
+	// can read the header and payload directly in one go...
 
-	if (!h->wait_for_write)
+	if (!text && *buf && (*len > 1))
 	{
-		char tmpbuf[256];
-		int len = sprintf(tmpbuf, "[ %u %u 0 0 ]\n", h->nbr, TR_END);
-		uint64_t pos = atomic_addu64(&h->st->eodpos[h->st->idx-1], len);
-		int ok2 = store_write(h->st, tmpbuf, len, pos);
+		struct iovec iov[2];
+		iov[0].iov_base = &hdr;
+		iov[0].iov_len = REC_HDR_SIZE;
+		iov[1].iov_base = *buf;
+		iov[1].iov_len = *len-1;
+		nread = preadv(fd, iov, 2, pos);
 
-		if (!ok2)
+		if ((nread < (int)REC_HDR_SIZE) || (hdr.magic != REC_MAGIC) || (hdr.version != REC_VERSION))
 		{
-			free(h);
+			printf("store_get preadv fd=%d prefix failed, pos=%llu\n", fd, (unsigned long long)pos);
 			return 0;
 		}
 
-		store_apply(h->st, h->nbr, h->start_pos);
-
-		if (dbsync)
-			fsync(h->st->fd[h->st->idx]);
-	}
-
-	atomic_dec_and_zero(&h->st->transactions, &h->st->current);
-	free(h);
-	return 1;
-}
-
-static void store_load_file(store *st)
-{
-	uint64_t pos = 0, save_pos = 0, next_pos = 0;
-	unsigned save_nbr = 0, cnt = 0;
-	int fd = st->fd[st->idx-1];
-	int valid = 1;
-
-	for (;;)
-	{
-		char tmpbuf[1024];
+		if (uuid_compare(u, &hdr.u) != 0)	// CHECK uuid match
+		{
+			char tmpbuf1[256], tmpbuf2[256];
+			printf("store_get failed uuid=%s !=%s failed\n", uuid_to_string(u, tmpbuf1), uuid_to_string(&hdr.u, tmpbuf2));
+			return 0;
+		}
 
-		if (pread(fd, tmpbuf, sizeof(tmpbuf), pos) <= 0)
-			break;
+		if (hdr.len == 0)					// CHECK has length
+		{
+			printf("store_get failed invalid length\n");
+			return 0;
+		}
 
-		unsigned nbr, flags, nbytes;
-		uuid u;
-		int skip = parse(tmpbuf, &nbr, &u, &flags, &nbytes);
+		nread -= REC_HDR_SIZE;
+		skip = REC_HDR_SIZE;
+		bufptr = (char*)*buf;
 
-		if (flags == TR_BEGIN)
+		if (hdr.len > nread)
 		{
-			if (!save_nbr)
+			if (*len < (hdr.len+1))
 			{
-				save_nbr = nbr;
-				save_pos = pos;
-				next_pos = pos;
+				if (!store_get_buffer(buf, len, hdr.len))
+					return 0;
+
+				bufptr = (char*)*buf;
+				nread = 0;
 			}
-			else
-				valid = 0;
-		}
-		else if (flags == TR_CANCEL)
-		{
-			unsigned nbr = 0;
 
-			if (nbr == save_nbr)		// drop on rollback
+			if (pread(fd, bufptr+nread, hdr.len-nread, pos+skip+nread) != (hdr.len-nread))
 			{
-				save_nbr = 0;
-				pos = next_pos;
+				printf("store_get pread fd=%d data failed, pos=%llu\n", fd, (unsigned long long)pos+skip);
+				return 0;
 			}
-			else
-				valid = 0;
 		}
-		else if (flags == TR_END)
+
+		if (!verify(&hdr, bufptr))
 		{
-			if (nbr == save_nbr)		// apply on commit
-			{
-				cnt += store_apply(st, nbr, save_pos);
-				save_nbr = 0;
+			printf("store_get failed checksum, pos=%llu\n", (unsigned long long)pos);
+			return 0;
+		}
 
-				// If we didn't encounter any embedded or
-				// interleaved transaction elements, then
-				// we don't have to go back and restart...
+		if (hdr.flags & FLAG_LZ)
+			return store_get_inflated(buf, len, hdr.flags, hdr.len);
 
-				if (!valid)
-					pos = next_pos;
-			}
+		bufptr[hdr.len] = 0;
+		return hdr.len;
+	}
+#endif
+
+	if ((nread = pread(fd, tmpbuf, sizeof(tmpbuf)-1, pos)) <= 0)
+	{
+		printf("store_get pread fd=%d prefix failed, pos=%llu\n", fd, (unsigned long long)pos);
+		return 0;
+	}
+
+	unsigned nbr, flags, nbytes;
+	uuid tmp_u;
+	skip = parse(tmpbuf, nread, &nbr, &tmp_u, &flags, &nbytes, &hdr);
+
+	if (!skip)
+	{
+		printf("store_get failed invalid prefix, pos=%llu\n", (unsigned long long)pos);
+		return 0;
+	}
+
+	if (uuid_compare(u, &tmp_u) != 0)	// CHECK uuid match
+	{
+		char tmpbuf1[256], tmpbuf2[256];
+		printf("store_get failed uuid=%s !=%s failed\n", uuid_to_string(u, tmpbuf1), uuid_to_string(&tmp_u, tmpbuf2));
+		return 0;
+	}
+
+	if (nbytes == 0)					// CHECK has length
+	{
+		printf("store_get failed invalid length\n");
+		return 0;
+	}
+
+	if (!store_get_buffer(buf, len, nbytes))
+		return 0;
+
+	bufptr = (char*)*buf;
+
+	// If wholely within tmpbuf then
+	// we already have it all!
+
+	if ((skip+nbytes) <= nread)
+	{
+		memcpy(bufptr, tmpbuf+skip, nbytes);
+	}
+	else if (pread(fd, bufptr, nbytes, pos+skip) != nbytes)
+	{
+		printf("store_get pread fd=%d data failed, pos=%llu\n", fd, (unsigned long long)pos+skip);
+		return 0;
+	}
+
+	if (hdr.magic && !verify(&hdr, bufptr))
+	{
+		printf("store_get failed checksum, pos=%llu\n", (unsigned long long)pos);
+		return 0;
+	}
+
+	if (flags & FLAG_LZ)
+		return store_get_inflated(buf, len, flags, nbytes);
+
+	bufptr[nbytes] = 0;
+	return nbytes;
+}
+
+// Sealed log files are mapped on demand. Each view holds a reference
+// on the mapping, as does the store until the file is compacted or
+// closed, and whoever drops the last one unmaps it.
+
+static store_map *store_map_file(store *st, int idx)
+{
+#ifdef _WIN32
+	return NULL;
+#else
+	// Not while a late transaction may still be writing to it.
+
+	if (SEG(st,idx)->map || !SEG(st,idx)->eodpos || SEG(st,idx)->writers)
+		return SEG(st,idx)->map;
+
+	// Only what has actually reached the file...
+
+	struct stat s = {0};
+	uint64_t len = SEG(st,idx)->eodpos;
+
+	if (fstat(SEG(st,idx)->fd, &s) || !s.st_size)
+		return NULL;
+
+	if (s.st_size < len)
+		len = s.st_size;
+
+	void *addr = mmap(NULL, len, PROT_READ, MAP_SHARED, SEG(st,idx)->fd, 0);
+
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	store_map *m = (store_map*)malloc(sizeof(struct store_map_));
+
+	if (!m)
+	{
+		munmap(addr, len);
+		return NULL;
+	}
+
+	m->addr = (char*)addr;
+	m->len = len;
+	m->refs = 1;
+	SEG(st,idx)->map = m;
+	return m;
+#endif
+}
+
+static void store_map_release(store_map *m)
+{
+	if (!m || atomic_dec(&m->refs))
+		return;
+
+#ifndef _WIN32
+	munmap(m->addr, m->len);
+#endif
+	free(m);
+}
+
+int store_get_view(store *st, const uuid *u, store_view *view)
+{
+	if (!st || !u || !view)
+		return 0;
+
+	memset(view, 0, sizeof(store_view));
+	unsigned long long v;
+	int locked = st->transactions || st->compacting;
+
+	if (locked)
+		lock_lock(st->lk);
+
+	int ok = tree_get(st->tptr, u, &v);
+	int idx = FILEIDX(v);
+	store_map *m = NULL;
+
+	if (ok && (idx < (st->idx-1)))
+	{
+		if (!(m = SEG(st,idx)->map))
+		{
+			if (!locked)
+				lock_lock(st->lk);
+
+			m = store_map_file(st, idx);
+
+			if (!locked)
+				lock_unlock(st->lk);
+		}
+
+		if (m)
+			atomic_inc(&m->refs);
+	}
+
+	if (locked)
+		lock_unlock(st->lk);
+
+	if (!ok)
+		return 0;
+
+	uint64_t pos = POS(v);
+	unsigned nbr, flags, nbytes;
+	uuid tmp_u;
+	rec_hdr hdr;
+	int skip = m && (pos < m->len) ? parse(m->addr+pos, m->len-pos, &nbr, &tmp_u, &flags, &nbytes, &hdr) : 0;
+
+	// The active log, a late write beyond the mapping, or one that
+	// needs expanding, is read into a private copy instead.
+
+	if (!skip || ((pos+skip+nbytes) > m->len) || (flags & FLAG_LZ))
+	{
+		store_map_release(m);
+		size_t len = 0;
+		int n = store_get(st, u, &view->buf, &len);
+
+		if (n <= 0)
+		{
+			free(view->buf);
+			view->buf = NULL;
+			return 0;
+		}
+
+		view->data = view->buf;
+		view->len = n;
+		return n;
+	}
+
+	const char *src = m->addr + pos + skip;
+
+	if (uuid_compare(u, &tmp_u) || !nbytes || (hdr.magic && !verify(&hdr, src)))
+	{
+		printf("store_get_view failed invalid record, pos=%llu\n", (unsigned long long)pos);
+		store_map_release(m);
+		return 0;
+	}
+
+	view->data = src;
+	view->len = nbytes;
+	view->map = m;
+	return nbytes;
+}
+
+void store_unpin(store_view *view)
+{
+	if (!view)
+		return;
+
+	store_map_release(view->map);
+	free(view->buf);
+	memset(view, 0, sizeof(store_view));
+}
+
+static uint64_t cache_hash(const uuid *u)
+{
+	uint64_t h = (u->u1 * 0x9E3779B97F4A7C15ULL) ^ u->u2;
+	return h ^ (h >> 29);
+}
+
+static cache_shard *cache_shard_of(const store *st, const uuid *u, uint64_t *h)
+{
+	*h = cache_hash(u);
+	return &st->cache[(*h * 0xBF58476D1CE4E5B9ULL) >> 60];
+}
+
+static cache_entry **cache_find(cache_shard *s, const uuid *u, uint64_t h)
+{
+	cache_entry **link = &s->buckets[h % s->nbuckets];
+
+	while (*link && uuid_compare(&(*link)->u, u))
+		link = &(*link)->next;
+
+	return link;
+}
+
+static void cache_unlink(cache_shard *s, cache_entry **link)
+{
+	cache_entry *e = *link;
+	*link = e->next;
+	s->ring[e->slot] = NULL;
+	s->holes++;
+	s->bytes -= sizeof(cache_entry) + e->len;
+	s->cnt--;
+	free(e);
+}
+
+// CLOCK: sweep the ring, giving each recently used entry a second
+// chance, until there is room.
+
+static void cache_evict(cache_shard *s, size_t need)
+{
+	while (s->cnt && ((s->bytes + need) > s->budget))
+	{
+		cache_entry *e = s->ring[s->hand];
+		s->hand = (s->hand + 1) % s->nring;
+
+		if (!e)
+			continue;
+
+		if (e->ref)
+		{
+			e->ref = 0;
+			continue;
+		}
+
+		cache_unlink(s, cache_find(s, &e->u, cache_hash(&e->u)));
+	}
+}
+
+static void cache_insert(cache_shard *s, const uuid *u, uint64_t h, const void *data, unsigned len)
+{
+	size_t need = sizeof(cache_entry) + len;
+
+	if ((need*8) > s->budget)
+		return;
+
+	cache_entry **link = cache_find(s, u, h);
+
+	if (*link)
+		cache_unlink(s, link);
+
+	cache_evict(s, need);
+
+	if (s->cnt >= s->nbuckets)
+	{
+		unsigned i, n = s->nbuckets * 2;
+		cache_entry **tmp = (cache_entry**)calloc(n, sizeof(cache_entry*));
+
+		if (!tmp)
+			return;
+
+		for (i = 0; i < s->nbuckets; i++)
+		{
+			while (s->buckets[i])
+			{
+				cache_entry *e = s->buckets[i];
+				s->buckets[i] = e->next;
+				uint64_t h2 = cache_hash(&e->u);
+				e->next = tmp[h2 % n];
+				tmp[h2 % n] = e;
+			}
+		}
+
+		free(s->buckets);
+		s->buckets = tmp;
+		s->nbuckets = n;
+	}
+
+	unsigned slot = s->nring;
+
+	if (s->holes)
+	{
+		for (slot = s->hand; s->ring[slot]; slot = (slot + 1) % s->nring)
+			;
+
+		s->holes--;
+	}
+	else if (s->nring == s->maxring)
+	{
+		unsigned n = s->maxring ? s->maxring * 2 : 1024;
+		cache_entry **tmp = (cache_entry**)realloc(s->ring, n*sizeof(cache_entry*));
+
+		if (!tmp)
+			return;
+
+		s->ring = tmp;
+		s->maxring = n;
+	}
+
+	cache_entry *e = (cache_entry*)malloc(sizeof(cache_entry) + len);
+
+	if (!e)
+		return;
+
+	e->u = *u;
+	e->len = len;
+	e->slot = slot;
+	e->ref = 0;
+	memcpy(e->data, data, len);
+	e->data[len] = 0;
+	e->next = NULL;
+	*cache_find(s, u, h) = e;
+	s->ring[slot] = e;
+
+	if (slot == s->nring)
+		s->nring++;
+
+	s->bytes += need;
+	s->cnt++;
+}
+
+static void cache_del(const store *st, const uuid *u)
+{
+	uint64_t h;
+	cache_shard *s = cache_shard_of(st, u, &h);
+	lock_lock(s->lk);
+	cache_entry **link = cache_find(s, u, h);
+
+	if (*link)
+		cache_unlink(s, link);
+
+	s->gen++;
+	lock_unlock(s->lk);
+}
+
+static void cache_put(const store *st, const uuid *u, const void *data, unsigned len)
+{
+	uint64_t h;
+	cache_shard *s = cache_shard_of(st, u, &h);
+	lock_lock(s->lk);
+	cache_insert(s, u, h, data, len);
+	lock_unlock(s->lk);
+}
+
+int store_get(const store *st, const uuid *u, void **buf, size_t *len)
+{
+	if (!st || !u || !buf || !len)
+	{
+		printf("store_get failed invalid args\n");
+		return 0;
+	}
+
+	if (!st->cache_on)
+		return store_read(st, u, buf, len);
+
+	uint64_t h;
+	cache_shard *s = cache_shard_of(st, u, &h);
+	lock_lock(s->lk);
+	cache_entry *e = *cache_find(s, u, h);
+	int nbytes = 0;
+
+	if (e && store_get_buffer(buf, len, e->len))
+	{
+		e->ref = 1;
+		memcpy(*buf, e->data, e->len+1);
+		nbytes = e->len;
+		s->hits++;
+	}
+	else
+		s->misses++;
+
+	uint64_t gen = s->gen;
+	lock_unlock(s->lk);
+
+	if (nbytes)
+		return nbytes;
+
+	// Only cache what was read if nothing changed meanwhile.
+
+	if ((nbytes = store_read(st, u, buf, len)) <= 0)
+		return nbytes;
+
+	lock_lock(s->lk);
+
+	if (s->gen == gen)
+		cache_insert(s, u, h, *buf, nbytes);
+
+	lock_unlock(s->lk);
+	return nbytes;
+}
+
+void store_set_cache(store *st, size_t nbytes)
+{
+	if (!st)
+		return;
+
+	if (!st->cache)
+	{
+		if (!nbytes)
+			return;
+
+		st->cache = (cache_shard*)calloc(CACHE_SHARDS, sizeof(cache_shard));
+
+		if (!st->cache)
+			return;
+
+		int i;
+
+		for (i = 0; i < CACHE_SHARDS; i++)
+		{
+			st->cache[i].lk = lock_create();
+			st->cache[i].nbuckets = 1024;
+			st->cache[i].buckets = (cache_entry**)calloc(1024, sizeof(cache_entry*));
+		}
+	}
+
+	int i;
+
+	for (i = 0; i < CACHE_SHARDS; i++)
+	{
+		cache_shard *s = &st->cache[i];
+		lock_lock(s->lk);
+		s->budget = nbytes / CACHE_SHARDS;
+		cache_evict(s, 0);
+		lock_unlock(s->lk);
+	}
+
+	st->cache_on = nbytes != 0;
+}
+
+void store_cache_stats(const store *st, uint64_t *hits, uint64_t *misses, size_t *nbytes)
+{
+	uint64_t h = 0, m = 0;
+	size_t b = 0;
+	int i;
+
+	for (i = 0; st && st->cache && (i < CACHE_SHARDS); i++)
+	{
+		lock_lock(st->cache[i].lk);
+		h += st->cache[i].hits;
+		m += st->cache[i].misses;
+		b += st->cache[i].bytes;
+		lock_unlock(st->cache[i].lk);
+	}
+
+	if (hits) *hits = h;
+	if (misses) *misses = m;
+	if (nbytes) *nbytes = b;
+}
+
+typedef struct
+{
+	uuid u;
+	uint64_t pos;
+	int idx, fd, gen;
+}
+ mget_key;
+
+typedef struct
+{
+	int first, cnt, fd, done, nread;
+	uint64_t pos;
+	size_t len;
+	char *buf;
+}
+ mget_run;
+
+typedef struct
+{
+	mget_run *runs;
+	event *ev, *exited;
+	int nruns, next;
+}
+ mget_ctx;
+
+static int mget_compare(const void *p1, const void *p2)
+{
+	const mget_key *k1 = (const mget_key*)p1, *k2 = (const mget_key*)p2;
+
+	if (k1->idx != k2->idx)
+		return k1->idx < k2->idx ? -1 : 1;
+
+	return k1->pos < k2->pos ? -1 : k1->pos > k2->pos ? 1 : 0;
+}
+
+static void mget_read(mget_ctx *ctx, mget_run *r)
+{
+	r->buf = (char*)malloc(r->len+1);
+	r->nread = r->buf ? pread(r->fd, r->buf, r->len, r->pos) : 0;
+	atomic_inc(&r->done);
+	event_signal(ctx->ev);
+}
+
+// Signalling its exit is a worker's last act, after which the
+// context can go.
+
+static int mget_worker(void *p1)
+{
+	mget_ctx *ctx = (mget_ctx*)p1;
+	int i;
+
+	while ((i = atomic_inc(&ctx->next)) < ctx->nruns)
+		mget_read(ctx, &ctx->runs[i]);
+
+	event_signal(ctx->exited);
+	return 0;
+}
+
+// Hand over one record from a run, falling back to a separate read
+// for any part beyond what was read.
+
+static int mget_record(store *st, mget_run *r, const mget_key *k, void (*f)(void*,const uuid*,const void*,int), void *p1)
+{
+	int off = (int)(k->pos - r->pos);
+	unsigned nbr, flags, nbytes;
+	uuid u;
+	rec_hdr h;
+	int skip = r->nread > off ? parse(r->buf+off, r->nread-off, &nbr, &u, &flags, &nbytes, &h) : 0;
+
+	if (!skip || uuid_compare(&u, &k->u) || !nbytes)
+	{
+		void *buf = NULL;
+		size_t len = 0;
+		int n = store_get(st, &k->u, &buf, &len);
+
+		if (n > 0)
+			f(p1, &k->u, buf, n);
+
+		free(buf);
+		return n > 0;
+	}
+
+	// The payload is terminated in place, so put back what
+	// that overwrites (the start of the next record).
+
+	int end = off + skip + nbytes, big;
+	char save = end < r->nread ? r->buf[end] : 0;
+	char *src = payload(k->fd, r->buf+off, r->nread-off, skip, nbytes, k->pos, &big);
+	int ok = src && (!h.magic || verify(&h, src));
+	int big2 = big;
+	unsigned len;
+	char *data = ok ? store_inflate(flags, src, nbytes, &len, &big2) : src;
+	ok = ok && data;
+
+	if (ok)
+		f(p1, &k->u, data, len);
+	else
+		printf("store_mget failed invalid record, pos=%llu\n", (unsigned long long)k->pos);
+
+	if (big2)
+		free(data);
+
+	if (!big && (end < r->nread))
+		r->buf[end] = save;
+
+	return ok;
+}
+
+int store_mget(store *st, const uuid *uuids, int n, void (*f)(void*,const uuid*,const void*,int), void *p1)
+{
+	if (!st || !uuids || (n <= 0) || !f)
+		return 0;
+
+	mget_key *keys = (mget_key*)malloc(n*sizeof(mget_key));
+
+	if (!keys)
+		return 0;
+
+	int locked = st->transactions || st->compacting;
+	int i, cnt = 0;
+
+	if (locked)
+		lock_lock(st->lk);
+
+	for (i = 0; i < n; i++)
+	{
+		unsigned long long v;
+
+		if (!tree_get(st->tptr, &uuids[i], &v))
+			continue;
+
+		mget_key *k = &keys[cnt++];
+		k->u = uuids[i];
+		k->idx = FILEIDX(v);
+		k->pos = POS(v);
+		k->fd = store_fd_pin(st, k->idx, &k->gen);
+	}
+
+	if (locked)
+		lock_unlock(st->lk);
+
+	qsort(keys, cnt, sizeof(mget_key), &mget_compare);
+
+	// Coalesce records close together in the same log file...
+
+	mget_run *runs = (mget_run*)calloc(cnt ? cnt : 1, sizeof(mget_run));
+	int nruns = 0;
+
+	for (i = 0; i < cnt; i++)
+	{
+		mget_run *r = nruns ? &runs[nruns-1] : NULL;
+
+		if (r && (keys[i].fd == r->fd) && ((keys[i].pos - (keys[r->first+r->cnt-1].pos)) <= MGET_GAP) &&
+			((keys[i].pos - r->pos) <= MGET_SPAN))
+		{
+			r->cnt++;
+			r->len = (size_t)(keys[i].pos - r->pos) + MGET_TAIL;
+			continue;
+		}
+
+		r = &runs[nruns++];
+		r->first = i;
+		r->cnt = 1;
+		r->fd = keys[i].fd;
+		r->pos = keys[i].pos;
+		r->len = MGET_TAIL;
+	}
+
+	// ...and with more than one read to do, have a pool of
+	// threads issue them ahead of us.
+
+	mget_ctx ctx = {runs, NULL, NULL, nruns, 0};
+	int threads = 0;
+
+	if (nruns > 1)
+	{
+		ctx.ev = event_create();
+		ctx.exited = event_create();
+	}
+
+	if (ctx.ev && ctx.exited)
+	{
+		if (!st->tp)
+		{
+			lock_lock(st->lk);
+
+			if (!st->tp)
+			{
+				int threads = MGET_THREADS;
+#ifndef _WIN32
+				threads = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+#endif
+				st->tp = tpool_create(threads < 1 ? 1 : threads > MGET_THREADS ? MGET_THREADS : threads);
+			}
+
+			lock_unlock(st->lk);
+		}
+
+		int n = nruns-1 < MGET_THREADS ? nruns-1 : MGET_THREADS;
+
+		for (i = 0; i < n; i++)
+			threads += tpool_start(st->tp, &mget_worker, &ctx);
+	}
+
+	int found = 0;
+
+	for (i = 0; i < nruns; i++)
+	{
+		mget_run *r = &runs[i];
+
+		while (!r->done)
+		{
+			unsigned seq = event_count(ctx.ev);
+			int j = atomic_inc(&ctx.next);
+
+			if (j < nruns)
+				mget_read(&ctx, &runs[j]);
+			else if (!r->done)
+				event_wait(ctx.ev, seq, -1);
+		}
+
+		int j;
+
+		for (j = 0; j < r->cnt; j++)
+			found += mget_record(st, r, &keys[r->first+j], f, p1);
+
+		free(r->buf);
+		r->buf = NULL;
+	}
+
+	unsigned exited;
+
+	while ((exited = event_count(ctx.exited)) < (unsigned)threads)
+		event_wait(ctx.exited, exited, -1);
+
+	event_destroy(ctx.exited);
+	event_destroy(ctx.ev);
+
+	for (i = 0; i < cnt; i++)
+		store_fd_unpin(st, keys[i].idx, keys[i].gen);
+
+	free(runs);
+	free(keys);
+	return found;
+}
+
+// A range cursor takes keys from the tree a batch at a time, in key
+// order, and before handing over one batch advises the kernel of the
+// log extents the next will need, so that reads are mostly cached.
+
+typedef struct
+{
+	uuid u;
+	uint64_t fp;
+}
+ range_key;
+
+typedef struct
+{
+	range_key keys[RANGE_BATCH];
+	int cnt;
+}
+ range_batch;
+
+struct store_range_
+{
+	store *st;
+	uuid next, to;
+	range_batch b[2];
+	int cur, off, bounded, done;
+};
+
+static int store_range_item(void *p1, const uuid *k, unsigned long long *v)
+{
+	range_batch *b = (range_batch*)p1;
+	b->keys[b->cnt].u = *k;
+	b->keys[b->cnt].fp = *v;
+	return ++b->cnt < RANGE_BATCH ? 1 : -1;
+}
+
+static void store_range_fill(store_range *r, range_batch *b)
+{
+	b->cnt = 0;
+
+	if (r->done)
+		return;
+
+	store *st = r->st;
+	int locked = st->transactions || st->compacting;
+
+	if (locked)
+		lock_lock(st->lk);
+
+	tree_range(st->tptr, &r->next, r->bounded ? &r->to : NULL, b, &store_range_item);
+
+#ifndef _WIN32
+	int i = 0;
+
+	while (i < b->cnt)
+	{
+		int idx = FILEIDX(b->keys[i].fp);
+		uint64_t lo = POS(b->keys[i].fp), hi = lo;
+
+		for (i++; (i < b->cnt) && (FILEIDX(b->keys[i].fp) == idx); i++)
+		{
+			uint64_t pos = POS(b->keys[i].fp);
+			uint64_t gap = pos < lo ? lo - pos : pos > hi ? pos - hi : 0;
+
+			if (gap > MGET_GAP)
+				break;
+
+			if (pos < lo) lo = pos;
+			if (pos > hi) hi = pos;
+		}
+
+		posix_fadvise(SEG(st,idx)->fd, lo, hi - lo + MGET_TAIL, POSIX_FADV_WILLNEED);
+	}
+#endif
+
+	if (locked)
+		lock_unlock(st->lk);
+
+	if (b->cnt < RANGE_BATCH)
+		r->done = 1;
+	else
+	{
+		r->next = b->keys[b->cnt-1].u;
+
+		if (!++r->next.u2)
+			r->next.u1++;
+	}
+}
+
+store_range *store_scan_open(store *st, uint64_t from_ts, uint64_t to_ts)
+{
+	if (!st)
+		return NULL;
+
+	store_range *r = (store_range*)calloc(1, sizeof(struct store_range_));
+
+	if (!r)
+		return NULL;
+
+	r->st = st;
+	r->next = uuid_set(from_ts, 0);
+	r->to = uuid_set(to_ts, 0);
+	r->bounded = to_ts != 0;
+	store_range_fill(r, &r->b[0]);
+	store_range_fill(r, &r->b[1]);
+	return r;
+}
+
+int store_scan_next(store_range *r, int n, int (*f)(void*,const uuid*,const void*,int), void *p1)
+{
+	if (!r || !f)
+		return 0;
+
+	void *buf = NULL;
+	size_t len = 0;
+	int cnt = 0;
+
+	while ((n <= 0) || (cnt < n))
+	{
+		range_batch *b = &r->b[r->cur];
+
+		if (r->off == b->cnt)
+		{
+			if (!b->cnt)
+				break;
+
+			// Move on, and read ahead one more...
+
+			store_range_fill(r, b);
+			r->cur ^= 1;
+			r->off = 0;
+			continue;
+		}
+
+		const range_key *k = &b->keys[r->off++];
+		int nbytes = store_get(r->st, &k->u, &buf, &len);
+
+		if (nbytes <= 0)
+			continue;			// since deleted
+
+		cnt++;
+
+		if (!f(p1, &k->u, buf, nbytes))
+		{
+			cnt = -1;
+			break;
+		}
+	}
+
+	free(buf);
+	return cnt;
+}
+
+void store_scan_close(store_range *r)
+{
+	free(r);
+}
+
+int store_scan(store *st, uint64_t from_ts, uint64_t to_ts, int (*f)(void*,const uuid*,const void*,int), void *p1)
+{
+	store_range *r = store_scan_open(st, from_ts, to_ts);
+	int cnt = store_scan_next(r, 0, f, p1);
+	store_scan_close(r);
+	return cnt;
+}
+
+static uint64_t store_usecs(void)
+{
+#ifdef _WIN32
+	return (uint64_t)GetTickCount64() * 1000;
+#else
+	struct timeval tp;
+	gettimeofday(&tp, 0);
+	return (uint64_t)tp.tv_sec * 1000 * 1000 + tp.tv_usec;
+#endif
+}
+
+// Make everything written to a log file (so far) durable. With group
+// commit callers take a ticket, and whoever finds no leader becomes
+// it: waiting a little for others to join, then syncing for all of
+// them at once. The rest just wait for their ticket to be done.
+
+static void store_sync(store *st, int idx)
+{
+	store_flush(st);
+
+	if (st->gc_batch <= 1)
+	{
+		fdatasync(SEG(st,idx)->fd);
+		return;
+	}
+
+	lock_lock(st->gc_lk);
+	uint64_t ticket = ++st->gc_req;
+
+	if (idx < st->gc_lo)
+		st->gc_lo = idx;
+
+	lock_unlock(st->gc_lk);
+	event_signal(st->gc_join);
+
+	for (;;)
+	{
+		lock_lock(st->gc_lk);
+		unsigned seq = event_count(st->gc_ev);
+
+		if (st->gc_done >= ticket)
+		{
+			lock_unlock(st->gc_lk);
+			return;
+		}
+
+		if (st->gc_leader)
+		{
+			lock_unlock(st->gc_lk);
+			event_wait(st->gc_ev, seq, -1);
+			continue;
+		}
+
+		st->gc_leader = 1;
+		lock_unlock(st->gc_lk);
+		uint64_t until = store_usecs() + st->gc_usecs;
+
+		// Woken as each joins, waiting to the millisecond...
+
+		for (;;)
+		{
+			unsigned seq2 = event_count(st->gc_join);
+			uint64_t now = store_usecs();
+
+			if (((st->gc_req - st->gc_done) >= st->gc_batch) || (now >= until))
+				break;
+
+			event_wait(st->gc_join, seq2, (int)((until-now+999)/1000));
+		}
+
+		lock_lock(st->gc_lk);
+		uint64_t upto = st->gc_req;
+		int i = st->gc_lo;
+		st->gc_lo = MAX_LOGFILES;
+		lock_unlock(st->gc_lk);
+
+		for (; i < st->idx; i++)
+			fdatasync(SEG(st,i)->fd);
+
+		lock_lock(st->gc_lk);
+		st->gc_done = upto;
+		st->gc_leader = 0;
+		lock_unlock(st->gc_lk);
+		event_signal(st->gc_ev);
+	}
+}
+
+void store_set_group_commit(store *st, unsigned usecs, unsigned batch)
+{
+	if (!st)
+		return;
+
+	st->gc_usecs = usecs;
+	st->gc_batch = batch;
+}
+
+hstore *store_begin(store *st)
+{
+	if (!st)
+		return 0;
+
+	hstore *h = (hstore*)calloc(1, sizeof(struct hstore_));
+
+	if (!h)
+		return 0;
+
+	// Under lock so a checkpoint can be sure of none in progress,
+	// and held back while one is waiting for those to finish.
+
+	lock_lock(st->lk);
+
+	while (st->ckp_wanted)
+	{
+		unsigned seq = event_count(st->ckp_ev);
+		lock_unlock(st->lk);
+		event_wait(st->ckp_ev, seq, CKP_WAIT);
+		lock_lock(st->lk);
+	}
+
+	h->nbr = atomic_inc(&st->current) + 1;	// zero means none
+	atomic_inc(&st->transactions);
+	lock_unlock(st->lk);
+	h->st = st;
+	h->wait_for_write = 1;
+	return h;
+}
+
+// A transaction stays in the log file it started in, even if that
+// gets sealed meanwhile. Compaction leaves it alone until done.
+
+static void store_join(hstore *h)
+{
+	lock_lock(h->st->lk);
+	h->idx = h->st->idx-1;
+	SEG(h->st,h->idx)->writers++;
+	lock_unlock(h->st->lk);
+}
+
+// Should memory run short the commit falls back to re-reading
+// the transaction from the log.
+
+static void store_hrecord(hstore *h, const uuid *u, unsigned flags, uint64_t pos, const void *buf, size_t len)
+{
+	if (h->reread)
+		return;
+
+	if (h->cnt == h->max)
+	{
+		int max = h->max ? h->max*2 : 16;
+		tr_item *tmp = (tr_item*)realloc(h->items, max*sizeof(tr_item));
+
+		if (!tmp)
+		{
+			h->reread = 1;
+			return;
+		}
+
+		h->items = tmp;
+		h->max = max;
+	}
+
+	tr_item *item = &h->items[h->cnt];
+	item->u = *u;
+	item->pos = pos;
+	item->flags = flags;
+	item->len = len;
+	item->data = NULL;
+
+	if (h->st->f && len)
+	{
+		if (!(item->data = (char*)malloc(len+1)))
+		{
+			h->reread = 1;
+			return;
+		}
+
+		memcpy(item->data, buf, len);
+		item->data[len] = 0;
+	}
+
+	h->cnt++;
+}
+
+static void store_hfree(hstore *h)
+{
+	int i;
+
+	for (i = 0; i < h->cnt; i++)
+		free(h->items[i].data);
+
+	free(h->items);
+	free(h);
+}
+
+static void store_happly(hstore *h)
+{
+	store *st = h->st;
+	int i;
+
+	if (h->reread)
+	{
+		store_apply(st, h->idx, h->nbr, h->start_pos);
+		return;
+	}
+
+	lock_lock(st->lk);
+
+	for (i = 0; i < h->cnt; i++)
+	{
+		tr_item *item = &h->items[i];
+
+		if (!(item->flags & FLAG_RM))
+			store_index(st, &item->u, MAKE_FILEPOS(h->idx,item->pos));
+		else
+			store_unindex(st, &item->u);
+
+		if (st->f)
+			st->f(st->p1, &item->u, item->data, item->flags&FLAG_RM?-(int)item->len:(int)item->len);
+	}
+
+	lock_unlock(st->lk);
+}
+
+int store_hget(hstore *h, const uuid *u, void **buf, size_t *len)
+{
+	if (!h)
+		return 0;
+
+	return store_get(h->st, u, buf, len);
+}
+
+int store_hadd(hstore *h, const uuid *u, const void *buf, size_t len)
+{
+	if (!h || !u || !buf || !len)
+		return 0;
+
+	char tmpbuf[256];
+	char *dst = tmpbuf;
+
+	if (h->wait_for_write)
+	{
+		dst += prefix(dst, h->nbr, NULL, TR_BEGIN, NULL, 0);
+		store_join(h);
+	}
+
+	char *lz;
+	const void *data = buf;
+	size_t nbytes = len;
+	unsigned flags = store_deflate(h->st, &data, &nbytes, &lz);
+	int plen = dst - tmpbuf;
+	plen += prefix(dst, h->nbr, u, flags, data, nbytes);
+	uint64_t pos = atomic_addu64(&SEG(h->st,h->idx)->eodpos, plen+nbytes);
+
+	if (h->wait_for_write)
+	{
+		h->wait_for_write = 0;
+		h->start_pos = pos;
+	}
+
+	int ok = store_write2(h->st, h->idx, tmpbuf, plen, data, nbytes, pos);
+	free(lz);
+
+	if (ok)
+		store_hrecord(h, u, flags, pos+(dst-tmpbuf), buf, len);
+
+	return ok;
+}
+
+int store_hrem2(hstore *h, const uuid *u, const void *buf, size_t len)
+{
+	if (!h || !u)
+		return 0;
+
+	char tmpbuf[256];
+	char *dst = tmpbuf;
+
+	if (h->wait_for_write)
+	{
+		dst += prefix(dst, h->nbr, NULL, TR_BEGIN, NULL, 0);
+		store_join(h);
+	}
+
+	char *lz;
+	const void *data = buf;
+	size_t nbytes = len;
+	unsigned flags = FLAG_RM | store_deflate(h->st, &data, &nbytes, &lz);
+	int plen = dst - tmpbuf;
+	plen += prefix(dst, h->nbr, u, flags, data, nbytes);
+	uint64_t pos = atomic_addu64(&SEG(h->st,h->idx)->eodpos, plen+nbytes);
+
+	if (h->wait_for_write)
+	{
+		h->wait_for_write = 0;
+		h->start_pos = pos;
+	}
+
+	int ok = store_write2(h->st, h->idx, tmpbuf, plen, data, nbytes, pos);
+	free(lz);
+
+	if (ok)
+		store_hrecord(h, u, flags, pos+(dst-tmpbuf), buf, len);
+
+	return ok;
+}
+
+int store_hrem(hstore *h, const uuid *u)
+{
+	if (!h || !u)
+		return 0;
+
+	char tmpbuf[256];
+	char *dst = tmpbuf;
+
+	if (h->wait_for_write)
+	{
+		dst += prefix(dst, h->nbr, NULL, TR_BEGIN, NULL, 0);
+		store_join(h);
+	}
+
+	unsigned flags = FLAG_RM;
+	int plen = dst - tmpbuf;
+	plen += prefix(dst, h->nbr, u, flags, NULL, 0);
+	uint64_t pos = atomic_addu64(&SEG(h->st,h->idx)->eodpos, plen);
+
+	if (h->wait_for_write)
+	{
+		h->wait_for_write = 0;
+		h->start_pos = pos;
+	}
+
+	int ok = store_write(h->st, h->idx, tmpbuf, plen, pos);
+
+	if (ok)
+		store_hrecord(h, u, flags, pos+(dst-tmpbuf), NULL, 0);
+
+	return ok;
+}
+
+// The last transaction to finish wakes a checkpoint waiting on it.
+
+static void store_tdone(store *st)
+{
+	if (!atomic_dec_and_zero(&st->transactions, &st->current) && st->ckp_wanted)
+		event_signal(st->ckp_ev);
+}
+
+int store_cancel(hstore *h)
+{
+	if (!h)
+		return 0;
+
+	if (!h->wait_for_write)
+	{
+		char tmpbuf[256];
+		int len = prefix(tmpbuf, h->nbr, NULL, TR_CANCEL, NULL, 0);
+		uint64_t pos = atomic_addu64(&SEG(h->st,h->idx)->eodpos, len);
+		int ok2 = store_write(h->st, h->idx, tmpbuf, len, pos);
+
+		atomic_dec(&SEG(h->st,h->idx)->writers);
+
+		if (!ok2)
+		{
+			store_tdone(h->st);
+			store_hfree(h);
+			return 0;
+		}
+	}
+
+	store *st = h->st;
+	store_tdone(st);
+	store_hfree(h);
+	store_notify(st);
+	return 1;
+}
+
+int store_end(hstore *h, int dbsync)
+{
+	if (!h)
+		return 0;
+
+	if (!h->wait_for_write)
+	{
+		char tmpbuf[256];
+		int len = prefix(tmpbuf, h->nbr, NULL, TR_END, NULL, 0);
+		uint64_t pos = atomic_addu64(&SEG(h->st,h->idx)->eodpos, len);
+		int ok2 = store_write(h->st, h->idx, tmpbuf, len, pos);
+
+		if (!ok2)
+		{
+			atomic_dec(&SEG(h->st,h->idx)->writers);
+			store_tdone(h->st);
+			store_hfree(h);
+			return 0;
+		}
+
+		store_happly(h);
+
+		if (dbsync)
+			store_sync(h->st, h->idx);
+
+		atomic_dec(&SEG(h->st,h->idx)->writers);
+	}
+
+	store *st = h->st;
+	int idx = h->wait_for_write ? -1 : h->idx;
+	store_tdone(st);
+	store_hfree(h);
+
+	store_notify(st);
+
+	if (idx >= 0)
+		store_rotate(st, idx);
+
+	store_autocheckpoint(st);
+	return 1;
+}
+
+// Make sure 'need' bytes from 'pos' are buffered, as far as the file
+// goes, reading a whole buffer ahead at a time. The buffer has room
+// for a trailing NUL. Returns the offset of 'pos' in the buffer.
+
+static int store_fill(int fd, char **buf, size_t *bufsize, uint64_t *bufpos, size_t *nread, uint64_t pos, size_t need)
+{
+	if ((pos >= *bufpos) && ((pos - *bufpos + need) <= *nread))
+		return (int)(pos - *bufpos);
+
+	if (need > *bufsize)
+	{
+		char *tmp = (char*)realloc(*buf, need+1);
+
+		if (!tmp)
+			return -1;
+
+		*buf = tmp;
+		*bufsize = need;
+	}
+
+	*bufpos = pos;
+	long n = pread(fd, *buf, *bufsize, pos);
+	*nread = n > 0 ? n : 0;
+	return 0;
+}
+
+// Replay a log file from its current end-of-data position (which
+// is zero, unless a checkpoint has already accounted for some). It
+// is read a buffer at a time, and ends at the first record that is
+// incomplete or fails its CRC, as when torn by a crash.
+
+static void store_load_file(store *st, int idx)
+{
+	uint64_t pos = SEG(st,idx)->eodpos, bufpos = pos;
+	size_t bufsize = SCAN_BUFSIZE, nread = 0;
+	char *buf = (char*)malloc(bufsize+1);
+	unsigned cnt = 0;
+	int fd = SEG(st,idx)->fd;
+
+	// Transactions may be interleaved, so keep track of where
+	// each pending one began: they are applied on commit.
+
+	struct { unsigned nbr; uint64_t pos; } *trans = NULL;
+	int ntrans = 0, i;
+
+	while (buf)
+	{
+		int off = store_fill(fd, &buf, &bufsize, &bufpos, &nread, pos, 256);
+
+		if (off < 0)
+			break;
+
+		unsigned nbr, flags, nbytes;
+		uuid u;
+		rec_hdr hdr;
+		int skip = parse(buf+off, nread-off, &nbr, &u, &flags, &nbytes, &hdr);
+
+		if (!skip)
+			break;
+
+		if (!hdr.magic)
+			SEG(st,idx)->text = 1;
+
+		if ((off = store_fill(fd, &buf, &bufsize, &bufpos, &nread, pos, skip+nbytes)) < 0)
+			break;
+
+		if ((off + skip + nbytes) > nread)
+			break;
+
+		char *src = buf + off + skip;
+
+		if (hdr.magic && !verify(&hdr, src))
+			break;
+
+		if (flags == TR_BEGIN)
+		{
+			void *tmp = realloc(trans, (ntrans+1)*sizeof(*trans));
+			if (!tmp) break;
+			trans = tmp;
+			trans[ntrans].nbr = nbr;
+			trans[ntrans++].pos = pos;
+		}
+		else if ((flags == TR_END) || (flags == TR_CANCEL))
+		{
+			for (i = 0; i < ntrans; i++)
+			{
+				if (trans[i].nbr != nbr)
+					continue;
+
+				if (flags == TR_END)			// apply on commit
+					cnt += store_apply(st, idx, nbr, trans[i].pos);
+
+				trans[i] = trans[--ntrans];		// drop on rollback
+				break;
+			}
+		}
+		else if (nbr != 0)
+		{
+		}
+		else
+		{
+			if (!(flags & FLAG_RM))
+			{
+				uint64_t fp = MAKE_FILEPOS(idx,pos);
+				store_index(st, &u, fp);
+			}
+			else
+				tree_del(st->tptr, &u);
+
+			if (st->f)
+			{
+				if (nbytes)
+				{
+					// Terminated in place, so put back what that
+					// overwrites (the start of the next record).
+
+					char save = src[nbytes];
+					int big = 0;
+					unsigned len;
+					src[nbytes] = 0;
+					char *data = store_inflate(flags, src, nbytes, &len, &big);
+
+					if (data)
+						st->f(st->p1, &u, data, flags&FLAG_RM?-(int)len:(int)len);
+
+					if (big) free(data);
+					src[nbytes] = save;
+
+					if (!data)
+						break;
+				}
+				else
+					st->f(st->p1, &u, NULL, 0);
+			}
+
+			cnt++;
+		}
+
+		pos += skip;
+		pos += nbytes;
+	}
+
+	free(trans);
+	free(buf);
+	SEG(st,idx)->eodpos = pos;
+	printf("store_load_file: '%s' applied=%u, size=%llu MiB\n", SEG(st,idx)->filename, cnt, (unsigned long long)pos/1024/1024);
+}
+
+// Whatever lies beyond the last valid record in what was the active
+// log is a write torn by a crash: cut it off, so that the file reads
+// cleanly from now on. Anywhere else it is reported, but left.
+
+static void store_truncate(store *st, int idx, int last)
+{
+	struct stat s = {0};
+
+	if (SEG(st,idx)->text || fstat(SEG(st,idx)->fd, &s) || ((uint64_t)s.st_size <= SEG(st,idx)->eodpos))
+		return;
+
+	uint64_t torn = (uint64_t)s.st_size - SEG(st,idx)->eodpos;
+
+	if (!last)
+	{
+		printf("store_open: '%s' invalid record, pos=%llu\n", SEG(st,idx)->filename, (unsigned long long)SEG(st,idx)->eodpos);
+		return;
+	}
+
+	printf("store_open: '%s' torn write, truncated %llu bytes at pos=%llu\n", SEG(st,idx)->filename, (unsigned long long)torn, (unsigned long long)SEG(st,idx)->eodpos);
+
+#ifndef _WIN32
+	if (truncate(SEG(st,idx)->filename, SEG(st,idx)->eodpos) < 0)
+		printf("store_open: truncate '%s' error: %s\n", SEG(st,idx)->filename, strerror(errno));
+#endif
+}
+
+// Parallel recovery: each log file is scanned on a thread-pool with
+// large sequential reads, producing a run of committed operations.
+// Runs are sorted by key (keeping only the last operation on each),
+// then merged across files so later files win, and applied to the
+// tree in key order, mostly as appends.
+
+typedef struct
+{
+	uuid u;
+	uint64_t pos;
+	unsigned flags, len, seq;
+}
+ scan_op;
+
+typedef struct
+{
+	scan_op *ops;
+	size_t cnt, max;
+	int failed;
+}
+ scan_run;
+
+typedef struct
+{
+	unsigned nbr;
+	scan_run run;
+}
+ scan_tran;
+
+typedef struct
+{
+	store *st;
+	scan_run *runs;
+	event *exited;
+	int next;
+}
+ scan_ctx;
+
+static int scan_push(scan_run *run, const scan_op *op)
+{
+	if (run->cnt == run->max)
+	{
+		size_t max = run->max ? run->max*2 : 1024;
+		scan_op *ops = (scan_op*)realloc(run->ops, max*sizeof(scan_op));
+
+		if (!ops)
+			return 0;
+
+		run->ops = ops;
+		run->max = max;
+	}
+
+	run->ops[run->cnt++] = *op;
+	return 1;
+}
+
+static int scan_compare(const void *p1, const void *p2)
+{
+	const scan_op *op1 = (const scan_op*)p1, *op2 = (const scan_op*)p2;
+	int x = uuid_compare(&op1->u, &op2->u);
+
+	if (x)
+		return x;
+
+	return op1->seq < op2->seq ? -1 : op1->seq > op2->seq ? 1 : 0;
+}
+
+static void store_scan_file(store *st, int idx, scan_run *run)
+{
+	int fd = SEG(st,idx)->fd;
+	uint64_t pos = SEG(st,idx)->eodpos, bufpos = pos;
+	size_t bufsize = SCAN_BUFSIZE, nread = 0;
+	char *buf = (char*)malloc(bufsize+1);
+	scan_tran *trans = NULL;
+	int ntrans = 0, i;
+
+	while (buf)
+	{
+		// Refill when the next header may not be wholly buffered.
+
+		int off = store_fill(fd, &buf, &bufsize, &bufpos, &nread, pos, 256);
+
+		if (off < 0)
+		{
+			run->failed = 1;
+			break;
+		}
+
+		unsigned nbr, flags, nbytes;
+		scan_op op;
+		rec_hdr hdr;
+		int skip = parse(buf+off, nread-off, &nbr, &op.u, &flags, &nbytes, &hdr);
+
+		if (!skip)
+			break;
+
+		if (!hdr.magic)
+			SEG(st,idx)->text = 1;
+
+		// Make sure the whole record is there, and intact...
+
+		if ((off = store_fill(fd, &buf, &bufsize, &bufpos, &nread, pos, skip+nbytes)) < 0)
+		{
+			run->failed = 1;
+			break;
+		}
+
+		if ((off + skip + nbytes) > nread)
+			break;
+
+		if (hdr.magic && !verify(&hdr, buf+off+skip))
+			break;
+
+		op.pos = pos;
+		op.flags = flags;
+		op.len = nbytes;
+		op.seq = run->cnt;
+
+		if (flags == TR_BEGIN)
+		{
+			scan_tran *tmp = (scan_tran*)realloc(trans, (ntrans+1)*sizeof(scan_tran));
+
+			if (!tmp)
+			{
+				run->failed = 1;
+				break;
+			}
+
+			trans = tmp;
+			memset(&trans[ntrans], 0, sizeof(scan_tran));
+			trans[ntrans++].nbr = nbr;
+		}
+		else if ((flags == TR_END) || (flags == TR_CANCEL))
+		{
+			for (i = 0; i < ntrans; i++)
+			{
+				if (trans[i].nbr != nbr)
+					continue;
+
+				size_t j;
+
+				for (j = 0; (flags == TR_END) && (j < trans[i].run.cnt); j++)
+				{
+					trans[i].run.ops[j].seq = run->cnt;
+
+					if (!scan_push(run, &trans[i].run.ops[j]))
+						run->failed = 1;
+				}
+
+				if (trans[i].run.failed)
+					run->failed = 1;
+
+				free(trans[i].run.ops);
+				trans[i] = trans[--ntrans];
+				break;
+			}
+		}
+		else
+		{
+			for (i = 0; nbr && (i < ntrans); i++)
+			{
+				if (trans[i].nbr == nbr)
+					break;
+			}
+
+			if (nbr && (i < ntrans))
+			{
+				if (!scan_push(&trans[i].run, &op))
+					trans[i].run.failed = 1;
+			}
+			else if (!nbr && !scan_push(run, &op))
+				run->failed = 1;
+		}
+
+		if (run->failed)
+			break;
+
+		pos += skip;
+		pos += nbytes;
+	}
+
+	if (!buf)
+		run->failed = 1;
+
+	for (i = 0; i < ntrans; i++)
+		free(trans[i].run.ops);
+
+	free(trans);
+	free(buf);
+	SEG(st,idx)->eodpos = pos;
+}
+
+static int store_scan_worker(void *p1)
+{
+	scan_ctx *ctx = (scan_ctx*)p1;
+	int idx;
+
+	while ((idx = atomic_inc(&ctx->next)) < ctx->st->idx)
+	{
+		scan_run *run = &ctx->runs[idx];
+		store_scan_file(ctx->st, idx, run);
+
+		// The callback needs log order, so sort a copy.
+
+		if (run->cnt && !ctx->st->f)
+			qsort(run->ops, run->cnt, sizeof(scan_op), &scan_compare);
+	}
+
+	event_signal(ctx->exited);
+	return 1;
+}
+
+static void store_scan_callback(store *st, int idx, scan_run *run)
+{
+	int fd = SEG(st,idx)->fd;
+	size_t i;
+
+	for (i = 0; i < run->cnt; i++)
+	{
+		scan_op *op = &run->ops[i];
+		char tmpbuf[1024];
+		int nread = pread(fd, tmpbuf, sizeof(tmpbuf)-1, op->pos);
+		unsigned nbr, flags, nbytes;
+		uuid u;
+		int skip = parse(tmpbuf, nread, &nbr, &u, &flags, &nbytes, NULL);
+
+		if (!skip)
+			break;
+
+		if (!nbytes)
+		{
+			st->f(st->p1, &u, NULL, 0);
+			continue;
+		}
+
+		int big;
+		unsigned len;
+		char *src = payload(fd, tmpbuf, nread, skip, nbytes, op->pos, &big);
+		src = store_inflate(flags, src, nbytes, &len, &big);
+
+		if (!src)
+			break;
+
+		st->f(st->p1, &u, src, flags&FLAG_RM?-(int)len:(int)len);
+		if (big) free(src);
+	}
+}
+
+// A min-heap of runs ordered by current key, then by file.
+
+typedef struct
+{
+	scan_run *runs;
+	size_t *cursor;
+	int *idx, cnt;
+}
+ merge_heap;
+
+static int heap_less(merge_heap *h, int i, int j)
+{
+	const scan_op *op1 = &h->runs[h->idx[i]].ops[h->cursor[h->idx[i]]];
+	const scan_op *op2 = &h->runs[h->idx[j]].ops[h->cursor[h->idx[j]]];
+	int x = uuid_compare(&op1->u, &op2->u);
+	return x ? x < 0 : h->idx[i] < h->idx[j];
+}
+
+static void heap_swap(merge_heap *h, int i, int j)
+{
+	int tmp = h->idx[i];
+	h->idx[i] = h->idx[j];
+	h->idx[j] = tmp;
+}
+
+static void heap_push(merge_heap *h, int idx)
+{
+	int i = h->cnt++;
+	h->idx[i] = idx;
+
+	while (i && heap_less(h, i, (i-1)/2))
+	{
+		heap_swap(h, i, (i-1)/2);
+		i = (i-1)/2;
+	}
+}
+
+static int heap_pop(merge_heap *h)
+{
+	int idx = h->idx[0], i = 0;
+	h->idx[0] = h->idx[--h->cnt];
+
+	for (;;)
+	{
+		int l = i*2+1, r = l+1, m = i;
+
+		if ((l < h->cnt) && heap_less(h, l, m))
+			m = l;
+
+		if ((r < h->cnt) && heap_less(h, r, m))
+			m = r;
+
+		if (m == i)
+			break;
+
+		heap_swap(h, i, m);
+		i = m;
+	}
+
+	return idx;
+}
+
+static const scan_op *heap_top(merge_heap *h)
+{
+	return &h->runs[h->idx[0]].ops[h->cursor[h->idx[0]]];
+}
+
+static int store_load_serial(store *st)
+{
+	int idx, replayed = 0;
+
+	for (idx = 0; idx < st->idx; idx++)
+	{
+		uint64_t pos = SEG(st,idx)->eodpos;
+		store_load_file(st, idx);
+		replayed += SEG(st,idx)->eodpos != pos;
+	}
+
+	return replayed;
+}
+
+static int store_load_parallel(store *st, int update)
+{
+	int threads = 4, idx, replayed = 0;
+
+#ifndef _WIN32
+	threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	if (threads > st->idx)
+		threads = st->idx;
+
+	if (threads < 1)
+		threads = 1;
+
+	scan_ctx ctx = {0};
+	ctx.st = st;
+	ctx.runs = (scan_run*)calloc(st->idx ? st->idx : 1, sizeof(scan_run));
+	ctx.exited = event_create();
+	uint64_t *start = (uint64_t*)malloc((st->idx ? st->idx : 1)*sizeof(uint64_t));
+
+	if (!ctx.runs || !ctx.exited || !start)
+	{
+		free(ctx.runs);
+		event_destroy(ctx.exited);
+		free(start);
+		return store_load_serial(st);
+	}
+
+	for (idx = 0; idx < st->idx; idx++)
+		start[idx] = SEG(st,idx)->eodpos;
+
+	thread_pool *tp = threads > 1 ? tpool_create(threads-1) : NULL;
+	unsigned started = 1, exited;
+	int i, failed = 0;
+
+	for (i = 1; tp && (i < threads); i++)
+		started += tpool_start(tp, &store_scan_worker, &ctx);
+
+	store_scan_worker(&ctx);
+
+	// Signalling is each worker's last act...
+
+	while ((exited = event_count(ctx.exited)) < started)
+		event_wait(ctx.exited, exited, -1);
+
+	tpool_destroy(tp);
+	event_destroy(ctx.exited);
+
+	for (idx = 0; idx < st->idx; idx++)
+		failed |= ctx.runs[idx].failed;
+
+	// The merge needs a cursor and heap slot per file...
+
+	merge_heap heap = {0};
+	heap.runs = ctx.runs;
+	heap.cursor = (size_t*)calloc(st->idx ? st->idx : 1, sizeof(size_t));
+	heap.idx = (int*)calloc(st->idx ? st->idx : 1, sizeof(int));
+
+	// Short of memory, do it the slow way...
+
+	if (failed || !heap.cursor || !heap.idx)
+	{
+		printf("store_load_parallel: out of memory, loading serially\n");
+
+		for (idx = 0; idx < st->idx; idx++)
+		{
+			SEG(st,idx)->eodpos = start[idx];
+			free(ctx.runs[idx].ops);
+		}
+
+		free(heap.cursor);
+		free(heap.idx);
+		free(ctx.runs);
+		free(start);
+		return store_load_serial(st);
+	}
+
+	for (idx = 0; idx < st->idx; idx++)
+	{
+		if (SEG(st,idx)->eodpos != start[idx])
+			replayed++;
+
+		if (!st->f || !ctx.runs[idx].cnt)
+			continue;
+
+		store_scan_callback(st, idx, &ctx.runs[idx]);
+		qsort(ctx.runs[idx].ops, ctx.runs[idx].cnt, sizeof(scan_op), &scan_compare);
+	}
+
+	// Merge the sorted runs: the last operation on a key in the
+	// latest file to have one is what counts.
+
+	unsigned long cnt = 0;
+
+	for (idx = 0; idx < st->idx; idx++)
+	{
+		if (ctx.runs[idx].cnt)
+			heap_push(&heap, idx);
+	}
+
+	while (heap.cnt)
+	{
+		const scan_op *best = NULL;
+		int best_idx = -1;
+		uuid u = heap_top(&heap)->u;
+
+		// Pop every run positioned on this key, ascending by file,
+		// advancing each past its last operation on the key...
+
+		while (heap.cnt && !uuid_compare(&heap_top(&heap)->u, &u))
+		{
+			idx = heap_pop(&heap);
+			scan_run *run = &ctx.runs[idx];
+
+			while (((heap.cursor[idx]+1) < run->cnt) && !uuid_compare(&run->ops[heap.cursor[idx]+1].u, &u))
+				heap.cursor[idx]++;
+
+			best = &run->ops[heap.cursor[idx]++];
+			best_idx = idx;
+
+			if (heap.cursor[idx] < run->cnt)
+				heap_push(&heap, idx);
+		}
+
+		if (!(best->flags & FLAG_RM))
+		{
+			uint64_t fp = MAKE_FILEPOS(best_idx,best->pos);
+
+			if (!update || !tree_set(st->tptr, &best->u, fp))
+				tree_add(st->tptr, &best->u, fp);
+		}
+		else if (update)
+			tree_del(st->tptr, &best->u);
+
+		cnt++;
+	}
+
+	free(heap.cursor);
+	free(heap.idx);
+
+	for (idx = 0; idx < st->idx; idx++)
+	{
+		printf("store_load_parallel: '%s' applied=%lu, size=%llu MiB\n", SEG(st,idx)->filename, (unsigned long)ctx.runs[idx].cnt, (unsigned long long)SEG(st,idx)->eodpos/1024/1024);
+		free(ctx.runs[idx].ops);
+	}
+
+	printf("store_load_parallel: threads=%d, keys=%lu\n", threads, cnt);
+	free(ctx.runs);
+	free(start);
+	return replayed;
+}
+
+// Records are re-written in binary format, whatever they were.
+
+static int store_merge_item(void *h, const uuid *u, unsigned long long *v)
+{
+	store *st = (store*)h;
+	int idx = FILEIDX(*v);
+
+	if (idx == 0)
+		return 0;
+
+	int fd = SEG(st,idx)->fd;
+	uint64_t pos = POS(*v);
+	char tmpbuf[1024];
+	int nread = pread(fd, tmpbuf, sizeof(tmpbuf)-1, pos);
+
+	if (nread <= 0)
+	{
+		printf("store_merge_item pread fd=%d prefix failed, pos=%llu\n", fd, (unsigned long long)pos);
+		return -1;
+	}
+
+	unsigned nbr, flags, nbytes;
+	uuid tmp_u;
+	int skip = parse(tmpbuf, nread, &nbr, &tmp_u, &flags, &nbytes, NULL);
+
+	if (!skip || (uuid_compare(u, &tmp_u) != 0))	// CHECK uuid match
+	{
+		char tmpbuf1[256], tmpbuf2[256];
+		printf("store_merge_item failed uuid=%s !=%s failed\n", uuid_to_string(u, tmpbuf1), uuid_to_string(&tmp_u, tmpbuf2));
+		return -1;
+	}
+
+	if (nbytes == 0)					// CHECK has length
+	{
+		printf("store_merge_item failed invalid length\n");
+		return -1;
+	}
+
+	int big;
+	char *buf = payload(fd, tmpbuf, nread, skip, nbytes, pos, &big);
+
+	if (!buf)
+	{
+		printf("store_merge_item pread fd=%d data failed, pos=%llu\n", fd, (unsigned long long)(pos+skip));
+		return -1;
+	}
+
+	char hdrbuf[REC_HDR_SIZE];
+	int plen = prefix(hdrbuf, 0, u, flags & FLAG_LZ, buf, nbytes);
+	int len = plen+nbytes;
+	long wlen = pwrite2(SEG(st,0)->fd, hdrbuf, plen, buf, nbytes, SEG(st,0)->eodpos);
+
+	if (big) free(buf);
+
+	if (wlen != len)
+	{
+		printf("store_merge_item write fd=%d data failed, pos=%llu\n", fd, (unsigned long long)SEG(st,0)->eodpos);
+		return -1;
+	}
+
+	*v = SEG(st,0)->eodpos;
+	SEG(st,0)->eodpos += len;
+	return 1;
+}
+
+// Make room in the table for one more log file. A bigger table is
+// published whole, the old one left for any reader still using it.
+
+static segment *store_segment(store *st)
+{
+	seg_table *t = st->segs;
+
+	if (!t || (st->idx == t->size))
+	{
+		int size = t ? t->size*2 : 16;
+		seg_table *t2 = (seg_table*)calloc(1, sizeof(seg_table)+size*sizeof(segment*));
+
+		if (!t2)
+			return NULL;
+
+		if (t)
+			memcpy(t2->seg, t->seg, t->size*sizeof(segment*));
+
+		t2->prev = t;
+		t2->size = size;
+		st->segs = t = t2;
+	}
+
+	segment *sp = t->seg[st->idx];
+
+	if (!sp)
+		return t->seg[st->idx] = (segment*)calloc(1, sizeof(segment));
+
+	// Reused after a merge...
+
+	free(sp->filename);
+	memset(sp, 0, sizeof(segment));
+	return sp;
+}
+
+static int store_open_file(store *st, const char *filename, int readonly, int create)
+{
+	if (!st || (st->idx == MAX_LOGFILES))
+		return 0;
+
+	segment *sp = store_segment(st);
+
+	if (!sp)
+		return 0;
+
+	int fd = sp->fd = open(filename, (create?O_CREAT:0)|(readonly?O_RDONLY:O_RDWR), 0666);
+
+	if (fd < 0)
+		return 0;
+
+	// Older logs may start with text-format records...
+
+	char ch = 0;
+	pread(fd, &ch, 1, 0);
+	sp->filename = strdup(filename);
+	sp->text = (ch == '[') || (ch == '\n');
+	st->idx++;
+	return 1;
+}
+
+static int store_merge(store *st)
+{
+	if (!st)
+		return 0;
+
+	close(SEG(st,0)->fd);
+	SEG(st,0)->fd = open(SEG(st,0)->filename, O_RDWR, 0666);
+
+	if (SEG(st,0)->fd < 0)
+		return 0;
+
+	printf("store_merge: begin\n");
+	size_t cnt = tree_iter(st->tptr, st, &store_merge_item);
+	printf("store_merge: end, %ld items\n", (long)cnt);
+	fsync(SEG(st,0)->fd);
+	close(SEG(st,0)->fd);
+
+	while (st->idx-- > 1)
+	{
+		close(SEG(st,st->idx)->fd);
+		remove(SEG(st,st->idx)->filename);
+		SEG(st,st->idx)->eodpos = 0;
+		SEG(st,st->idx)->text = 0;
+	}
+
+	st->idx = 0;
+	string filename;
+	sprintf(filename, "%s/%s", st->path1, ZEROTH_LOG);
+	store_open_file(st, filename, 1, 1);
+	return 1;
+}
+
+
+typedef struct
+{
+	char (*names)[256];
+	int cnt, size;
+}
+ names_ctx;
+
+static int store_open_direct(store *st, int idx)
+{
+	segment *sp = SEG(st,idx);
+
+#ifdef O_DIRECT
+	int fd = open(sp->filename, O_WRONLY|O_DIRECT);
+#else
+	int fd = -1;
+	errno = ENOTSUP;
+#endif
+
+	if (fd < 0)
+	{
+		printf("store_open_direct: '%s' error: %s\n", sp->filename, strerror(errno));
+		return 0;
+	}
+
+	lock_lock(st->dio_lk);
+	sp->dfd = fd;
+	lock_unlock(st->dio_lk);
+	return 1;
+}
+
+// Timestamped log names must be unique, even if created (or the
+// store re-opened) within the same second.
+
+static int store_create_log(store *st)
+{
+	long long now = (long long)time(NULL);
+
+	if (now <= st->last_log)
+		now = st->last_log + 1;
+
+	string filename;
+
+	if (snprintf(filename, sizeof(filename), "%s/%lld.log", st->path2, now) >= (int)sizeof(filename))
+	{
+		printf("store_create_log: '%s' path too long\n", st->path2);
+		return 0;
+	}
+
+	if (!store_open_file(st, filename, 0, 1))
+	{
+		printf("store_create_log: '%s' error: %s\n", filename, strerror(errno));
+		return 0;
+	}
+
+	st->last_log = now;
+	printf("store_open_file: '%s'\n", filename);
+
+	if (st->direct)
+		store_open_direct(st, st->idx-1);
+
+	store_notify(st);
+	return 1;
+}
+
+// Once sealed, stop writing the log file directly, and cut it back
+// to its end (past which it may be allocated, or padded).
+
+static void store_trim(store *st, int idx)
+{
+	segment *sp = SEG(st,idx);
+	lock_lock(st->dio_lk);
+
+	if (sp->dfd > 0)
+		close(sp->dfd);
+
+	sp->dfd = 0;
+	sp->alloc = ~0ULL;
+	lock_unlock(st->dio_lk);
+
+	if (sp->trim && (ftruncate(sp->fd, sp->eodpos) < 0))
+		printf("store_trim: '%s' error: %s\n", sp->filename, strerror(errno));
+
+	sp->trim = 0;
+}
+
+// Seal the active log once it is big enough, and start another.
+// Writers already committed to the old one carry on regardless.
+
+static void store_rotate(store *st, int idx)
+{
+	if ((SEG(st,idx)->eodpos < st->max_logsize) || (idx != (st->idx-1)))
+		return;
+
+	lock_lock(st->lk);
+
+	if ((idx != (st->idx-1)) || (st->idx == MAX_LOGFILES))
+	{
+		lock_unlock(st->lk);
+		return;
+	}
+
+	int ok = store_create_log(st);
+	store_flush(st);
+	lock_unlock(st->lk);
+
+	if (!ok)
+		return;
+
+	store_trim(st, idx);
+	fsync(SEG(st,idx)->fd);
+}
+
+void store_set_logsize(store *st, uint64_t nbytes)
+{
+	if (!st)
+		return;
+
+	st->max_logsize = nbytes ? nbytes : MAX_LOGFILE_SIZE;
+
+	if (st->max_logsize > (1ULL<<POS_BITS)/2)
+		st->max_logsize = (1ULL<<POS_BITS)/2;
+}
+
+int store_set_prealloc(store *st, uint64_t nbytes)
+{
+	if (!st)
+		return 0;
+
+#ifndef FALLOC_FL_KEEP_SIZE
+	if (nbytes)
+		return 0;
+#endif
+
+	st->prealloc = nbytes;
+	return 1;
+}
+
+int store_set_direct(store *st, int on)
+{
+	if (!st)
+		return 0;
+
+	lock_lock(st->lk);
+	int idx = st->idx-1, ok = 1;
+
+	if (on && !st->direct)
+		ok = store_open_direct(st, idx);
+	else if (!on && st->direct)
+	{
+		lock_lock(st->dio_lk);
+		close(SEG(st,idx)->dfd);
+		SEG(st,idx)->dfd = 0;
+		lock_unlock(st->dio_lk);
+	}
+
+	st->direct = ok ? on : 0;
+	lock_unlock(st->lk);
+	return ok;
+}
+
+// Bulk loading: records are gathered into large writes, and only
+// indexed once written. Keys in order go straight on the end of
+// the tree, anything else is indexed as usual.
+
+#define BULK_BUFSIZE (8*1024*1024)
+
+typedef struct
+{
+	uuid u;
+	uint64_t off;
+}
+ bulk_key;
+
+static int store_bulk_write(store *st, int idx, const void *buf, size_t len, const void *buf2, size_t len2, bulk_key *keys, int nkeys)
+{
+	uint64_t pos = atomic_addu64(&SEG(st,idx)->eodpos, len+len2);
+
+	// Nothing else writes to this log: on failure take the space back,
+	// and cut off whatever part was written, lest reopening find it...
+
+	if (!store_write2(st, idx, buf, len, buf2, len2, pos))
+	{
+		SEG(st,idx)->eodpos = pos;
+
+		if (ftruncate(SEG(st,idx)->fd, pos) < 0)
+			printf("store_bulk_load: '%s' truncate error: %s\n", SEG(st,idx)->filename, strerror(errno));
+
+		return 0;
+	}
+
+	int locked = st->transactions || st->compacting;
+	int i;
+
+	if (locked)
+		lock_lock(st->lk);
+
+	for (i = 0; i < nkeys; i++)
+	{
+		uint64_t fp = MAKE_FILEPOS(idx,pos+keys[i].off);
+
+		if (!tree_append(st->tptr, &keys[i].u, fp))
+			store_index(st, &keys[i].u, fp);
+	}
+
+	if (locked)
+		lock_unlock(st->lk);
+
+	store_notify(st);
+	return 1;
+}
+
+unsigned long store_bulk_load(store *st, int (*f)(void*,uuid*,const void**,size_t*), void *p1, int *err)
+{
+	int dummy;
+
+	if (!err)
+		err = &dummy;
+
+	*err = STORE_BULK_WRITE;
+
+	if (!st || !f)
+		return 0;
+
+	// Into a log file of its own...
+
+	store_flush(st);
+	lock_lock(st->lk);
+	int ok = !SEG(st,st->idx-1)->eodpos || store_create_log(st);
+	int idx = st->idx-1;
+	lock_unlock(st->lk);
+
+	if (!ok)
+		return 0;
+
+	char *wbuf = (char*)malloc(BULK_BUFSIZE);
+	int nkeys = 0, maxkeys = 0;
+	bulk_key *keys = NULL;
+	unsigned long cnt = 0;
+	size_t wlen = 0;
+	uuid last = {0};
+
+	if (!wbuf)
+		return 0;
+
+	*err = 0;
+
+	for (;;)
+	{
+		const void *buf = NULL;
+		size_t len = 0;
+		uuid u;
+
+		if (f(p1, &u, &buf, &len) <= 0)
+			break;
+
+		if (!buf || !len || (len > STORE_MAX_WRITELEN))
+			continue;
+
+		if (uuid_compare(&u, &last) <= 0)
+		{
+			printf("store_bulk_load: out of order\n");
+			*err = STORE_BULK_ORDER;
+			break;
+		}
+
+		char tmpbuf[256], *lz;
+		const void *data = buf;
+		size_t nbytes = len;
+		unsigned flags = store_deflate(st, &data, &nbytes, &lz);
+		int plen = prefix(tmpbuf, 0, &u, flags, data, nbytes);
+		last = u;
+
+		if (wlen && ((wlen+plen+nbytes) > BULK_BUFSIZE))
+		{
+			if ((ok = store_bulk_write(st, idx, wbuf, wlen, NULL, 0, keys, nkeys)) != 0)
+				cnt += nkeys;
+
+			wlen = nkeys = 0;
+		}
+
+		if (nkeys == maxkeys)
+		{
+			maxkeys = maxkeys ? maxkeys*2 : 1024;
+			bulk_key *tmp = (bulk_key*)realloc(keys, maxkeys*sizeof(bulk_key));
+
+			if (!tmp)
+				ok = 0;
 			else
-				valid = 0;
+				keys = tmp;
+		}
+
+		if (!ok)
+		{
+			free(lz);
+			break;
 		}
-		else if (save_nbr != 0)
+
+		keys[nkeys].u = u;
+		keys[nkeys++].off = wlen;
+
+		// Too big to buffer, it goes on its own...
+
+		if ((plen+nbytes) > BULK_BUFSIZE)
 		{
+			if ((ok = store_bulk_write(st, idx, tmpbuf, plen, data, nbytes, keys, nkeys)) != 0)
+				cnt += nkeys;
+
+			nkeys = 0;
 		}
 		else
 		{
-			if (!(flags & FLAG_RM))
+			memcpy(wbuf+wlen, tmpbuf, plen);
+			memcpy(wbuf+wlen+plen, data, nbytes);
+			wlen += plen + nbytes;
+		}
+
+		free(lz);
+
+		if (!ok)
+			break;
+	}
+
+	if (ok && wlen && ((ok = store_bulk_write(st, idx, wbuf, wlen, NULL, 0, keys, nkeys)) != 0))
+		cnt += nkeys;
+
+	if (!ok)
+		*err = STORE_BULK_WRITE;
+
+	free(keys);
+	free(wbuf);
+	fsync(SEG(st,idx)->fd);
+	printf("store_bulk_load: '%s' loaded=%lu, size=%llu MiB\n", SEG(st,idx)->filename, cnt, (unsigned long long)SEG(st,idx)->eodpos/1024/1024);
+	store_rotate(st, idx);
+	store_autocheckpoint(st);
+	return cnt;
+}
+
+// Online compaction rewrites a sealed log file keeping only what
+// the index still refers to, in the same place in the log order, so
+// replay is unaffected. Deletes are kept if an older log file might
+// still hold what they deleted. Entries are repointed under lock.
+
+typedef struct
+{
+	uuid u;
+	uint64_t from, to;
+	unsigned size;
+}
+ cmp_move;
+
+static int store_compact_file(store *st, int idx, int measure)
+{
+	int fd = SEG(st,idx)->fd, fd2 = -1;
+	uint64_t pos = 0, eod = SEG(st,idx)->eodpos, npos = 0, live = 0;
+	cmp_move *moves = NULL;
+	size_t cnt = 0, max = 0;
+	string tmpname;
+	int ok = 1, i;
+
+	if (!measure)
+	{
+		if (snprintf(tmpname, sizeof(tmpname), "%s.cmp", SEG(st,idx)->filename) >= (int)sizeof(tmpname))
+		{
+			printf("store_compact: '%s' path too long\n", SEG(st,idx)->filename);
+			return 0;
+		}
+
+		fd2 = open(tmpname, O_CREAT|O_TRUNC|O_RDWR, 0666);
+
+		if (fd2 < 0)
+		{
+			printf("store_compact: '%s' error: %s\n", tmpname, strerror(errno));
+			return 0;
+		}
+	}
+
+	while (ok && (pos < eod))
+	{
+		char tmpbuf[1024];
+		int nread = pread(fd, tmpbuf, sizeof(tmpbuf)-1, pos);
+		unsigned nbr, flags, nbytes;
+		uuid u;
+		rec_hdr h;
+		int skip = nread > 0 ? parse(tmpbuf, nread, &nbr, &u, &flags, &nbytes, &h) : 0;
+
+		if (!skip)
+			break;
+
+		uint64_t next = pos + skip + nbytes;
+
+		if (flags & (TR_BEGIN|TR_END))
+		{
+			pos = next;
+			continue;
+		}
+
+		unsigned long long v;
+		lock_lock(st->lk);
+		int found = tree_get(st->tptr, &u, &v);
+		lock_unlock(st->lk);
+		int keep = flags & FLAG_RM ? idx && !found : found && (v == MAKE_FILEPOS(idx,pos));
+
+		if (!keep)
+		{
+			pos = next;
+			continue;
+		}
+
+		live += skip + nbytes;
+
+		if (measure)
+		{
+			pos = next;
+			continue;
+		}
+
+		int big;
+		char *src = payload(fd, tmpbuf, nread, skip, nbytes, pos, &big);
+
+		if (!src || (h.magic && !verify(&h, src)))
+		{
+			printf("store_compact: '%s' bad record, pos=%llu\n", SEG(st,idx)->filename, (unsigned long long)pos);
+			if (big) free(src);
+			ok = 0;
+			break;
+		}
+
+		char hdr[REC_HDR_SIZE];
+		int plen = prefix(hdr, 0, &u, flags & (FLAG_RM|FLAG_LZ), src, nbytes);
+		ok = pwrite2(fd2, hdr, plen, src, nbytes, npos) == (plen+nbytes);
+		if (big) free(src);
+
+		if (!(flags & FLAG_RM))
+		{
+			if (cnt == max)
 			{
-				int idx = st->idx-1;
-				uint64_t fp = MAKE_FILEPOS(idx,pos);
-				tree_add(st->tptr, &u, fp);
+				max = max ? max*2 : 1024;
+				cmp_move *tmp = (cmp_move*)realloc(moves, max*sizeof(cmp_move));
+
+				if (!tmp)
+				{
+					ok = 0;
+					break;
+				}
+
+				moves = tmp;
 			}
-			else
-				tree_del(st->tptr, &u);
 
-			if (st->f)
-			{
-				if (nbytes)
-				{
-					char *src = tmpbuf+skip;
-					int big = 0;
+			cmp_move *m = &moves[cnt++];
+			m->u = u;
+			m->from = pos;
+			m->to = npos;
+			m->size = plen + nbytes;
+		}
+
+		npos += plen + nbytes;
+		pos = next;
+	}
+
+	if (measure)
+	{
+		SEG(st,idx)->dead = eod - (live < eod ? live : eod);
+		SEG(st,idx)->measured = 1;
+		return 1;
+	}
+
+	// The checkpoint would refer to old positions, so it is
+	// dropped before the switch. A new one is written later.
+
+	string filename;
+
+	if (!ok || (pos < eod) || fsync(fd2) ||
+		(snprintf(filename, sizeof(filename), "%s/%s", st->path1, CHECKPOINT) >= (int)sizeof(filename)))
+	{
+		close(fd2);
+		remove(tmpname);
+		free(moves);
+		return 0;
+	}
+
+	// What was replaced last time is closed once its readers are done
+	// (new ones only get the current descriptor).
+
+	if (SEG(st,idx)->oldfd > 0)
+	{
+		while (SEG(st,idx)->readers[(SEG(st,idx)->fdgen+1)&1])
+			msleep(1);
+
+		close(SEG(st,idx)->oldfd);
+		SEG(st,idx)->oldfd = 0;
+	}
+
+	lock_lock(st->lk);
+	remove(filename);
+
+	if (rename(tmpname, SEG(st,idx)->filename))
+	{
+		printf("store_compact: '%s' error: %s\n", tmpname, strerror(errno));
+		lock_unlock(st->lk);
+		close(fd2);
+		remove(tmpname);
+		free(moves);
+		return 0;
+	}
+
+	uint64_t dead = 0;
+
+	for (i = 0; i < cnt; i++)
+	{
+		unsigned long long v;
+
+		if (tree_get(st->tptr, &moves[i].u, &v) && (v == MAKE_FILEPOS(idx,moves[i].from)))
+			tree_set(st->tptr, &moves[i].u, MAKE_FILEPOS(idx,moves[i].to));
+		else
+			dead += moves[i].size;
+	}
+
+	// Anything noted meanwhile is at an old position, and was
+	// either not copied or is counted above.
+
+	size_t j = 0;
+
+	for (i = 0; i < (int)st->cmp_ndead; i++)
+	{
+		if (FILEIDX(st->cmp_dead[i]) != (unsigned)idx)
+			st->cmp_dead[j++] = st->cmp_dead[i];
+	}
+
+	st->cmp_ndead = j;
+
+	store_map_release(SEG(st,idx)->map);
+	SEG(st,idx)->map = NULL;
+	SEG(st,idx)->oldfd = fd;
+	SEG(st,idx)->fd = fd2;
+	SEG(st,idx)->fdgen++;
+	SEG(st,idx)->text = 0;
+	SEG(st,idx)->eodpos = npos;
+	SEG(st,idx)->dead = dead;
+	st->ckp_idx = -1;
+	st->ckp_gen++;
+	lock_unlock(st->lk);
+	free(moves);
+	printf("store_compact: '%s' %llu -> %llu bytes\n", SEG(st,idx)->filename, (unsigned long long)eod, (unsigned long long)npos);
+
+	if (st->ckp_interval)
+		store_checkpoint(st);
+
+	return 1;
+}
+
+int store_compact(store *st)
+{
+	if (!st)
+		return 0;
+
+	lock_lock(st->cmp_lk);
+	st->compacting = 1;
+	store_dead_measure(st);
+	int pct = st->cmp_pct > 0 ? st->cmp_pct : 50;
+	int i, best = -1;
+
+	// The log file just sealed may yet have a late writer, so
+	// leave that and the active one alone.
+
+	for (i = 0; (i+2) < st->idx; i++)
+	{
+		if (SEG(st,i)->writers || SEG(st,i)->tailing || !SEG(st,i)->eodpos)
+			continue;
 
-					if ((src+nbytes) >= (tmpbuf+sizeof(tmpbuf)))
-					{
-						big = 1;
-						src = (char*)malloc(nbytes+1);
+		if (!SEG(st,i)->measured)
+			store_compact_file(st, i, 1);
 
-						if (pread(fd, src, nbytes, pos+skip) <= 0)
-							return;
-					}
+		if ((SEG(st,i)->dead*100) < (pct*SEG(st,i)->eodpos))
+			continue;
 
-					src[nbytes] = 0;
-					st->f(st->p1, &u, src, flags&FLAG_RM?-nbytes:nbytes);
-					if (big) free(src);
-				}
-				else
-					st->f(st->p1, &u, NULL, 0);
-			}
+		if ((best < 0) || ((SEG(st,i)->dead*SEG(st,best)->eodpos) > (SEG(st,best)->dead*SEG(st,i)->eodpos)))
+			best = i;
+	}
 
-			cnt++;
-		}
+	int ok = best >= 0 ? store_compact_file(st, best, 0) : 0;
+	lock_unlock(st->cmp_lk);
+	return ok;
+}
 
-		pos += skip;
-		pos += nbytes;
+static int store_compactor(void *p1)
+{
+	store *st = (store*)p1;
+
+	while (st->cmp_pct > 0)
+	{
+		if (store_compact(st))
+			continue;
+
+		int i;
+
+		for (i = 0; (i < 100) && (st->cmp_pct > 0); i++)
+			msleep(10);
 	}
 
-	st->eodpos[st->idx-1] = pos;
-	printf("store_load_file: '%s' applied=%u, size=%llu MiB\n", st->filename[st->idx-1], cnt, (unsigned long long)pos/1024/1024);
+	st->cmp_running = 0;
+	return 0;
 }
 
-static int store_merge_item(void *h, const uuid *u, unsigned long long *v)
+void store_set_compact(store *st, int pct)
 {
-	store *st = (store*)h;
-	int idx = FILEIDX(*v);
+	if (!st)
+		return;
 
-	if (idx == 0)
+	st->compacting = 1;
+	st->cmp_pct = pct;
+
+	if ((pct > 0) && !st->cmp_running)
+	{
+		st->cmp_running = 1;
+
+		if (!thread_run(&store_compactor, st))
+			st->cmp_running = 0;
+	}
+}
+
+static int store_open_handler(void *p1, const char *name)
+{
+	if (!strcmp(name, ZEROTH_LOG) || !strcmp(name, FIRST_LOG))
+		return 1;
+
+	names_ctx *ctx = (names_ctx*)p1;
+
+	if (ctx->cnt == (MAX_LOGFILES-2))
 		return 0;
 
-	int fd = st->fd[idx];
-	uint64_t pos = POS(*v);
-	char tmpbuf[1024];
+	if (strlen(name) >= sizeof(ctx->names[0]))
+		return 1;
 
-	if (pread(fd, tmpbuf, sizeof(tmpbuf), pos) <= 0)
+	if (ctx->cnt == ctx->size)
 	{
-		printf("store_merge_item pread fd=%d prefix failed, pos=%llu\n", fd, (unsigned long long)pos);
-		return -1;
+		int size = ctx->size ? ctx->size*2 : 256;
+		void *names = realloc(ctx->names, size*sizeof(ctx->names[0]));
+
+		if (!names)
+			return 0;
+
+		ctx->names = (char(*)[256])names;
+		ctx->size = size;
 	}
 
-	unsigned nbr, flags, nbytes;
-	uuid tmp_u;
-	int skip = parse(tmpbuf, &nbr, &tmp_u, &flags, &nbytes);
-	tmpbuf[skip] = 0;
+	strcpy(ctx->names[ctx->cnt++], name);
+	return 1;
+}
 
-	if (uuid_compare(u, &tmp_u) != 0)	// CHECK uuid match
-	{
-		char tmpbuf1[256], tmpbuf2[256];
-		printf("store_merge_item failed uuid=%s !=%s failed\n", uuid_to_string(u, tmpbuf1), uuid_to_string(&tmp_u, tmpbuf2));
+// Timestamped log files are named so numeric order is log order.
+
+static int store_name_compare(const void *p1, const void *p2)
+{
+	unsigned long long v1 = strtoull((const char*)p1, NULL, 10);
+	unsigned long long v2 = strtoull((const char*)p2, NULL, 10);
+	return v1 < v2 ? -1 : v1 > v2 ? 1 : strcmp((const char*)p1, (const char*)p2);
+}
+
+static const char *store_basename(const char *filename)
+{
+	const char *src = strrchr(filename, '/');
+#ifdef _WIN32
+	if (!src) src = strrchr(filename, '\\');
+#endif
+	return src ? src+1 : filename;
+}
+
+typedef struct
+{
+	ckp_key *keys;
+	size_t cnt, max;
+}
+ ckp_ctx;
+
+static int store_checkpoint_item(void *p1, const uuid *k, unsigned long long *v)
+{
+	ckp_ctx *ctx = (ckp_ctx*)p1;
+
+	if (ctx->cnt == ctx->max)
 		return -1;
-	}
 
-	if (nbytes == 0)					// CHECK has length
+	ckp_key *key = &ctx->keys[ctx->cnt++];
+	key->k = *k;
+	key->v = *v;
+	return 1;
+}
+
+// So that a rename survives a crash.
+
+static int store_sync_dir(const char *path)
+{
+#ifdef _WIN32
+	return 1;
+#else
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return 0;
+
+	int ok = !fsync(fd);
+	close(fd);
+	return ok;
+#endif
+}
+
+static int store_write_checkpoint(const char *tmpname, const ckp_seg *segs, int segments, const ckp_key *keys, size_t cnt)
+{
+	FILE *fp = fopen(tmpname, "wb");
+
+	if (!fp)
 	{
-		printf("store_merge_item failed invalid length\n");
-		return -1;
+		printf("store_checkpoint: '%s' error: %s\n", tmpname, strerror(errno));
+		return 0;
 	}
 
-	int wlen, len = skip+nbytes;
+	ckp_hdr hdr = {0};
+	hdr.magic = CKP_MAGIC;
+	hdr.version = CKP_VERSION;
+	hdr.segments = segments;
+	hdr.keys = cnt;
+	hdr.crc = crc32c(0, segs, segments*sizeof(ckp_seg));
+	hdr.crc = crc32c(hdr.crc, keys, cnt*sizeof(ckp_key));
+	int err = fwrite(&hdr, sizeof(hdr), 1, fp) != 1;
+	err |= fwrite(segs, sizeof(ckp_seg), segments, fp) != (size_t)segments;
+
+	if (cnt)
+		err |= fwrite(keys, sizeof(ckp_key), cnt, fp) != cnt;
+
+	err |= fflush(fp) != 0;
+	err |= fsync(fileno(fp)) != 0;
+	err |= fclose(fp) != 0;
+
+	if (err)
+		printf("store_checkpoint: '%s' write failed: %s\n", tmpname, strerror(errno));
+
+	return !err;
+}
+
+int store_checkpoint(store *st)
+{
+	if (!st || !st->idx)
+		return 0;
+
+	string filename, tmpname;
 
-	if (len <= sizeof(tmpbuf))
+	if ((snprintf(filename, sizeof(filename), "%s/%s", st->path1, CHECKPOINT) >= (int)sizeof(filename)) ||
+		(snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename) >= (int)sizeof(tmpname)))
 	{
-		wlen = pwrite(st->fd[0], tmpbuf, len, st->eodpos[0]);
+		printf("store_checkpoint: '%s' path too long\n", st->path1);
+		return 0;
 	}
-	else
+
+	store_flush(st);
+	lock_lock(st->lk);
+
+	// Transactions in progress would leave the index and the
+	// logs out of step, so hold back new ones and wait (for a
+	// while) for those to finish...
+
+	if (st->ckp_busy || st->ckp_wanted)
 	{
-		void *buf = malloc(nbytes);
+		lock_unlock(st->lk);
+		return 0;
+	}
 
-		if (!buf)
-			return -1;
+	if (st->transactions)
+	{
+		uint64_t until = store_usecs()/1000 + CKP_WAIT;
+		st->ckp_wanted = 1;
 
-		if (pread(fd, buf, nbytes, pos+skip) != nbytes)
+		while (st->transactions)
 		{
-			printf("store_merge_item pread fd=%d data failed, pos=%llu\n", fd, (unsigned long long)(pos+skip));
-			return -1;
+			unsigned seq = event_count(st->ckp_ev);
+			uint64_t now = store_usecs()/1000;
+			lock_unlock(st->lk);
+
+			if (now < until)
+				event_wait(st->ckp_ev, seq, (int)(until-now));
+
+			lock_lock(st->lk);
+
+			if (store_usecs()/1000 >= until)
+				break;
 		}
 
-#ifdef _WIN32
-		size_t len = skip + nbytes;
-		char tmpbuf2[1024*2];
+		st->ckp_wanted = 0;
+		event_signal(st->ckp_ev);
+
+		// Not to be held up like that again for a while...
 
-		if (len <= sizeof(tmpbuf2))
+		if (st->transactions)
 		{
-			memcpy(tmpbuf2, tmpbuf, skip);
-			memcpy(tmpbuf2+skip, buf, nbytes);
-			wlen = (size_t)pwrite(st->fd[0], tmpbuf2, (size_t)len, st->eodpos[0]);
+			st->ckp_retry = store_usecs()/1000 + CKP_WAIT;
+			lock_unlock(st->lk);
+			return 0;
 		}
-		else
+	}
+
+	// Only copy the index while holding the lock, and write it
+	// out after. Should the logs be compacted meanwhile, the
+	// copy is out of date and is dropped.
+
+	int idx = st->idx-1, segments = st->idx, i;
+	int first = st->ckp_idx > 0 ? st->ckp_idx : 0;
+	ckp_seg *segs = (ckp_seg*)calloc(segments, sizeof(ckp_seg));
+	int *pins = (int*)malloc((idx-first+1) * 2 * sizeof(int));
+	ckp_ctx ctx = {0};
+	ctx.max = tree_count(st->tptr);
+	ctx.keys = (ckp_key*)malloc((ctx.max ? ctx.max : 1) * sizeof(ckp_key));
+
+	if (!segs || !pins || !ctx.keys)
+	{
+		printf("store_checkpoint: out of memory\n");
+		lock_unlock(st->lk);
+		free(segs);
+		free(pins);
+		free(ctx.keys);
+		return 0;
+	}
+
+	// Everything the checkpoint refers to must be on disk, but
+	// the logs written since the last one are synced after the
+	// lock is let go, pinned so that compaction can't close them.
+
+	for (i = first; i <= idx; i++)
+		pins[(i-first)*2] = store_fd_pin(st, i, &pins[(i-first)*2+1]);
+
+	for (i = 0; i < segments; i++)
+	{
+		strncpy(segs[i].name, store_basename(SEG(st,i)->filename), sizeof(segs[i].name)-1);
+		segs[i].eodpos = SEG(st,i)->eodpos;
+	}
+
+	tree_iter(st->tptr, &ctx, &store_checkpoint_item);
+	uint64_t eodpos = SEG(st,idx)->eodpos;
+	unsigned gen = st->ckp_gen;
+	st->ckp_busy = 1;
+	lock_unlock(st->lk);
+
+	int ok = 1;
+
+	for (i = first; i <= idx; i++)
+	{
+		if (fsync(pins[(i-first)*2]) < 0)
 		{
-			wlen = (size_t)pwrite(st->fd[0], tmpbuf, (size_t)skip, st->eodpos[0]);
-			wlen += pwrite(st->fd[0], buf, nbytes, st->eodpos[0]+skip);
+			printf("store_checkpoint: '%s' sync error: %s\n", SEG(st,i)->filename, strerror(errno));
+			ok = 0;
 		}
-#else
-		struct iovec iov[2];
-		iov[0].iov_base = (void*)tmpbuf;
-		iov[0].iov_len = skip;
-		iov[1].iov_base = (void*)buf;
-		iov[1].iov_len = nbytes;
-		wlen = pwritev(st->fd[0], iov, 2, st->eodpos[0]);
+
+		store_fd_unpin(st, i, pins[(i-first)*2+1]);
+	}
+
+	free(pins);
+
+	if (ok)
+		ok = store_write_checkpoint(tmpname, segs, segments, ctx.keys, ctx.cnt);
+
+	free(segs);
+	free(ctx.keys);
+	lock_lock(st->lk);
+	st->ckp_busy = 0;
+
+	if (ok && (gen != st->ckp_gen))
+		ok = 0;
+
+	if (ok)
+	{
+#ifdef _WIN32
+		remove(filename);
 #endif
+		if (rename(tmpname, filename))
+		{
+			printf("store_checkpoint: '%s' error: %s\n", filename, strerror(errno));
+			ok = 0;
+		}
 	}
 
-	if (wlen != len)
+	if (ok)
 	{
-		printf("store_merge_item write fd=%d data failed, pos=%llu\n", fd, (unsigned long long)st->eodpos[0]);
-		return -1;
+		st->ckp_idx = idx;
+		st->ckp_eodpos = eodpos;
 	}
+	else
+		remove(tmpname);
 
-	*v = st->eodpos[0];
-	st->eodpos[0] += len;
-	return 1;
+	lock_unlock(st->lk);
+
+	if (ok && !store_sync_dir(st->path1))
+	{
+		printf("store_checkpoint: '%s' sync error: %s\n", st->path1, strerror(errno));
+		return 0;
+	}
+
+	return ok;
 }
 
-static int store_open_file(store *st, const char *filename, int readonly, int create)
+void store_set_checkpoint(store *st, uint64_t nbytes)
 {
 	if (!st)
-		return 0;
+		return;
 
-	int fd = st->fd[st->idx] = open(filename, (create?O_CREAT:0)|(readonly?O_RDONLY:O_RDWR), 0666);
+	st->ckp_interval = nbytes;
+}
 
-	if (fd < 0)
+static void store_autocheckpoint(store *st)
+{
+	if (!st->ckp_interval)
+		return;
+
+	int idx = st->idx-1;
+	uint64_t nbytes = SEG(st,idx)->eodpos;
+
+	if (idx == st->ckp_idx)
+		nbytes -= st->ckp_eodpos;
+
+	if ((nbytes >= st->ckp_interval) && (store_usecs()/1000 >= st->ckp_retry))
+		store_checkpoint(st);
+}
+
+// With a checkpoint loaded the user callback doesn't see the history,
+// so present it with the current state instead.
+
+typedef struct
+{
+	store *st;
+	void *buf;
+	size_t len;
+}
+ replay_ctx;
+
+static int store_checkpoint_replay(void *p1, const uuid *k, unsigned long long *v)
+{
+	replay_ctx *ctx = (replay_ctx*)p1;
+	int nbytes = store_get(ctx->st, k, &ctx->buf, &ctx->len);
+
+	if (!nbytes)
 		return 0;
 
-	strcpy(st->filename[st->idx], filename);
-	st->idx++;
+	ctx->st->f(ctx->st->p1, k, ctx->buf, nbytes);
 	return 1;
 }
 
-static int store_merge(store *st)
+static int store_load_checkpoint(store *st)
 {
-	if (!st)
+	string filename;
+
+	if (snprintf(filename, sizeof(filename), "%s/%s", st->path1, CHECKPOINT) >= (int)sizeof(filename))
 		return 0;
 
-	close(st->fd[0]);
-	st->fd[0] = open(st->filename[0], O_RDWR, 0666);
+	FILE *fp = fopen(filename, "rb");
 
-	if (st->fd[0] < 0)
+	if (!fp)
 		return 0;
 
-	printf("store_merge: begin\n");
-	size_t cnt = tree_iter(st->tptr, st, &store_merge_item);
-	printf("store_merge: end, %ld items\n", (long)cnt);
-	fsync(st->fd[0]);
-	close(st->fd[0]);
+	ckp_hdr hdr;
 
-	while (st->idx-- > 1)
+	if ((fread(&hdr, sizeof(hdr), 1, fp) != 1) || (hdr.magic != CKP_MAGIC) ||
+		(hdr.version != CKP_VERSION) || (hdr.segments > MAX_LOGFILES))
 	{
-		close(st->fd[st->idx]);
-		remove(st->filename[st->idx]);
-		st->eodpos[st->idx] = 0;
+		fclose(fp);
+		return 0;
 	}
 
-	st->idx = 0;
-	string filename;
-	sprintf(filename, "%s/%s", st->path1, ZEROTH_LOG);
-	store_open_file(st, filename, 1, 1);
-	return 1;
-}
+	// Every log file it refers to must still be there, and
+	// be at least as long as it was. Except one compacted down to
+	// nothing, removed on open, as no key can refer to it...
 
+	int *map = (int*)malloc((hdr.segments+1)*sizeof(int));
+	uint64_t *eodpos = (uint64_t*)calloc(st->idx+1, sizeof(uint64_t));
+	uint32_t crc = 0;
+	int i, j;
 
-static int store_open_handler(void *p1, const char *name)
-{
-	if (!strcmp(name, ZEROTH_LOG))
-		return 1;
+	if (!map || !eodpos)
+	{
+		printf("store_load_checkpoint: out of memory\n");
+		fclose(fp);
+		free(map);
+		free(eodpos);
+		return 0;
+	}
 
-	store *st = (store*)p1;
-	string filename;
-	sprintf(filename, "%s/%s", st->path2, name);
+	for (i = 0; i < hdr.segments; i++)
+	{
+		ckp_seg seg;
+
+		if (fread(&seg, sizeof(seg), 1, fp) != 1)
+			break;
+
+		crc = crc32c(crc, &seg, sizeof(seg));
+		seg.name[sizeof(seg.name)-1] = 0;
+		map[i] = -1;
+
+		for (j = 0; j < st->idx; j++)
+		{
+			if (strcmp(seg.name, store_basename(SEG(st,j)->filename)))
+				continue;
+
+			struct stat s = {0};
+			fstat(SEG(st,j)->fd, &s);
+
+			if (s.st_size >= seg.eodpos)
+			{
+				map[i] = j;
+				eodpos[j] = seg.eodpos;
+			}
+
+			break;
+		}
+
+		if ((map[i] < 0) && seg.eodpos)
+			break;
+	}
+
+	if (i != hdr.segments)
+	{
+		printf("store_load_checkpoint: '%s' is stale\n", filename);
+		fclose(fp);
+		free(map);
+		free(eodpos);
+		return 0;
+	}
+
+	uint64_t cnt = 0;
+	int ok = 1;
+
+	for (;;)
+	{
+		ckp_key keys[1024];
+		size_t n = fread(keys, sizeof(ckp_key), 1024, fp);
+
+		if (!n)
+			break;
+
+		crc = crc32c(crc, keys, n*sizeof(ckp_key));
+
+		for (i = 0; (i < n) && ok; i++)
+		{
+			unsigned idx = FILEIDX(keys[i].v);
+
+			if ((idx >= hdr.segments) || (map[idx] < 0))
+				ok = 0;
+			else
+				tree_add(st->tptr, &keys[i].k, MAKE_FILEPOS(map[idx],keys[i].v));
+		}
+
+		cnt += n;
+	}
+
+	fclose(fp);
+	free(map);
+
+	if (!ok || (cnt != hdr.keys) || (crc != hdr.crc))
+	{
+		printf("store_load_checkpoint: '%s' is corrupt\n", filename);
+		tree_destroy(st->tptr);
+		st->tptr = tree_create();
+		free(eodpos);
+		return 0;
+	}
+
+	for (j = 0; j < st->idx; j++)
+		SEG(st,j)->eodpos = eodpos[j];
+
+	free(eodpos);
+
+	printf("store_load_checkpoint: '%s' keys=%llu\n", filename, (unsigned long long)cnt);
 
-	if (!store_open_file(st, filename, 1, 0))
-		return 1;
+	if (st->f)
+	{
+		replay_ctx ctx = {st, NULL, 0};
+		tree_iter(st->tptr, &ctx, &store_checkpoint_replay);
+		free(ctx.buf);
+	}
 
-	store_load_file(st);
 	return 1;
 }
 
-store *store_open2(const char *path1, const char *path2, int compact, void (*f)(void*,const uuid*,const void*,int), void *p1)
+store *store_open2(const char *path1, const char *path2, int flags, void (*f)(void*,const uuid*,const void*,int), void *p1)
 {
 	store *st = (store*)calloc(1, sizeof(struct store_));
 	if (!st || !path1) return NULL;
@@ -921,6 +4533,18 @@ store *store_open2(const char *path1, const char *path2, int compact, void (*f)(
 	st->p1 = p1;
 	st->tptr = tree_create();
 	st->lk = lock_create();
+	st->cmp_lk = lock_create();
+	st->gc_lk = lock_create();
+	st->gc_ev = event_create();
+	st->gc_join = event_create();
+	st->wb_lk = lock_create();
+	st->ev = event_create();
+	st->ckp_ev = event_create();
+	st->wb_flk = lock_create();
+	st->dio_lk = lock_create();
+	st->gc_lo = MAX_LOGFILES;
+	st->ckp_idx = -1;
+	st->max_logsize = MAX_LOGFILE_SIZE;
 
 	if ((mkdir(st->path1, 0777) < 0) && (errno != EEXIST))
 	{
@@ -936,7 +4560,7 @@ store *store_open2(const char *path1, const char *path2, int compact, void (*f)(
 	stat(filename, &s);
 	int do_merge = 0;
 
-	if (compact && (s.st_size > 0))
+	if ((flags & STORE_COMPACT) && (s.st_size > 0))
 	{
 		printf("store_open: compaction scheduled\n");
 		rename(filename, filename2);
@@ -944,13 +4568,9 @@ store *store_open2(const char *path1, const char *path2, int compact, void (*f)(
 	}
 
 	if (store_open_file(st, filename, 1, 1))
-	{
 		printf("store_open_file: '%s'\n", filename);
-		store_load_file(st);
-	}
 
-	if (store_open_file(st, filename2, 1, 0))
-		store_load_file(st);
+	store_open_file(st, filename2, 1, 0);
 
 	if (strcmp(st->path1, st->path2))
 	{
@@ -962,40 +4582,90 @@ store *store_open2(const char *path1, const char *path2, int compact, void (*f)(
 		}
 	}
 
-	// Open all timestamped log files.
+	// Open all timestamped log files, oldest first.
 
-	dirlist(st->path2, ".log", &store_open_handler, st);
+	names_ctx ctx = {0};
+	dirlist(st->path2, ".log", &store_open_handler, &ctx);
+	qsort(ctx.names, ctx.cnt, sizeof(ctx.names[0]), &store_name_compare);
+	int i;
 
-	if (st->idx == (MAX_LOGFILES-1))
-		do_merge++;
+	for (i = 0; i < ctx.cnt; i++)
+	{
+		sprintf(filename, "%s/%s", st->path2, ctx.names[i]);
+
+		if (strtoll(ctx.names[i], NULL, 10) > st->last_log)
+			st->last_log = strtoll(ctx.names[i], NULL, 10);
+
+		// Compaction may have left nothing at all...
+
+		struct stat s = {0};
+
+		if (!stat(filename, &s) && !s.st_size)
+		{
+			remove(filename);
+			continue;
+		}
+
+		store_open_file(st, filename, 1, 0);
+	}
+
+	free(ctx.names);
+
+	// Start from the checkpoint, if there is one, and just replay
+	// the logs from where it left off. Merging invalidates it.
+
+	int loaded = 0, replayed = 0, idx;
+
+	if (do_merge)
+	{
+		sprintf(filename2, "%s/%s", st->path1, CHECKPOINT);
+		remove(filename2);
+	}
+	else
+		loaded = store_load_checkpoint(st);
+
+	if (flags & STORE_PARALLEL)
+		replayed = store_load_parallel(st, loaded);
+	else
+		replayed = store_load_serial(st);
+
+	for (idx = 0; idx < st->idx; idx++)
+		store_truncate(st, idx, idx == (st->idx-1));
 
 	if (do_merge)
 		store_merge(st);
 
 	// Create an active log.
 
-	sprintf(filename, "%s/%lld.log", st->path2, (long long)time(NULL));
-	store_open_file(st, filename, 0, 1);
-	printf("store_open_file: '%s'\n", filename);
+	store_create_log(st);
+
+	// Nothing to be gained by checkpointing again until written to.
+
+	if (loaded && !replayed)
+		st->ckp_idx = st->idx-1;
+
 	return st;
 }
 
-static int store_logreader_apply(store *st, int n, uint64_t pos, int (*f)(void*,const uuid*,const void*,int), void *p1)
+static int store_logreader_apply(store *st, int idx, int n, uint64_t pos, int (*f)(void*,const uuid*,const void*,int), void *p1)
 {
-	int idx = FILEIDX(pos);
-	int fd = st->fd[idx];
+	int fd = SEG(st,idx)->fd;
 
 	for (;;)
 	{
 		char tmpbuf[1024];
+		int nread = pread(fd, tmpbuf, sizeof(tmpbuf)-1, pos);
 
-		if (pread(fd, tmpbuf, sizeof(tmpbuf), pos) <= 0)
+		if (nread <= 0)
 			return 0;
 
 		unsigned nbr, flags, nbytes;
 		uuid u;
 
-		int skip = parse(tmpbuf, &nbr, &u, &flags, &nbytes);
+		int skip = parse(tmpbuf, nread, &nbr, &u, &flags, &nbytes, NULL);
+
+		if (!skip)
+			return 0;
 
 		if (flags == TR_BEGIN)
 		{
@@ -1016,21 +4686,15 @@ static int store_logreader_apply(store *st, int n, uint64_t pos, int (*f)(void*,
 			{
 				if (nbytes)
 				{
-					char *src = tmpbuf+skip;
-					int big = 0;
-
-					if ((src+nbytes) >= (tmpbuf+sizeof(tmpbuf)))
-					{
-						big = 1;
-						src = (char*)malloc(nbytes+1);
+					int big;
+					unsigned len;
+					char *src = payload(fd, tmpbuf, nread, skip, nbytes, pos, &big);
+					src = store_inflate(flags, src, nbytes, &len, &big);
 
-						if (pread(fd, src, nbytes, pos+skip) <= 0)
-							return 0;
-
-						src[nbytes] = 0;
-					}
+					if (!src)
+						return 0;
 
-					int ok = f(p1, &u, src, flags&FLAG_RM?-nbytes:nbytes);
+					int ok = f(p1, &u, src, flags&FLAG_RM?-(int)len:(int)len);
 					if (big) free(src);
 					if (!ok) return 0;
 				}
@@ -1046,10 +4710,37 @@ static int store_logreader_apply(store *st, int n, uint64_t pos, int (*f)(void*,
 	return 1;
 }
 
-int store_tail(store *st, const uuid *u, int (*f)(void*,const uuid*,const void*,int), void *p1)
+// A tail cursor reads the logs in order, delivering plain records
+// as found and transactions on commit. At the end of what has been
+// written it waits to be woken by the next append, and moves on to
+// the next log file only once the current one is sealed and complete.
+
+struct store_cursor_
+{
+	store *st;
+	int idx, ntrans;
+	uint64_t pos;
+	struct { unsigned nbr; uint64_t pos; } *trans;
+};
+
+// Compaction leaves alone any log file being tailed.
+
+static void store_tail_enter(store_cursor *c, int idx)
+{
+	lock_lock(c->st->cmp_lk);
+
+	if (c->idx >= 0)
+		SEG(c->st,c->idx)->tailing--;
+
+	SEG(c->st,c->idx = idx)->tailing++;
+	lock_unlock(c->st->cmp_lk);
+	c->ntrans = 0;
+}
+
+store_cursor *store_tail_open(store *st, const uuid *u)
 {
 	if (!st || !u)
-		return 0;
+		return NULL;
 
 	unsigned long long v = 0;
 
@@ -1057,138 +4748,379 @@ int store_tail(store *st, const uuid *u, int (*f)(void*,const uuid*,const void*,
 
 	if (!uuid_is_zero(u))
 	{
-		if (st->transactions)
+		int locked = st->transactions || st->compacting;
+
+		if (locked)
 			lock_lock(st->lk);
 
 		int ok = tree_get(st->tptr, u, &v);
 
-		if (st->transactions)
+		if (locked)
 			lock_unlock(st->lk);
 
 		if (!ok)
-			return 0;
+			return NULL;
 	}
 
-	uint64_t pos = POS(v);
-	int idx = FILEIDX(pos);
-	uint64_t save_pos = 0, next_pos = 0;
-	unsigned save_nbr = 0, cnt = 0;
-	int valid = 1;
+	store_cursor *c = (store_cursor*)calloc(1, sizeof(struct store_cursor_));
+
+	if (!c)
+		return NULL;
+
+	c->st = st;
+	c->idx = -1;
+	store_tail_enter(c, FILEIDX(v));
+	c->pos = POS(v);
+	atomic_inc(&st->tailers);
+	return c;
+}
+
+// Resume from a position given out by a cursor earlier. One that is
+// not on a record, as the file was compacted since, starts the file
+// over instead.
+
+store_cursor *store_tail_open2(store *st, uint64_t pos)
+{
+	if (!st || (FILEIDX(pos) >= (unsigned)st->idx))
+		return NULL;
+
+	unsigned idx = FILEIDX(pos);
+	uint64_t off = POS(pos);
+
+	if (off > SEG(st,idx)->eodpos)
+		off = 0;
+	else if (off < SEG(st,idx)->eodpos)
+	{
+		char tmpbuf[256];
+		int nread = pread(SEG(st,idx)->fd, tmpbuf, sizeof(tmpbuf)-1, off);
+		unsigned nbr, flags, nbytes;
+		uuid u;
+		rec_hdr hdr;
+
+		if ((nread <= 0) || !parse(tmpbuf, nread, &nbr, &u, &flags, &nbytes, &hdr))
+			off = 0;
+	}
+
+	store_cursor *c = (store_cursor*)calloc(1, sizeof(struct store_cursor_));
+
+	if (!c)
+		return NULL;
+
+	c->st = st;
+	c->idx = -1;
+	store_tail_enter(c, idx);
+	c->pos = off;
+	atomic_inc(&st->tailers);
+	return c;
+}
+
+// Where to resume from: before any transaction not yet committed.
+
+uint64_t store_tail_pos(const store_cursor *c)
+{
+	if (!c)
+		return 0;
+
+	uint64_t pos = c->pos;
+	int i;
+
+	for (i = 0; i < c->ntrans; i++)
+	{
+		if (c->trans[i].pos < pos)
+			pos = c->trans[i].pos;
+	}
+
+	return MAKE_FILEPOS(c->idx, pos);
+}
+
+void store_tail_close(store_cursor *c)
+{
+	if (!c)
+		return;
+
+	lock_lock(c->st->cmp_lk);
+	SEG(c->st,c->idx)->tailing--;
+	lock_unlock(c->st->cmp_lk);
+	atomic_dec(&c->st->tailers);
+	free(c->trans);
+	free(c);
+}
+
+static int store_tail_scan(store_cursor *c, int (*f)(void*,const uuid*,const void*,int), void *p1)
+{
+	store *st = c->st;
+	int cnt = 0, i;
 
 	for (;;)
 	{
-		int fd = st->fd[idx];
+		int fd = SEG(st,c->idx)->fd;
 		char tmpbuf[1024];
+		int nread = pread(fd, tmpbuf, sizeof(tmpbuf)-1, c->pos);
+		unsigned nbr, flags, nbytes;
+		uuid u;
+		rec_hdr hdr;
+		int skip = nread > 0 ? parse(tmpbuf, nread, &nbr, &u, &flags, &nbytes, &hdr) : 0;
+		int big = 0;
+		char *src = NULL;
+
+		// Check it has been written completely...
 
-		if (pread(fd, tmpbuf, sizeof(tmpbuf), pos) <= 0)
+		if (skip && nbytes)
 		{
-			if (++idx < st->idx)
-			{
-				idx++;			// move on to the
-				pos = 0;		// next log file
-				valid = 1;
-				save_nbr = 0;
-			}
-			else
+			src = payload(fd, tmpbuf, nread, skip, nbytes, c->pos, &big);
+
+			if (!src || (hdr.magic && !verify(&hdr, src)))
 			{
-				--idx;			// just tail the active log
-				msleep(1);		// TO-DO: use a wakeup
+				if (big) free(src);
+				skip = 0;
 			}
+		}
+		else if (skip && hdr.magic && !verify(&hdr, NULL))
+			skip = 0;
 
+		if (!skip)
+		{
+			// Anything left in a sealed log file, once done with,
+			// is not going to be written now.
+
+			int idx = c->idx;
+
+			if ((idx >= (st->idx-1)) || SEG(st,idx)->writers)
+				return cnt;
+
+			if (c->pos < SEG(st,idx)->eodpos)
+				printf("store_tail: '%s' invalid record, pos=%llu\n", SEG(st,idx)->filename, (unsigned long long)c->pos);
+
+			store_tail_enter(c, idx+1);
+			c->pos = 0;
 			continue;
 		}
 
-		unsigned nbr, flags, nbytes;
-		uuid u;
-		int skip = parse(tmpbuf, &nbr, &u, &flags, &nbytes);
+		uint64_t pos = c->pos;
+		c->pos += skip + nbytes;
+		int ok = 1;
 
 		if (flags == TR_BEGIN)
 		{
-			if (!save_nbr)
-			{
-				save_nbr = nbr;
-				save_pos = pos;
-				next_pos = pos;
-			}
-			else
-				valid = 0;
-				pos++;
-		}
-		else if (flags == TR_CANCEL)
-		{
+			void *tmp = realloc(c->trans, (c->ntrans+1)*sizeof(*c->trans));
 
-			if (nbr == save_nbr)		// drop on rollback
+			if (tmp)
 			{
-				save_nbr = 0;
-				pos = next_pos;
+				c->trans = tmp;
+				c->trans[c->ntrans].nbr = nbr;
+				c->trans[c->ntrans++].pos = pos;
 			}
-			else
-				valid = 0;
 		}
-		else if (flags == TR_END)
+		else if ((flags == TR_END) || (flags == TR_CANCEL))
 		{
-			if (nbr == save_nbr)		// apply on commit
+			for (i = 0; i < c->ntrans; i++)
 			{
-				if (!store_logreader_apply(st, nbr, save_pos, f, p1))
-					break;
+				if (c->trans[i].nbr != nbr)
+					continue;
 
-				save_nbr = 0;
-
-				// If we didn't encounter any embedded or
-				// interleaved transaction elements, then
-				// we don't have to go back and restart...
+				if (flags == TR_END)			// apply on commit
+				{
+					ok = store_logreader_apply(st, c->idx, nbr, c->trans[i].pos, f, p1);
+					cnt++;
+				}
 
-				if (!valid)
-					pos = next_pos;
+				c->trans[i] = c->trans[--c->ntrans];
+				break;
 			}
-			else
-				valid = 0;
 		}
-		else if (save_nbr != 0)
+		else if (nbr == 0)
 		{
-			if (nbr != save_nbr)
-				valid = 0;
+			unsigned len;
+
+			if (!nbytes)
+				ok = f(p1, &u, NULL, 0);
+			else if ((src = store_inflate(flags, src, nbytes, &len, &big)) != NULL)
+				ok = f(p1, &u, src, flags&FLAG_RM?-(int)len:(int)len);
+
+			cnt++;
 		}
-		else
-		{
-			if (nbytes)
-			{
-				char *src = tmpbuf+skip;
-				int big = 0;
 
-				if ((src+nbytes) >= (tmpbuf+sizeof(tmpbuf)))
-				{
-					big = 1;
-					src = (char*)malloc(nbytes+1);
+		if (big)
+			free(src);
 
-					if (pread(fd, src, nbytes, pos+skip) <= 0)
-						return 0;
-				}
+		if (!ok)
+			return -1;
+	}
+}
 
-				src[nbytes] = 0;
-				int ok = f(p1, &u, src, flags&FLAG_RM?-nbytes:nbytes);
-				if (big) free(src);
-				if (!ok) break;
-			}
-			else
-			{
-				if (!f(p1, &u, NULL, 0))
-					break;
-			}
+int store_tail_next(store_cursor *c, int msecs, int (*f)(void*,const uuid*,const void*,int), void *p1)
+{
+	if (!c || !f)
+		return -1;
 
-			cnt++;
+	for (;;)
+	{
+		unsigned seq = event_count(c->st->ev);
+		int cnt = store_tail_scan(c, f, p1);
+
+		if (cnt || !msecs)
+			return cnt;
+
+		if (!event_wait(c->st->ev, seq, msecs))
+			return 0;
+	}
+}
+
+int store_tail(store *st, const uuid *u, int (*f)(void*,const uuid*,const void*,int), void *p1)
+{
+	store_cursor *c = store_tail_open(st, u);
+
+	if (!c)
+		return 0;
+
+	int n, cnt = 0;
+
+	while ((n = store_tail_next(c, -1, f, p1)) >= 0)
+		cnt += n;
+
+	store_tail_close(c);
+	return cnt;
+}
+
+// Wake anyone tailing the logs.
+
+static void store_notify(store *st)
+{
+	if (st->tailers)
+		event_signal(st->ev);
+}
+
+static int store_convert_file(const char *filename)
+{
+	string tmpname;
+
+	if (snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename) >= (int)sizeof(tmpname))
+	{
+		printf("store_convert_file: '%s' name too long\n", filename);
+		return 0;
+	}
+
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0)
+		return 0;
+
+	int fd2 = open(tmpname, O_CREAT|O_TRUNC|O_RDWR, 0666);
+
+	if (fd2 < 0)
+	{
+		close(fd);
+		return 0;
+	}
+
+	uint64_t pos = 0, pos2 = 0;
+	unsigned cnt = 0, text = 0;
+	int ok = 1;
+
+	for (;;)
+	{
+		char tmpbuf[1024];
+		int nread = pread(fd, tmpbuf, sizeof(tmpbuf)-1, pos);
+
+		if (nread <= 0)
+			break;
+
+		unsigned nbr, flags, nbytes;
+		uuid u;
+		rec_hdr hdr;
+		int skip = parse(tmpbuf, nread, &nbr, &u, &flags, &nbytes, &hdr);
+
+		if (!skip)
+			break;
+
+		if (!hdr.magic)
+			text++;
+
+		int big = 0;
+		char *src = nbytes ? payload(fd, tmpbuf, nread, skip, nbytes, pos, &big) : NULL;
+
+		if (nbytes && !src)
+			break;
+
+		char hdrbuf[REC_HDR_SIZE];
+		int plen = prefix(hdrbuf, nbr, &u, flags, src, nbytes);
+		long wlen = pwrite2(fd2, hdrbuf, plen, src, nbytes, pos2);
+		if (big) free(src);
+
+		if (wlen != (plen+nbytes))
+		{
+			printf("store_convert pwrite fd=%d data failed, pos=%llu\n", fd2, (unsigned long long)pos2);
+			ok = 0;
+			break;
 		}
 
 		pos += skip;
 		pos += nbytes;
+		pos2 += wlen;
+		cnt++;
 	}
 
-	return cnt;
+	close(fd);
+
+	if (!ok || !text)
+	{
+		close(fd2);
+		remove(tmpname);
+		return 0;
+	}
+
+	fsync(fd2);
+	close(fd2);
+#ifdef _WIN32
+	remove(filename);
+#endif
+	rename(tmpname, filename);
+	printf("store_convert: '%s' converted=%u, text=%u\n", filename, cnt, text);
+	return 1;
+}
+
+typedef struct
+{
+	const char *path;
+	int cnt;
+}
+ convert_ctx;
+
+static int store_convert_handler(void *p1, const char *name)
+{
+	convert_ctx *ctx = (convert_ctx*)p1;
+	string filename;
+
+	if (snprintf(filename, sizeof(filename), "%s/%s", ctx->path, name) >= (int)sizeof(filename))
+	{
+		printf("store_convert: '%s' name too long\n", name);
+		return 1;
+	}
+
+	ctx->cnt += store_convert_file(filename);
+	return 1;
+}
+
+int store_convert(const char *path1, const char *path2)
+{
+	if (!path1)
+		return 0;
+
+	convert_ctx ctx = {path1, 0};
+	dirlist(path1, ".log", &store_convert_handler, &ctx);
+
+	if (path2 && strcmp(path1, path2))
+	{
+		ctx.path = path2;
+		dirlist(path2, ".log", &store_convert_handler, &ctx);
+	}
+
+	return ctx.cnt;
 }
 
-store *store_open(const char *path1, const char *path2, int compact)
+store *store_open(const char *path1, const char *path2, int flags)
 {
-	return store_open2(path1, path2, compact, NULL, NULL);
+	return store_open2(path1, path2, flags, NULL, NULL);
 }
 
 int store_close(store *st)
@@ -1196,16 +5128,80 @@ int store_close(store *st)
 	if (!st)
 		return 0;
 
+	int i;
+	st->cmp_pct = 0;
+	st->wb_msecs = 0;
+
+	while (st->cmp_running || st->wb_running)
+		msleep(1);
+
+	store_flush(st);
+
+	if (st->idx)
+		store_trim(st, st->idx-1);
+
+	if (st->idx && !((st->ckp_idx == st->idx-1) && (st->ckp_eodpos == SEG(st,st->idx-1)->eodpos)))
+		store_checkpoint(st);
+
 	while (st->idx-- > 0)
 	{
-		if (st->fd[st->idx] >= 0)
+		if (SEG(st,st->idx)->fd >= 0)
 		{
-			fsync(st->fd[st->idx]);
-			close(st->fd[st->idx]);
+			fsync(SEG(st,st->idx)->fd);
+			close(SEG(st,st->idx)->fd);
 		}
+
+		if (SEG(st,st->idx)->oldfd > 0)
+			close(SEG(st,st->idx)->oldfd);
+
+		store_map_release(SEG(st,st->idx)->map);
+	}
+
+	for (i = 0; st->segs && (i < st->segs->size); i++)
+	{
+		if (!st->segs->seg[i])
+			continue;
+
+		free(st->segs->seg[i]->filename);
+		free(st->segs->seg[i]);
+	}
+
+	while (st->segs)
+	{
+		seg_table *t = st->segs;
+		st->segs = t->prev;
+		free(t);
 	}
 
+	tpool_destroy(st->tp);
 	tree_destroy(st->tptr);
+
+	for (i = 0; st->cache && (i < CACHE_SHARDS); i++)
+	{
+		cache_shard *s = &st->cache[i];
+
+		while (s->nring--)
+			free(s->ring[s->nring]);
+
+		free(s->ring);
+		free(s->buckets);
+		lock_destroy(s->lk);
+	}
+
+	free(st->cache);
+	free(st->cmp_dead);
+	lock_destroy(st->cmp_lk);
+	lock_destroy(st->gc_lk);
+	event_destroy(st->gc_ev);
+	event_destroy(st->gc_join);
+	event_destroy(st->ev);
+	event_destroy(st->ckp_ev);
+	lock_destroy(st->wb_flk);
+	lock_destroy(st->wb_lk);
+	lock_destroy(st->dio_lk);
+	free(st->dio_buf);
+	free(st->wb[0]);
+	free(st->wb[1]);
 	lock_destroy(st->lk);
 	free(st);
 	return 1;
@@ -10,9 +10,15 @@
 
 typedef struct store_ store;
 typedef struct hstore_ hstore;
+typedef struct store_map_ store_map;
 
-extern store *store_open(const char *path1, const char *path2, int compact);
-extern store *store_open2(const char *path1, const char *path2, int compact, void (*)(void*,const uuid*,const void*,int), void *p1);
+// Open flags...
+
+#define STORE_COMPACT	1			// merge all logs on open
+#define STORE_PARALLEL	2			// recover logs concurrently
+
+extern store *store_open(const char *path1, const char *path2, int flags);
+extern store *store_open2(const char *path1, const char *path2, int flags, void (*)(void*,const uuid*,const void*,int), void *p1);
 
 extern int store_get(const store *st, const uuid *u, void **buf, size_t *len);
 extern int store_add(store *st, const uuid *u, const void *buf, size_t len);
@@ -20,6 +26,107 @@ extern int store_rem(store *st, const uuid *u);
 extern int store_rem2(store *st, const uuid *u, const void *buf, size_t len);
 extern unsigned long store_count(const store *st);
 
+// Load records sorted by key, as for an initial load or migration,
+// far faster than one at a time: they go into a log file of their
+// own in large writes, are appended to the index without searching,
+// and made durable with a single fsync. The callback supplies each
+// record in turn, returning 0 when there are no more. Loading stops
+// at a key out of order. Not to be used alongside other writers.
+// Returns the number loaded: those records are durable and indexed
+// whatever else happens, they are not rolled back. If 'err' is given
+// it is set to 0 when the callback ran dry, or to why loading stopped
+// short: at the key out of order, or at a failed write or allocation
+// (the records buffered but not yet written are not loaded).
+
+#define STORE_BULK_ORDER	1			// key out of order
+#define STORE_BULK_WRITE	2			// write or allocation failed
+
+extern unsigned long store_bulk_load(store *st, int (*)(void*,uuid*,const void**,size_t*), void *p1, int *err);
+
+// Write-behind: plain store_add() records are gathered in memory (in
+// one of two 'nbytes' buffers) and written out when full, every
+// 'msecs' if non-zero, or on store_flush(). They can be read back in
+// the meantime, but a crash loses them. Zero bytes turns it off.
+
+extern void store_set_buffer(store *st, size_t nbytes, int msecs);
+extern int store_flush(store *st);
+
+// An optional cache of records read or added, within 'nbytes' in all
+// (zero turns it off). The counters help to size it.
+
+extern void store_set_cache(store *st, size_t nbytes);
+extern void store_cache_stats(const store *st, uint64_t *hits, uint64_t *misses, size_t *nbytes);
+
+// Records (and removal payloads) of at least 'nbytes' are written
+// compressed, where that saves space. Zero, the default, turns it
+// off. Compressed and plain records can be mixed in a log.
+
+extern void store_set_compress(store *st, size_t nbytes);
+
+// Zero-copy read: records in sealed log files are returned in place
+// from a mapping of the file, which stays pinned until unpinned (even
+// across compaction). Other records, and compressed ones, are copied.
+// Not NUL-terminated.
+
+typedef struct
+{
+	const void *data;
+	size_t len;
+	store_map *map;
+	void *buf;
+}
+ store_view;
+
+extern int store_get_view(store *st, const uuid *u, store_view *v);
+extern void store_unpin(store_view *v);
+
+// Batched lookup: the records for 'n' keys are read in log order,
+// nearby ones coalesced into single reads issued ahead by a pool of
+// threads, and handed to 'f' in that order from the calling thread.
+// Returns the number found.
+
+extern int store_mget(store *st, const uuid *uuids, int n, void (*f)(void*,const uuid*,const void*,int), void *p1);
+
+// Range scan: the records whose keys are timestamped (see uuid_ts)
+// from 'from_ts' up to, not including, 'to_ts' (zero for no end), in
+// key order, until the callback returns zero. The cursor form hands
+// over up to 'n' at a time (zero for all), returning the number done
+// (zero at the end) or -1 if the callback stopped it. Records added
+// to the range meanwhile may or may not be seen.
+
+typedef struct store_range_ store_range;
+
+extern int store_scan(store *st, uint64_t from_ts, uint64_t to_ts, int (*)(void*,const uuid*,const void*,int), void *p1);
+extern store_range *store_scan_open(store *st, uint64_t from_ts, uint64_t to_ts);
+extern int store_scan_next(store_range *r, int n, int (*)(void*,const uuid*,const void*,int), void *p1);
+extern void store_scan_close(store_range *r);
+
+// The active log is sealed, and a new one started, when it grows
+// beyond this size (default 1GB). There can be up to a million of
+// them, each up to 8TB.
+
+extern void store_set_logsize(store *st, uint64_t nbytes);
+
+// Allocate the active log ahead of writes, 'nbytes' at a time (zero
+// for not), rather than have every write extend it. The excess is
+// trimmed once sealed. Returns 0 if unsupported.
+
+extern int store_set_prealloc(store *st, uint64_t nbytes);
+
+// Write the active log with O_DIRECT, bypassing the page cache for
+// what is written once and rarely read back. Records are written in
+// whole blocks, along with the part blocks either side, so it is
+// best used with the write-behind buffer. Returns 0 if unsupported.
+
+extern int store_set_direct(store *st, int on);
+
+// Sealed log files are compacted in the background, while the store
+// stays in use, once at least 'pct' percent of one is obsolete (zero
+// stops it). Or compact the worst such file now, returns 1 if done.
+
+extern void store_set_compact(store *st, int pct);
+extern int store_compact(store *st);
+
 // Only transactions are thread-safe...
 
 extern hstore *store_begin(store *st);
@@ -30,11 +137,49 @@ extern int store_hrem2(hstore *h, const uuid *u, const void *buf, size_t len);
 extern int store_cancel(hstore *h);
 extern int store_end(hstore *h, int dbsync);
 
-// Reader...
+// Group commit: concurrent durable store_end() calls share a single
+// sync, the first waiting up to 'usecs' for as many as 'batch' in all
+// to join it. A batch of zero or one syncs each on its own (default).
+
+extern void store_set_group_commit(store *st, unsigned usecs, unsigned batch);
+
+// Index checkpoints let a store re-open by replaying only what was
+// written since, rather than all the logs. One is written on close,
+// on demand, and optionally whenever 'nbytes' have been appended.
+// With a checkpoint the open callback is presented with the current
+// records rather than the full history.
+//
+// Writers are held up while the index is copied (24 bytes a key, all
+// in memory), but not while it is written out and synced. Transactions
+// in progress are waited for (up to a second), holding back new ones
+// meanwhile. Returns 0 if not done.
+
+extern int store_checkpoint(store *st);
+extern void store_set_checkpoint(store *st, uint64_t nbytes);
+
+// Reader: follows the logs from the record for 'u' (or the start,
+// if zero), blocking for more until the callback returns zero. Or
+// use a cursor: next delivers whatever is available, waiting up to
+// 'msecs' (negative for ever) if nothing, and returns the number of
+// records delivered, or -1 if the callback stopped it. A cursor's
+// position can be kept to later resume from, while the store is open.
+
+typedef struct store_cursor_ store_cursor;
 
 extern int store_tail(store *st, const uuid *u, int (*)(void*,const uuid*,const void*,int), void *p1);
+extern store_cursor *store_tail_open(store *st, const uuid *u);
+extern store_cursor *store_tail_open2(store *st, uint64_t pos);
+extern uint64_t store_tail_pos(const store_cursor *c);
+extern int store_tail_next(store_cursor *c, int msecs, int (*)(void*,const uuid*,const void*,int), void *p1);
+extern void store_tail_close(store_cursor *c);
 
 extern int store_close(store *st);
 
+// Offline conversion of older text-format log files to the binary
+// format. Must not be used on a store that is open. Returns the
+// number of files converted.
+
+extern int store_convert(const char *path1, const char *path2);
+
 #endif
 
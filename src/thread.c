@@ -9,6 +9,7 @@
 #else
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 #endif
 
 #include "thread.h"
@@ -40,6 +41,7 @@ typedef struct _thread *thread;
 struct thread_pool_
 {
 	thread threads[MAX_THREADS];
+	lock *lk;
 	int cnt, last;
 };
 
@@ -99,68 +101,245 @@ void lock_destroy(lock *l)
 #endif
 }
 
-// Crude atomicity, uses global lock.
+struct event_
+{
+#ifdef _WIN32
+	CRITICAL_SECTION mutex;
+	CONDITION_VARIABLE cond;
+#else
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+	volatile unsigned count;
+};
+
+event *event_create()
+{
+	event *e = (event*)calloc(1, sizeof(struct event_));
+
+	if (!e)
+		return NULL;
+
+#ifdef _WIN32
+	InitializeCriticalSection(&e->mutex);
+	InitializeConditionVariable(&e->cond);
+#else
+	pthread_mutex_init(&e->mutex, NULL);
+	pthread_cond_init(&e->cond, NULL);
+#endif
+
+	return e;
+}
+
+// Read under the mutex, so that once a count is seen the signals
+// making it up are over, and the event can be destroyed.
+
+unsigned event_count(event *e)
+{
+	if (!e)
+		return 0;
+
+#ifdef _WIN32
+	EnterCriticalSection(&e->mutex);
+	unsigned count = e->count;
+	LeaveCriticalSection(&e->mutex);
+#else
+	pthread_mutex_lock(&e->mutex);
+	unsigned count = e->count;
+	pthread_mutex_unlock(&e->mutex);
+#endif
+
+	return count;
+}
+
+int event_wait(event *e, unsigned count, int msecs)
+{
+	if (!e)
+		return 0;
+
+#ifdef _WIN32
+	EnterCriticalSection(&e->mutex);
+
+	while (e->count == count)
+	{
+		if (!SleepConditionVariableCS(&e->cond, &e->mutex, msecs < 0 ? INFINITE : (DWORD)msecs))
+			break;
+	}
+
+	int ok = e->count != count;
+	LeaveCriticalSection(&e->mutex);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += msecs / 1000;
+	ts.tv_nsec += (long)(msecs % 1000) * 1000 * 1000;
+
+	if (ts.tv_nsec >= (1000L*1000*1000))
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000L*1000*1000;
+	}
+
+	pthread_mutex_lock(&e->mutex);
+
+	while (e->count == count)
+	{
+		if (msecs < 0)
+			pthread_cond_wait(&e->cond, &e->mutex);
+		else if (pthread_cond_timedwait(&e->cond, &e->mutex, &ts))
+			break;
+	}
+
+	int ok = e->count != count;
+	pthread_mutex_unlock(&e->mutex);
+#endif
+
+	return ok;
+}
+
+void event_signal(event *e)
+{
+	if (!e)
+		return;
+
+#ifdef _WIN32
+	EnterCriticalSection(&e->mutex);
+	e->count++;
+	WakeAllConditionVariable(&e->cond);
+	LeaveCriticalSection(&e->mutex);
+#else
+	pthread_mutex_lock(&e->mutex);
+	e->count++;
+	pthread_cond_broadcast(&e->cond);
+	pthread_mutex_unlock(&e->mutex);
+#endif
+}
+
+void event_destroy(event *e)
+{
+	if (!e)
+		return;
+
+#ifdef _WIN32
+	DeleteCriticalSection(&e->mutex);
+#else
+	pthread_cond_destroy(&e->cond);
+	pthread_mutex_destroy(&e->mutex);
+#endif
+	free(e);
+}
+
+// Atomics are lock-free where the compiler or OS provides them, so
+// that unrelated counters (eg. in different stores) never contend.
+// Otherwise they fall back to a global lock.
+
+#if defined(_WIN32)
+
+uint64_t atomic_addu64(uint64_t *v, int n)
+{
+	return (uint64_t)InterlockedExchangeAdd64((volatile LONGLONG*)v, n);
+}
+
+int64_t atomic_add64(int64_t *v, int n)
+{
+	return InterlockedExchangeAdd64((volatile LONGLONG*)v, n);
+}
+
+int atomic_inc(int *v)
+{
+	return InterlockedExchangeAdd((volatile LONG*)v, 1);
+}
+
+int atomic_dec(int *v)
+{
+	return InterlockedExchangeAdd((volatile LONG*)v, -1) - 1;
+}
 
-static lock *g_lock = NULL;
+int atomic_dec_and_zero(int *v, int *v2)
+{
+	int tmp = atomic_dec(v);
+	if (tmp == 0) InterlockedExchange((volatile LONG*)v2, 0);
+	return tmp;
+}
+
+#elif defined(__GNUC__) || defined(__clang__)
 
 uint64_t atomic_addu64(uint64_t *v, int n)
 {
-	if (!g_lock)
-		g_lock = lock_create();
+	return __atomic_fetch_add(v, (uint64_t)(int64_t)n, __ATOMIC_SEQ_CST);
+}
+
+int64_t atomic_add64(int64_t *v, int n)
+{
+	return __atomic_fetch_add(v, n, __ATOMIC_SEQ_CST);
+}
+
+int atomic_inc(int *v)
+{
+	return __atomic_fetch_add(v, 1, __ATOMIC_SEQ_CST);
+}
+
+int atomic_dec(int *v)
+{
+	return __atomic_sub_fetch(v, 1, __ATOMIC_SEQ_CST);
+}
+
+int atomic_dec_and_zero(int *v, int *v2)
+{
+	int tmp = __atomic_sub_fetch(v, 1, __ATOMIC_SEQ_CST);
+	if (tmp == 0) __atomic_store_n(v2, 0, __ATOMIC_SEQ_CST);
+	return tmp;
+}
 
-	lock_lock(g_lock);
+#else
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t atomic_addu64(uint64_t *v, int n)
+{
+	pthread_mutex_lock(&g_lock);
 	uint64_t tmp = *v;
 	*v += n;
-	lock_unlock(g_lock);
+	pthread_mutex_unlock(&g_lock);
 	return tmp;
 }
 
 int64_t atomic_add64(int64_t *v, int n)
 {
-	if (!g_lock)
-		g_lock = lock_create();
-
-	lock_lock(g_lock);
+	pthread_mutex_lock(&g_lock);
 	int64_t tmp = *v;
 	*v += n;
-	lock_unlock(g_lock);
+	pthread_mutex_unlock(&g_lock);
 	return tmp;
 }
 
 int atomic_inc(int *v)
 {
-	if (!g_lock)
-		g_lock = lock_create();
-
-	lock_lock(g_lock);
+	pthread_mutex_lock(&g_lock);
 	int tmp = (*v)++;
-	lock_unlock(g_lock);
+	pthread_mutex_unlock(&g_lock);
 	return tmp;
 }
 
 int atomic_dec(int *v)
 {
-	if (!g_lock)
-		g_lock = lock_create();
-
-	lock_lock(g_lock);
+	pthread_mutex_lock(&g_lock);
 	int tmp = --(*v);
-	lock_unlock(g_lock);
+	pthread_mutex_unlock(&g_lock);
 	return tmp;
 }
 
 int atomic_dec_and_zero(int *v, int *v2)
 {
-	if (!g_lock)
-		g_lock = lock_create();
-
-	lock_lock(g_lock);
+	pthread_mutex_lock(&g_lock);
 	int tmp = --(*v);
 	if (tmp == 0) *v2 = 0;
-	lock_unlock(g_lock);
+	pthread_mutex_unlock(&g_lock);
 	return tmp;
 }
 
+#endif
+
 static void thread_pause(thread t)
 {
 #ifdef _WIN32
@@ -170,24 +349,34 @@ static void thread_pause(thread t)
 #else
 	pthread_mutex_lock(&t->mutex);
 	t->busy = 0;
-	pthread_cond_wait(&t->cond, &t->mutex);
+
+	while (t->running && !t->f)
+		pthread_cond_wait(&t->cond, &t->mutex);
+
 	t->busy = 1;
 	pthread_mutex_unlock(&t->mutex);
 #endif
 
-	if (t->running)
+	if (t->running && t->f)
 		t->f((void*)t->data);
 
 	t->f = NULL;
 	t->data = NULL;
 }
 
+// Work is handed over, or the thread told to stop, under its mutex
+// so that it can't be missed by one just about to wait.
+
 static int thread_resume(thread t, int (*f)(void*), void *data)
 {
 #ifdef _WIN32
+	t->f = f;
+	t->data = data;
 	ResumeThread((HANDLE)t->id);
 #else
 	pthread_mutex_lock(&t->mutex);
+	t->f = f;
+	t->data = data;
 	pthread_cond_signal(&t->cond);
 	pthread_mutex_unlock(&t->mutex);
 #endif
@@ -218,12 +407,11 @@ static void *thread_start(thread t)
 	t->id = (void*)_beginthreadex(&sa, 0, (start_routine_t)start_routine, (LPVOID)t, 0, NULL);
 	return (void*)t->id;
 #else
+	// Joinable, so that a pool is only freed once they're gone.
+
 	typedef void *(*start_routine_t)(void*);
-	pthread_attr_t sa;
-	pthread_attr_init(&sa);
-	pthread_attr_setdetachstate(&sa, PTHREAD_CREATE_DETACHED);
 	pthread_t handle;
-	int status = pthread_create(&handle, &sa, (start_routine_t)start_routine, t);
+	int status = pthread_create(&handle, NULL, (start_routine_t)start_routine, t);
 	t->id = (void*)handle;
 	return (void*)(size_t)!status;
 #endif
@@ -275,16 +463,42 @@ thread_pool *tpool_create(int threads)
 {
 	thread_pool *tp = (thread_pool*)calloc(1, sizeof(struct thread_pool_));
 
+	if (!tp)
+		return NULL;
+
+	if (!(tp->lk = lock_create()))
+	{
+		free(tp);
+		return NULL;
+	}
+
 	if (threads > MAX_THREADS)
 		threads = MAX_THREADS;
 
 	while (threads-- > 0)
 	{
 		thread t = thread_create();
-		t->cnt = tp->cnt;
 		if (!t) break;
+		t->cnt = tp->cnt;
+
+		if (!thread_start(t))
+		{
+			thread_destroy(t);
+			break;
+		}
+
 		tp->threads[tp->cnt++] = t;
-		thread_start(t);
+	}
+
+	// Wait (briefly) for them to be ready, otherwise work
+	// handed out straight away would all be run in-line.
+
+	int i, cnt = 0;
+
+	for (i = 0; i < tp->cnt; i++)
+	{
+		while (tp->threads[i]->busy && (cnt++ < 1000))
+			msleep(1);
 	}
 
 	return tp;
@@ -295,22 +509,33 @@ int tpool_start(thread_pool *tp, int (*f)(void*), void *data)
 	if (!tp || !f)
 		return 0;
 
+	thread t = NULL;
 	int i;
 
+	// Claim one under the pool's lock, so that it can't be handed
+	// out twice before it has had a chance to wake up...
+
+	lock_lock(tp->lk);
+
 	for (i = 0; i < tp->cnt; i++)
 	{
-		thread t = tp->threads[tp->last++%tp->cnt];
+		thread tmp = tp->threads[tp->last++%tp->cnt];
 
-		if (t->busy)
+		if (tmp->busy)
 			continue;
 
-		t->f = f;
-		t->data = data;
-		thread_resume(t, f, data);
-		return 1;
+		t = tmp;
+		t->busy = 1;
+		break;
 	}
 
-	f(data);
+	lock_unlock(tp->lk);
+
+	if (t)
+		thread_resume(t, f, data);
+	else
+		f(data);
+
 	return 1;
 }
 
@@ -321,20 +546,24 @@ void tpool_destroy(thread_pool *tp)
 
 	int i;
 
+	// Each finishes what it is doing, if anything, and is then
+	// waited for before it is freed.
+
 	for (i = 0; i < tp->cnt; i++)
 	{
 		thread t = tp->threads[i];
 		t->running = 0;
-		int cnt = 0;
-
-		while (t->busy && (cnt++ < (1000*5)))
-			msleep(1);
-
 		thread_resume(t, NULL, NULL);
-		msleep(1);
+#ifdef _WIN32
+		WaitForSingleObject((HANDLE)t->id, INFINITE);
+		CloseHandle((HANDLE)t->id);
+#else
+		pthread_join((pthread_t)t->id, NULL);
+#endif
 		thread_destroy(t);
 	}
 
+	lock_destroy(tp->lk);
 	free(tp);
 }
 
@@ -19,6 +19,18 @@ extern int atomic_dec_and_zero(int *v, int *v2);
 extern int64_t atomic_add64(int64_t *v, int n);		// return pre-value
 extern uint64_t atomic_addu64(uint64_t *v, int n);	// return pre-value
 
+// An event counts signals and wakes all waiters on each. Waiters
+// pass the count they last saw, so a signal is never missed. Waits
+// return 0 on timeout (negative 'msecs' waits indefinitely).
+
+typedef struct event_ event;
+
+extern event *event_create(void);
+extern unsigned event_count(event *e);
+extern int event_wait(event *e, unsigned count, int msecs);
+extern void event_signal(event *e);
+extern void event_destroy(event *e);
+
 // Run a supplied function as a one-off detached thread. The
 // thread will be destroyed after this single use.
 
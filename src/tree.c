@@ -3,19 +3,21 @@
   *Like a b-tree, but optimized for indexing timestamped logfiles.
   *A key value of zero is not allowed.
   *In-order adds are extremely quick (effectively an append)
-  *Out-of-order inserts not so much.
+  *Out-of-order inserts split full branches, as a b-tree does,
+  *in half, or where a run of inserts is going.
  *
   *Thread-safe for a single writer and readers.
  *
-  *Future enhancement: if nbr of nodes in a branch *drops below half,
-  *then reallocate the branch *at half the size. But only if
-  *the number is above a certain minimum. This way we can  garbage
-  *collect wasted space.
+  *Deletes fold a sparse branch into a neighbour, or reallocate it
+  *smaller, so that memory follows the number of keys. A branch
+  *still being appended to is never made smaller than it started.
  *
  */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "tree.h"
 
@@ -23,27 +25,55 @@
 #define TREE_NODES 64
 #endif
 
+// Within a branch, binary search down to this many keys, then
+// count the rest at once...
+
+#ifndef TREE_WINDOW
+#define TREE_WINDOW TREE_NODES
+#endif
+
+// A branch down to a quarter full is merged with a neighbour, if
+// together they come to no more than three quarters. Else it is
+// halved once down to a quarter full, but no smaller than this...
+
+#ifndef TREE_MIN
+#define TREE_MIN (TREE_NODES/4)
+#endif
+
+// Levels, way more than there ever will be...
+
+#define TREE_MAXDEPTH 32
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define TREE_SIMD 1
+#include <immintrin.h>
+#endif
+
 typedef struct trunk_ trunk;
 typedef struct branch_ branch;
-typedef struct node_ node;
 
-struct node_
+typedef union
 {
-	uuid k;
+	unsigned long long v;	// if a leaf: stores value
+	branch *b;				// otherwise: points to branch
+}
+ slot;
 
-	union
-	{
-		unsigned long long v;	// if a leaf: stores value
-		branch *b;				// otherwise: points to branch
-	};
-};
+// The keys of a branch are kept apart from what they lead to, and
+// split into high and low halves, each contiguous: the high halves
+// ('u1') are compared several at a time. So 'maxnode_s' of each,
+// then the values (or branches).
 
 struct branch_
 {
 	unsigned maxnode_s, nodes, leaf;
-	node n[0];
+	uint64_t d[];
 };
 
+#define KHI(b) ((b)->d)
+#define KLO(b) ((b)->d + (b)->maxnode_s)
+#define VAL(b) ((slot*)((b)->d + 2*(b)->maxnode_s))
+
 struct trunk_
 {
 	branch *active;
@@ -54,56 +84,255 @@ struct tree_
 {
 	trunk *first, *last;
 	size_t trunks, branches, leafs;
+	size_t slots, bytes;
+	const branch *run;
+	int run_pos;
 	uuid last_key;
 };
 
 static uuid kzero = {0};
 
-static int binary_search(node *n, const uuid *k, int imin, int imax)
+static uuid key_get(const branch *b, int i)
+{
+	uuid k;
+	k.u1 = KHI(b)[i];
+	k.u2 = KLO(b)[i];
+	return k;
+}
+
+static void key_set(branch *b, int i, const uuid *k)
+{
+	KHI(b)[i] = k->u1;
+	KLO(b)[i] = k->u2;
+}
+
+// Compare key 'i' with 'k', as uuid_compare.
+
+static int key_compare(const branch *b, int i, const uuid *k)
+{
+	uint64_t hi = KHI(b)[i], lo = KLO(b)[i];
+
+	if (hi != k->u1)
+		return hi < k->u1 ? -1 : 1;
+
+	return lo < k->u2 ? -1 : lo > k->u2 ? 1 : 0;
+}
+
+// Slide 'cnt' keys (and values) from 'from' to 'to'.
+
+static void branch_move(branch *b, int to, int from, int cnt)
+{
+	if (cnt <= 0)
+		return;
+
+	memmove(KHI(b)+to, KHI(b)+from, cnt*sizeof(uint64_t));
+	memmove(KLO(b)+to, KLO(b)+from, cnt*sizeof(uint64_t));
+	memmove(VAL(b)+to, VAL(b)+from, cnt*sizeof(slot));
+}
+
+static size_t branch_size(unsigned maxnode_s)
+{
+	return sizeof(struct branch_) + maxnode_s * (2*sizeof(uint64_t)+sizeof(slot));
+}
+
+// Keep count of the room for keys in leaf branches, and the memory
+// held by all of them.
+
+static void branch_account(tree *tptr, const branch *b, int sign)
+{
+	if (b->leaf)
+		tptr->slots += sign * (long)b->maxnode_s;
+
+	tptr->bytes += sign * (long)branch_size(b->maxnode_s);
+}
+
+static branch *branch_alloc(tree *tptr, unsigned maxnode_s, int leaf)
+{
+	branch *b = (branch*)calloc(1, branch_size(maxnode_s));
+	if (!b) return NULL;
+	b->maxnode_s = maxnode_s;
+	b->leaf = leaf;
+	tptr->branches++;
+	branch_account(tptr, b, 1);
+	return b;
+}
+
+static void branch_free(tree *tptr, branch *b)
+{
+	branch_account(tptr, b, -1);
+	tptr->branches--;
+	free(b);
+}
+
+// The low halves and values move up to make room for more keys, or
+// down before giving room back. Should a shrink not be able to
+// reallocate, the branch just stays as big as it was.
+
+static branch *branch_resize(tree *tptr, branch *b, unsigned maxnode_s)
 {
-	while (imax >= imin)
+	unsigned old = b->maxnode_s;
+
+	if (maxnode_s < b->nodes)
+		return b;
+
+	branch_account(tptr, b, -1);
+
+	if (maxnode_s < old)
 	{
-		int imid = (imax + imin) / 2;
-		int x = uuid_compare(&n[imid].k, k);
+		memmove(b->d+maxnode_s, b->d+old, b->nodes*sizeof(uint64_t));
+		memmove(b->d+2*maxnode_s, b->d+2*old, b->nodes*sizeof(slot));
+		b->maxnode_s = maxnode_s;
+		branch *b2 = (branch*)realloc(b, branch_size(maxnode_s));
+		if (b2) b = b2;
+		branch_account(tptr, b, 1);
+		return b;
+	}
 
-		if (x == 0)
-			return imid;
-		else if (x < 0)
-			imin = imid + 1;
-		else
-			imax = imid - 1;
+	branch *b2 = (branch*)realloc(b, branch_size(maxnode_s));
+
+	if (!b2)
+	{
+		branch_account(tptr, b, 1);
+		return NULL;
+	}
+
+	b = b2;
+	memmove(b->d+2*maxnode_s, b->d+2*old, b->nodes*sizeof(slot));
+	memmove(b->d+maxnode_s, b->d+old, b->nodes*sizeof(uint64_t));
+	b->maxnode_s = maxnode_s;
+	branch_account(tptr, b, 1);
+	return b;
+}
+
+// How many of 'n' (ascending) high halves are less than 'k'. With
+// AVX2 or SSE4.2 compare four or two at a time, if the CPU has it.
+// Being unsigned, flip the sign bits for a signed compare.
+
+static int count_less_sw(const uint64_t *hi, int n, uint64_t k)
+{
+	int i, cnt = 0;
+
+	for (i = 0; i < n; i++)
+		cnt += hi[i] < k;
+
+	return cnt;
+}
+
+#if TREE_SIMD
+__attribute__((target("avx2,popcnt")))
+static int count_less_avx2(const uint64_t *hi, int n, uint64_t k)
+{
+	const __m256i bias = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+	const __m256i vk = _mm256_xor_si256(_mm256_set1_epi64x((long long)k), bias);
+	int i = 0, cnt = 0;
+
+	for (; (i+4) <= n; i += 4)
+	{
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(hi+i)), bias);
+		__m256i lt = _mm256_cmpgt_epi64(vk, v);
+		cnt += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
 	}
 
-	return -1;
+	return cnt + count_less_sw(hi+i, n-i, k);
 }
 
-// Modified binary search: return position where it is or ought to be
+__attribute__((target("sse4.2,popcnt")))
+static int count_less_sse42(const uint64_t *hi, int n, uint64_t k)
+{
+	const __m128i bias = _mm_set1_epi64x((long long)0x8000000000000000ULL);
+	const __m128i vk = _mm_xor_si128(_mm_set1_epi64x((long long)k), bias);
+	int i = 0, cnt = 0;
+
+	for (; (i+2) <= n; i += 2)
+	{
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(hi+i)), bias);
+		__m128i lt = _mm_cmpgt_epi64(vk, v);
+		cnt += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(lt)));
+	}
+
+	return cnt + count_less_sw(hi+i, n-i, k);
+}
+#endif
+
+static int (*count_less)(const uint64_t*, int, uint64_t) = &count_less_sw;
+
+// Chosen once at load time, before any thread can be searching. The
+// CPU features may not be known yet in a constructor, so ask first.
+
+#if TREE_SIMD
+__attribute__((constructor))
+static void tree_init(void)
+{
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		count_less = &count_less_avx2;
+	else if (__builtin_cpu_supports("sse4.2"))
+		count_less = &count_less_sse42;
+}
+#endif
+
+// Lowest position whose key is not less than 'k'. Only keys whose
+// high halves tie need their low halves compared.
 
-static int binary_search2(node *n, const uuid *k, int imin, int imax)
+static int lower_bound(const branch *b, const uuid *k)
 {
-	int imid = 0;
+	const uint64_t *hi = KHI(b), *lo = KLO(b);
+	int imin = 0, imax = b->nodes;
 
-	while (imax >= imin)
+	while ((imax - imin) > TREE_WINDOW)
 	{
-		imid = (imax + imin) / 2;
-		int x = uuid_compare(&n[imid].k, k);
+		int imid = (imax + imin) / 2;
 
-		if (x == 0)
-			return -1;
-		else if (x < 0)
+		if (key_compare(b, imid, k) < 0)
 			imin = imid + 1;
 		else
-			imax = imid - 1;
+			imax = imid;
 	}
 
-	// The binary search can come up either side of the
-	// actual insertion point, depending upon odd-even
-	// number of points. Make sure we get it right...
+	int i = imin + count_less(hi+imin, imax-imin, k->u1);
+
+	while ((i < imax) && (hi[i] == k->u1) && (lo[i] < k->u2))
+		i++;
+
+	return i;
+}
+
+// Where the key is, or -1.
+
+static int binary_search(const branch *b, const uuid *k)
+{
+	int i = lower_bound(b, k);
+
+	if ((i == b->nodes) || key_compare(b, i, k))
+		return -1;
+
+	return i;
+}
+
+// Where the key ought to be, or -1 if already there.
+
+static int binary_search2(const branch *b, const uuid *k)
+{
+	int i = lower_bound(b, k);
+
+	if ((i < b->nodes) && !key_compare(b, i, k))
+		return -1;
+
+	return i;
+}
+
+// The child branch that would hold the key: a branch's key is the
+// lowest it holds. Or -1 if there isn't one.
+
+static int branch_child(const branch *b, const uuid *k)
+{
+	int i = lower_bound(b, k);
 
-	if (uuid_compare(&n[imid].k, k) < 0)
-		imid++;
+	if ((i < b->nodes) && !key_compare(b, i, k))
+		return i;
 
-	return imid;
+	return i - 1;
 }
 
 tree *tree_create()
@@ -114,21 +343,15 @@ tree *tree_create()
 	tptr->last = tptr->first = (trunk*)calloc(1, sizeof(struct trunk_));
 	if (!tptr->last) return tptr;
 
-	size_t block_size = TREE_NODES  *sizeof(struct node_);
-	block_size += sizeof(struct branch_);
-
-	tptr->branches++;
 	trunk *t = tptr->first;
-	t->active = (branch*)calloc(1, block_size);
+	t->active = branch_alloc(tptr, TREE_NODES, 1);
 	if (!t->active) return tptr;
-	t->active->maxnode_s = TREE_NODES;
-	t->active->leaf = 1;
 
 	// Add in a dummy (illegal) zero key,
 	// to aid/simplify inserts...
 
-	t->active->n[t->active->nodes].k = kzero;
-	t->active->n[t->active->nodes].v = 0;
+	key_set(t->active, t->active->nodes, &kzero);
+	VAL(t->active)[t->active->nodes].v = 0;
 	t->active->nodes++;
 	return tptr;
 }
@@ -138,68 +361,144 @@ size_t tree_count(const tree *tptr)
 	return tptr->leafs;
 }
 
-static int branch_insert(tree *tptr, branch **b2, const uuid *k, unsigned long long v)
+// The trunk a branch is active in, if any.
+
+static trunk *active_trunk(const tree *tptr, const branch *b)
 {
-	branch *b = *b2;
+	trunk *t;
 
-	if (b->leaf)
+	for (t = tptr->first; t; t = t->next)
 	{
-		int imid = binary_search2(b->n, k, 0, b->nodes-1);
+		if (b == t->active)
+			return t;
+	}
 
-		if (imid < 0)
-			return 0;
+	return NULL;
+}
+
+static int is_active(const tree *tptr, const branch *b)
+{
+	return active_trunk(tptr, b) != NULL;
+}
 
-		// If full, reallocate a bigger one...
+static void trunk_add(tree *tptr, trunk *t, branch *save, branch *b, const uuid *k)
+{
+	if (!t->next)
+	{
+		tptr->trunks++;
+		tptr->last = t->next = (trunk*)calloc(1, sizeof(struct trunk_));
+		if (!tptr->last) return;
 
-		if (b->nodes == b->maxnode_s)
-		{
-			b->maxnode_s += 1;
-			size_t block_size = b->maxnode_s  *sizeof(struct node_);
-			block_size += sizeof(struct branch_);
-			b = (branch*)realloc(b, block_size);
-			if (!b) return 0;
+		t->next->active = branch_alloc(tptr, TREE_NODES, 0);
+		if (!t->next->active) return;
+		uuid k0 = key_get(save, 0);
+		key_set(t->next->active, 0, &k0);
+		VAL(t->next->active)[0].b = save;
+		t->next->active->nodes++;
+	}
+
+	t = t->next;
 
-			if (*b2 == tptr->first->active)
-				tptr->first->active = b;
+	if (t->active->nodes == t->active->maxnode_s)
+	{
+		branch *save2 = t->active;
+		t->active = branch_alloc(tptr, TREE_NODES, 0);
+		if (!t->active) return;
+		trunk_add(tptr, t, save2, t->active, k);
+	}
 
-			*b2 = b;
-		}
+	key_set(t->active, t->active->nodes, k);
+	VAL(t->active)[t->active->nodes].b = b;
+	t->active->nodes++;
+}
 
-		// Slide things up and in-fill...
+// Out-of-order inserts split full branches, B+tree style. The path
+// down is kept by level, leaves being level 0, as are the trunks.
 
-		int i;
+// Make room for one more in 'path[lvl]', to go in at '*pos'. A branch
+// smaller than TREE_NODES (see branch_tidy) grows back, otherwise it
+// is split. The lower part goes to a new branch linked in before it,
+// so an active branch stays the last at its level, and '*pos' then
+// follows into whichever part it falls in. The parent is made room
+// for first, and a split root adds a level.
 
-		for (i = b->nodes; i > imid; i--)
-			b->n[i] = b->n[i-1];
+static int branch_room(tree *tptr, branch **path, int *idx, int lvl, int *pos)
+{
+	branch *b = path[lvl];
+	int n = b->nodes;
 
-		b->n[i].k = *k;
-		b->n[i].v = v;
-		b->nodes++;
-		tptr->leafs++;
+	if (n < b->maxnode_s)
 		return 1;
-	}
 
-	branch **last = 0;
-	node *n = b->n;
-	int i;
-
-	for (i = 0; i < b->nodes; i++, n++)
+	if (b->maxnode_s < TREE_NODES)
 	{
-		int x = uuid_compare(k, &n->k);
+		unsigned maxnode_s = b->leaf ? b->maxnode_s+TREE_NODES/8+1 : TREE_NODES;
+		trunk *t = active_trunk(tptr, b);
+		b = branch_resize(tptr, b, maxnode_s < TREE_NODES ? maxnode_s : TREE_NODES);
+		if (!b) return 0;
 
-		if (x < 0)
-			break;
+		if (t)
+			t->active = b;
 
-		last = &n->b;
+		if (lvl < (tptr->trunks-1))
+			VAL(path[lvl+1])[idx[lvl+1]].b = b;
 
-		if (x == 0)
-			break;
+		path[lvl] = b;
+		return 1;
 	}
 
-	if (!last)
+	// Split in half. Unless continuing a run of inserts, up or
+	// down, when splitting right there leaves full ones behind...
+
+	int s = n / 2;
+
+	if (b->leaf && (b == tptr->run) && ((*pos == tptr->run_pos) || (*pos == (tptr->run_pos+1))))
+		s = *pos < 1 ? 1 : *pos < n ? *pos : n - 1;
+
+	int top = lvl == (tptr->trunks-1);
+
+	if (!top && !branch_room(tptr, path, idx, lvl+1, &idx[lvl+1]))
 		return 0;
 
-	return branch_insert(tptr, last, k, v);
+	branch *l = branch_alloc(tptr, TREE_NODES, b->leaf);
+	if (!l) return 0;
+	memcpy(KHI(l), KHI(b), s*sizeof(uint64_t));
+	memcpy(KLO(l), KLO(b), s*sizeof(uint64_t));
+	memcpy(VAL(l), VAL(b), s*sizeof(slot));
+	l->nodes = s;
+	branch_move(b, 0, s, n-s);
+	b->nodes = n - s;
+	uuid k0 = key_get(b, 0);
+
+	if (top)
+	{
+		trunk_add(tptr, tptr->last, l, b, &k0);
+		path[lvl+1] = tptr->last->active;
+		idx[lvl+1] = 1;
+	}
+	else
+	{
+		// The new one takes over the old key, which
+		// is no more than any it holds...
+
+		branch *p = path[lvl+1];
+		int i = idx[lvl+1];
+		branch_move(p, i+1, i, p->nodes-i);
+		VAL(p)[i].b = l;
+		key_set(p, i+1, &k0);
+		p->nodes++;
+		idx[lvl+1] = i + 1;
+	}
+
+	if (b->leaf ? (*pos <= s) : (*pos < s))
+	{
+		path[lvl] = l;
+		idx[lvl+1]--;
+	}
+	else
+		*pos -= s;
+
+	return 1;
 }
 
 int tree_insert(tree *tptr, const uuid *k, unsigned long long v)
@@ -207,48 +506,77 @@ int tree_insert(tree *tptr, const uuid *k, unsigned long long v)
 	if (!tptr)
 		return 0;
 
-	return branch_insert(tptr, &tptr->last->active, k, v);
-}
+	branch *path[TREE_MAXDEPTH+1];
+	int idx[TREE_MAXDEPTH+1];
+	int lvl = tptr->trunks - 1;
+	branch *b = tptr->last->active;
 
-static void trunk_add(tree *tptr, trunk *t, branch *save, branch *b, const uuid *k)
-{
-	if (!t->next)
+	if (lvl >= TREE_MAXDEPTH)
+		return 0;
+
+	path[lvl] = b;
+
+	while (!b->leaf)
 	{
-		tptr->trunks++;
-		tptr->last = t->next = (trunk*)calloc(1, sizeof(struct trunk_));
-		if (!tptr->last) return;
+		if (!b->nodes || (lvl == 0))
+			return 0;
 
-		size_t block_size = TREE_NODES  *sizeof(struct node_);
-		block_size += sizeof(struct branch_);
+		int i = branch_child(b, k);
 
-		tptr->branches++;
-		t->next->active = (branch*)calloc(1, block_size);
-		if (!t->next->active) return;
-		t->next->active->maxnode_s = TREE_NODES;
-		t->next->active->n[0].k = save->n[0].k;
-		t->next->active->n[0].b = save;
-		t->next->active->nodes++;
+		// Lower than any here (as when the first branch
+		// has gone), so the first now starts lower...
+
+		if (i < 0)
+		{
+			key_set(b, 0, k);
+			i = 0;
+		}
+
+		idx[lvl] = i;
+		b = path[--lvl] = VAL(b)[i].b;
 	}
 
-	t = t->next;
+	int pos = binary_search2(b, k);
+
+	if (pos < 0)
+		return 0;
+
+	if (!branch_room(tptr, path, idx, 0, &pos))
+		return 0;
+
+	// Slide things up and in-fill...
+
+	b = path[0];
+	branch_move(b, pos+1, pos, b->nodes-pos);
+	key_set(b, pos, k);
+	VAL(b)[pos].v = v;
+	b->nodes++;
+	tptr->leafs++;
+	tptr->run = b;
+	tptr->run_pos = pos;
+	return 1;
+}
+
+// Past the last key, so it just goes on the end...
+
+static int tree_append2(tree *tptr, const uuid *k, unsigned long long v)
+{
+	trunk *t = tptr->first;
 
 	if (t->active->nodes == t->active->maxnode_s)
 	{
 		branch *save2 = t->active;
-
-		size_t block_size = TREE_NODES  *sizeof(struct node_);
-		block_size += sizeof(struct branch_);
-
-		tptr->branches++;
-		t->active = (branch*)calloc(1, block_size);
-		if (!t->active) return;
-		t->active->maxnode_s = TREE_NODES;
+		t->active = branch_alloc(tptr, TREE_NODES, 1);
+		if (!t->active) return 0;
 		trunk_add(tptr, t, save2, t->active, k);
 	}
 
-	t->active->n[t->active->nodes].k = *k;
-	t->active->n[t->active->nodes].b = b;
+	key_set(t->active, t->active->nodes, k);
+	VAL(t->active)[t->active->nodes].v = v;
 	t->active->nodes++;
+	tptr->leafs++;
+	tptr->last_key = *k;
+	return 1;
 }
 
 int tree_add(tree *tptr, const uuid *k, unsigned long long v)
@@ -256,109 +584,156 @@ int tree_add(tree *tptr, const uuid *k, unsigned long long v)
 	if (!tptr || !k)
 		return 0;
 
-	if (uuid_compare(k, &tptr->last_key) < 0)
+	int x = uuid_compare(k, &tptr->last_key);
+
+	if (x < 0)
 		return tree_insert(tptr, k, v);
 
-	trunk *t = tptr->first;
+	// Already there? Unless it has since been deleted.
 
-	if (t->active->nodes == t->active->maxnode_s)
+	if (x == 0)
 	{
-		branch *save2 = t->active;
+		unsigned long long tmp;
 
-		size_t block_size = TREE_NODES  *sizeof(struct node_);
-		block_size += sizeof(struct branch_);
-
-		tptr->branches++;
-		t->active = (branch*)calloc(1, block_size);
-		if (!t->active) return 0;
-		t->active->maxnode_s = TREE_NODES;
-		t->active->leaf = 1;
-		trunk_add(tptr, t, save2, t->active, k);
+		if (tree_get(tptr, k, &tmp))
+			return 0;
 	}
 
-	t->active->n[t->active->nodes].k = *k;
-	t->active->n[t->active->nodes].v = v;
-	t->active->nodes++;
-	tptr->leafs++;
-	tptr->last_key = *k;
-	return 1;
+	return tree_append2(tptr, k, v);
 }
 
-static int is_active(const tree *tptr, const branch *b)
+int tree_append(tree *tptr, const uuid *k, unsigned long long v)
 {
-	trunk *t;
+	if (!tptr || !k || (uuid_compare(k, &tptr->last_key) <= 0))
+		return 0;
 
-	for (t = tptr->first; t; t = t->next)
+	return tree_append2(tptr, k, v);
+}
+
+static void branch_drop(tree *tptr, branch *b, int i)
+{
+	branch_free(tptr, VAL(b)[i].b);
+	branch_move(b, i, i+1, b->nodes-i-1);
+	b->nodes--;
+}
+
+// Fold child 'i+1' into child 'i'. All its keys are beyond those
+// of 'i', so they just go on the end.
+
+static int branch_merge(tree *tptr, branch *b, int i)
+{
+	branch *l = VAL(b)[i].b, *r = VAL(b)[i+1].b;
+	unsigned nodes = l->nodes + r->nodes;
+
+	if (nodes > l->maxnode_s)
 	{
-		if (b == t->active)
-			return 1;
+		l = branch_resize(tptr, l, nodes);
+		if (!l) return 0;
+		VAL(b)[i].b = l;
 	}
 
-	return 0;
+	memcpy(KHI(l)+l->nodes, KHI(r), r->nodes*sizeof(uint64_t));
+	memcpy(KLO(l)+l->nodes, KLO(r), r->nodes*sizeof(uint64_t));
+	memcpy(VAL(l)+l->nodes, VAL(r), r->nodes*sizeof(slot));
+	l->nodes = nodes;
+	branch_free(tptr, r);
+	branch_move(b, i+1, i+2, b->nodes-i-2);
+	b->nodes--;
+	return 1;
 }
 
-static int branch_del(tree *tptr, branch *b, const uuid *k)
+// Give back room down to 'maxnode_s', or 'min' if more.
+
+static branch *branch_trim(tree *tptr, branch *b, unsigned maxnode_s, unsigned min)
 {
-	if (b->leaf)
-	{
-		int idx = binary_search(b->n, k, 0, b->nodes-1);
-		if (idx < 0) return 0;
+	if (maxnode_s < min)
+		maxnode_s = min;
 
-		while (idx < b->nodes)
-		{
-			b->n[idx] = b->n[idx+1];
-			idx++;
-		}
+	if (maxnode_s >= b->maxnode_s)
+		return b;
 
-		b->nodes--;
-		tptr->leafs--;
+	int first = b == tptr->first->active;
+	b = branch_resize(tptr, b, maxnode_s);
 
-		// TO-DO: if 'nodes' drops below half full
-		// re-allocate a smaller branch.
+	if (first)
+		tptr->first->active = b;
 
-		return 1;
-	}
+	return b;
+}
 
-	node *last = 0;
-	node *n = b->n;
-	int i;
+// Halve a branch once down to a quarter full.
 
-	for (i = 0; i < b->nodes; i++, n++)
-	{
-		int x = uuid_compare(k, &n->k);
+static branch *branch_shrink(tree *tptr, branch *b, unsigned min)
+{
+	if ((b->nodes*4) >= b->maxnode_s)
+		return b;
 
-		if (x < 0)
-			break;
+	return branch_trim(tptr, b, b->maxnode_s/2, min);
+}
 
-		last = n;
+// After a delete below child 'i': drop it if empty, or merge it with
+// a neighbour if sparse, or failing that give back some of its room.
+// An active branch is only shrunk, and no smaller than it started.
 
-		if (x == 0)
-			break;
-	}
+static void branch_tidy(tree *tptr, branch *b, int i)
+{
+	branch *child = VAL(b)[i].b;
 
-	if (!last)
-		return 0;
+	if (is_active(tptr, child))
+	{
+		VAL(b)[i].b = branch_shrink(tptr, child, TREE_NODES);
+		return;
+	}
 
-	int del = branch_del(tptr, last->b, k);
+	if (!child->nodes)
+	{
+		branch_drop(tptr, b, i);
+		return;
+	}
 
-	if (!last->b->nodes)
+	if (child->nodes <= (TREE_NODES/4))
 	{
-		if (!is_active(tptr, last->b))
+		if ((i > 0) && ((VAL(b)[i-1].b->nodes + child->nodes) <= (TREE_NODES*3/4)))
 		{
-			free(last->b);
-			tptr->branches--;
+			if (branch_merge(tptr, b, i-1))
+				return;
 		}
 
-		while (i < b->nodes)
+		if (((i+1) < b->nodes) && !is_active(tptr, VAL(b)[i+1].b) &&
+			((child->nodes + VAL(b)[i+1].b->nodes) <= (TREE_NODES*3/4)))
 		{
-			last[0] = last[1];
-			last++;
-			i++;
+			if (branch_merge(tptr, b, i))
+				return;
 		}
+	}
 
+	VAL(b)[i].b = branch_shrink(tptr, child, TREE_MIN);
+}
+
+static int branch_del(tree *tptr, branch *b, const uuid *k)
+{
+	if (b->leaf)
+	{
+		int idx = binary_search(b, k);
+		if (idx < 0) return 0;
+
+		branch_move(b, idx, idx+1, b->nodes-idx-1);
 		b->nodes--;
+		tptr->leafs--;
+		return 1;
 	}
 
+	int i = branch_child(b, k);
+
+	if (i < 0)
+		return 0;
+
+	branch *child = VAL(b)[i].b;
+	int del = branch_del(tptr, child, k);
+
+	if (del)
+		branch_tidy(tptr, b, i);
+
 	return del;
 }
 
@@ -367,40 +742,89 @@ int tree_del(tree *tptr, const uuid *k)
 	if (!tptr || !k)
 		return 0;
 
-	return branch_del(tptr, tptr->last->active, k);
+	trunk *t = tptr->last;
+
+	if (!branch_del(tptr, t->active, k))
+		return 0;
+
+	// A lone leaf has no parent to see to it...
+
+	if (t->active->leaf)
+		tptr->first->active = t->active = branch_shrink(tptr, t->active, TREE_NODES);
+
+	return 1;
 }
 
-static int branch_get(const tree *tptr, branch *b, const uuid *k, unsigned long long *v)
+// From the bottom up: drop empty branches, merge neighbours that fit
+// in one and trim the rest to size.
+
+static void branch_compact(tree *tptr, branch *b)
 {
+	int i;
+
 	if (b->leaf)
+		return;
+
+	for (i = 0; i < b->nodes; i++)
+		branch_compact(tptr, VAL(b)[i].b);
+
+	for (i = 0; i < b->nodes; )
 	{
-		int idx = binary_search(b->n, k, 0, b->nodes-1);
-		if (idx < 0) return 0;
-		*v = b->n[idx].v;
-		return 1;
-	}
+		branch *child = VAL(b)[i].b;
 
-	branch *last = 0;
-	node *n = b->n;
-	int i;
+		if (!child->nodes && !is_active(tptr, child))
+			branch_drop(tptr, b, i);
+		else
+			i++;
+	}
 
-	for (i = 0; i < b->nodes; i++, n++)
+	for (i = 0; (i+1) < b->nodes; )
 	{
-		int x = uuid_compare(k, &n->k);
+		branch *l = VAL(b)[i].b, *r = VAL(b)[i+1].b;
 
-		if (x < 0)
-			break;
+		if (is_active(tptr, r) || ((l->nodes + r->nodes) > TREE_NODES) || !branch_merge(tptr, b, i))
+			i++;
+	}
 
-		last = n->b;
+	for (i = 0; i < b->nodes; i++)
+	{
+		branch *child = VAL(b)[i].b;
 
-		if (x == 0)
-			break;
+		VAL(b)[i].b = branch_trim(tptr, child, child->nodes, is_active(tptr, child) ? TREE_NODES : 1);
 	}
+}
 
-	if (!last)
+size_t tree_compact(tree *tptr)
+{
+	if (!tptr)
 		return 0;
 
-	return branch_get(tptr, last, k, v);
+	size_t bytes = tptr->bytes;
+	trunk *t = tptr->last;
+	branch_compact(tptr, t->active);
+
+	if (t->active->leaf)
+		tptr->first->active = t->active = branch_trim(tptr, t->active, t->active->nodes, TREE_NODES);
+
+	return bytes - tptr->bytes;
+}
+
+static int branch_get(const tree *tptr, const branch *b, const uuid *k, unsigned long long *v)
+{
+	while (!b->leaf)
+	{
+		int i = branch_child(b, k);
+
+		if (i < 0)
+			return 0;
+
+		b = VAL(b)[i].b;
+	}
+
+	int idx = binary_search(b, k);
+	if (idx < 0) return 0;
+	*v = VAL(b)[idx].v;
+	return 1;
 }
 
 int tree_get(const tree *tptr, const uuid *k, unsigned long long *v)
@@ -413,35 +837,20 @@ int tree_get(const tree *tptr, const uuid *k, unsigned long long *v)
 
 static int branch_set(const tree *tptr, branch *b, const uuid *k, unsigned long long v)
 {
-	if (b->leaf)
-	{
-		int idx = binary_search(b->n, k, 0, b->nodes-1);
-		if (idx < 0) return 0;
-		b->n[idx].v = v;
-		return 1;
-	}
-
-	branch *last = 0;
-	node *n = b->n;
-	int i;
-
-	for (i = 0; i < b->nodes; i++, n++)
+	while (!b->leaf)
 	{
-		int x = uuid_compare(k, &n->k);
+		int i = branch_child(b, k);
 
-		if (x < 0)
-			break;
-
-		last = n->b;
+		if (i < 0)
+			return 0;
 
-		if (x == 0)
-			break;
+		b = VAL(b)[i].b;
 	}
 
-	if (!last)
-		return 0;
-
-	return branch_set(tptr, last, k, v);
+	int idx = binary_search(b, k);
+	if (idx < 0) return 0;
+	VAL(b)[idx].v = v;
+	return 1;
 }
 
 int tree_set(const tree *tptr, const uuid *k, unsigned long long v)
@@ -460,10 +869,12 @@ static int branch_iter(const tree *tptr, size_t *cnt, branch *b, void *h, int (*
 	{
 		if (b->leaf)
 		{
-			if (uuid_compare(&b->n[i].k, &kzero) == 0)
+			uuid k = key_get(b, i);
+
+			if (uuid_compare(&k, &kzero) == 0)
 				continue;
 
-			int ok = f(h, &b->n[i].k, &b->n[i].v);
+			int ok = f(h, &k, &VAL(b)[i].v);
 
 			if (ok < 0)
 				return 0;
@@ -472,7 +883,7 @@ static int branch_iter(const tree *tptr, size_t *cnt, branch *b, void *h, int (*
 			continue;
 		}
 
-		if (branch_iter(tptr, cnt, b->n[i].b, h, f) < 0)
+		if (!branch_iter(tptr, cnt, VAL(b)[i].b, h, f))
 			return 0;
 	}
 
@@ -490,6 +901,294 @@ size_t tree_iter(const tree *tptr, void *h, int (*f)(void*,const uuid*,unsigned
 	return cnt;
 }
 
+static int branch_range(const tree *tptr, size_t *cnt, branch *b, const uuid *from, const uuid *to, void *h, int (*f)(void*,const uuid*,unsigned long long*))
+{
+	int i = b->leaf ? lower_bound(b, from) : branch_child(b, from);
+
+	// A branch's key is the lowest it holds, so the one
+	// holding 'from' may be the one before...
+
+	if (i < 0)
+		i = 0;
+
+	for (; i < b->nodes; i++)
+	{
+		if (to && (key_compare(b, i, to) >= 0))
+			return 1;
+
+		if (!b->leaf)
+		{
+			if (!branch_range(tptr, cnt, VAL(b)[i].b, from, to, h, f))
+				return 0;
+
+			continue;
+		}
+
+		uuid k = key_get(b, i);
+
+		if (uuid_compare(&k, &kzero) == 0)
+			continue;
+
+		int ok = f(h, &k, &VAL(b)[i].v);
+
+		if (ok < 0)
+			return 0;
+
+		*cnt += ok;
+	}
+
+	return 1;
+}
+
+size_t tree_range(const tree *tptr, const uuid *from, const uuid *to, void *h, int (*f)(void*,const uuid*,unsigned long long*))
+{
+	if (!tptr || !f)
+		return 0;
+
+	const trunk *t = tptr->last;
+	size_t cnt = 0;
+	branch_range(tptr, &cnt, t->active, from ? from : &kzero, to, h, f);
+	return cnt;
+}
+
+// A cursor keeps the path down to its leaf, so stepping only goes
+// back up as far as it has to.
+
+struct tree_cursor_
+{
+	const tree *tptr;
+	uuid from, to;
+	int has_to, depth, started, valid;
+	branch *b[TREE_MAXDEPTH];
+	int i[TREE_MAXDEPTH];
+};
+
+tree_cursor *tree_cursor_open(const tree *tptr, const uuid *from, const uuid *to)
+{
+	if (!tptr)
+		return NULL;
+
+	tree_cursor *c = (tree_cursor*)calloc(1, sizeof(struct tree_cursor_));
+	if (!c) return NULL;
+	c->tptr = tptr;
+	c->from = from ? *from : kzero;
+
+	if (to)
+	{
+		c->to = *to;
+		c->has_to = 1;
+	}
+
+	return c;
+}
+
+// Settle on the nearest key at or after the current position,
+// climbing out of exhausted (or empty) branches and descending the
+// next. The dummy zero key is passed over.
+
+static int cursor_fwd(tree_cursor *c)
+{
+	int d = c->depth - 1;
+
+	for (;;)
+	{
+		while ((d >= 0) && (c->i[d] >= c->b[d]->nodes))
+		{
+			if (--d >= 0)
+				c->i[d]++;
+		}
+
+		if (d < 0)
+			return 0;
+
+		while (!c->b[d]->leaf && (d < (TREE_MAXDEPTH-1)))
+		{
+			branch *b = VAL(c->b[d])[c->i[d]].b;
+			c->b[++d] = b;
+			c->i[d] = 0;
+		}
+
+		if (c->i[d] >= c->b[d]->nodes)
+			continue;
+
+		if (!KHI(c->b[d])[c->i[d]] && !KLO(c->b[d])[c->i[d]])
+		{
+			c->i[d]++;
+			continue;
+		}
+
+		c->depth = d + 1;
+		return 1;
+	}
+}
+
+// Likewise, at or before it.
+
+static int cursor_back(tree_cursor *c)
+{
+	int d = c->depth - 1;
+
+	for (;;)
+	{
+		while ((d >= 0) && (c->i[d] < 0))
+		{
+			if (--d >= 0)
+				c->i[d]--;
+		}
+
+		if (d < 0)
+			return 0;
+
+		while (!c->b[d]->leaf && (d < (TREE_MAXDEPTH-1)))
+		{
+			branch *b = VAL(c->b[d])[c->i[d]].b;
+			c->b[++d] = b;
+			c->i[d] = (int)b->nodes - 1;
+		}
+
+		if (c->i[d] < 0)
+			continue;
+
+		if (!KHI(c->b[d])[c->i[d]] && !KLO(c->b[d])[c->i[d]])
+		{
+			c->i[d]--;
+			continue;
+		}
+
+		c->depth = d + 1;
+		return 1;
+	}
+}
+
+static int cursor_inside(const tree_cursor *c)
+{
+	const branch *b = c->b[c->depth-1];
+	int i = c->i[c->depth-1];
+
+	if (key_compare(b, i, &c->from) < 0)
+		return 0;
+
+	if (c->has_to && (key_compare(b, i, &c->to) >= 0))
+		return 0;
+
+	return 1;
+}
+
+// Descend to the first key not less than (or if 'after', greater
+// than) the given one.
+
+static int cursor_seek(tree_cursor *c, const uuid *k, int after)
+{
+	branch *b = c->tptr->last->active;
+	int d = 0;
+
+	while (!b->leaf && b->nodes && (d < (TREE_MAXDEPTH-1)))
+	{
+		int i = branch_child(b, k);
+		c->b[d] = b;
+		c->i[d++] = i < 0 ? 0 : i;
+		b = VAL(b)[i < 0 ? 0 : i].b;
+	}
+
+	int i = b->leaf ? lower_bound(b, k) : 0;
+
+	if (after && (i < b->nodes) && !key_compare(b, i, k))
+		i++;
+
+	c->b[d] = b;
+	c->i[d] = i;
+	c->depth = d + 1;
+	c->started = 1;
+	return cursor_fwd(c);
+}
+
+static int cursor_seek_last(tree_cursor *c)
+{
+	branch *b = c->tptr->last->active;
+	c->b[0] = b;
+	c->i[0] = (int)b->nodes - 1;
+	c->depth = 1;
+	c->started = 1;
+	return cursor_back(c);
+}
+
+int tree_seek(tree_cursor *c, const uuid *k)
+{
+	if (!c || !k)
+		return 0;
+
+	if (uuid_compare(k, &c->from) < 0)
+		k = &c->from;
+
+	return c->valid = cursor_seek(c, k, 0) && cursor_inside(c);
+}
+
+int tree_seek_after(tree_cursor *c, const uuid *k)
+{
+	if (!c || !k)
+		return 0;
+
+	if (uuid_compare(k, &c->from) < 0)
+		return tree_seek(c, &c->from);
+
+	return c->valid = cursor_seek(c, k, 1) && cursor_inside(c);
+}
+
+int tree_next(tree_cursor *c)
+{
+	if (!c)
+		return 0;
+
+	if (!c->started || !c->valid)
+		return c->valid = cursor_seek(c, &c->from, 0) && cursor_inside(c);
+
+	c->i[c->depth-1]++;
+	return c->valid = cursor_fwd(c) && cursor_inside(c);
+}
+
+int tree_prev(tree_cursor *c)
+{
+	if (!c)
+		return 0;
+
+	if (!c->started || !c->valid)
+	{
+		// The last key before the end...
+
+		if (c->has_to && cursor_seek(c, &c->to, 0))
+			c->i[c->depth-1]--;
+		else if (!cursor_seek_last(c))
+			return c->valid = 0;
+
+		return c->valid = cursor_back(c) && cursor_inside(c);
+	}
+
+	c->i[c->depth-1]--;
+	return c->valid = cursor_back(c) && cursor_inside(c);
+}
+
+int tree_cursor_get(const tree_cursor *c, uuid *k, unsigned long long *v)
+{
+	if (!c || !c->valid)
+		return 0;
+
+	const branch *b = c->b[c->depth-1];
+	int i = c->i[c->depth-1];
+
+	if (k)
+		*k = key_get(b, i);
+
+	if (v)
+		*v = VAL(b)[i].v;
+
+	return 1;
+}
+
+void tree_cursor_close(tree_cursor *c)
+{
+	free(c);
+}
+
 int tree_stats(const tree *tptr, size_t *trunks, size_t *branches, size_t *leafs)
 {
 	if (!tptr)
@@ -501,6 +1200,16 @@ int tree_stats(const tree *tptr, size_t *trunks, size_t *branches, size_t *leafs
 	return 1;
 }
 
+int tree_stats2(const tree *tptr, size_t *trunks, size_t *branches, size_t *leafs, size_t *slots, size_t *bytes)
+{
+	if (!tree_stats(tptr, trunks, branches, leafs))
+		return 0;
+
+	*slots = tptr->slots;
+	*bytes = tptr->bytes;
+	return 1;
+}
+
 static void branch_close(branch *b)
 {
 	int i;
@@ -510,7 +1219,7 @@ static void branch_close(branch *b)
 		if (b->leaf)
 			continue;
 
-		branch_close(b->n[i].b);
+		branch_close(VAL(b)[i].b);
 	}
 
 	free(b);
@@ -7,15 +7,58 @@ typedef struct tree_ tree;
 
 extern tree *tree_create(void);
 
+// Returns 0 if the key is already present (see tree_set).
+
 extern int tree_add(tree *tptr, const uuid *key, unsigned long long value);
 extern int tree_get(const tree *tptr, const uuid *key, unsigned long long *value);
 extern int tree_set(const tree *tptr, const uuid *key, unsigned long long value);
 extern int tree_del(tree *tptr, const uuid *key);
 
+// As tree_add, but only for a key beyond any added so far, which is
+// then appended without searching. Returns 0 for any other key.
+
+extern int tree_append(tree *tptr, const uuid *key, unsigned long long value);
+
 extern size_t tree_count(const tree *tptr);
 extern int tree_stats(const tree *tptr, size_t *trunks, size_t *branches, size_t *leafs);
+
+// As tree_stats, plus the room for keys in leaf branches (so the fill
+// factor is leafs/slots) and the bytes held by all branches.
+
+extern int tree_stats2(const tree *tptr, size_t *trunks, size_t *branches, size_t *leafs, size_t *slots, size_t *bytes);
+
+// Deletes already merge and shrink sparse branches as they go. This
+// packs them as tightly as they will go, returning the bytes freed.
+
+extern size_t tree_compact(tree *tptr);
 extern size_t tree_iter(const tree *tptr, void *h, int (*)(void*,const uuid*,unsigned long long*));
 
+// As tree_iter, in key order, but only for keys from 'from' up to
+// (and not including) 'to'. Either may be NULL for no bound. Only
+// the branches in range are visited.
+
+extern size_t tree_range(const tree *tptr, const uuid *from, const uuid *to, void *h, int (*)(void*,const uuid*,unsigned long long*));
+
+// A cursor over keys from 'from' up to (and not including) 'to',
+// either NULL for no bound. It starts before the first (for next)
+// and after the last (for prev). Seeks go to the first key not less
+// than (or with seek_after, greater than) the one given. Each step
+// is from where it is, not from the top. Returns 0 at either end,
+// after which (or a failed seek) next and prev start over.
+//
+// Only good as long as nothing is added or deleted (tree_set is
+// fine) while it is open.
+
+typedef struct tree_cursor_ tree_cursor;
+
+extern tree_cursor *tree_cursor_open(const tree *tptr, const uuid *from, const uuid *to);
+extern int tree_seek(tree_cursor *c, const uuid *key);
+extern int tree_seek_after(tree_cursor *c, const uuid *key);
+extern int tree_next(tree_cursor *c);
+extern int tree_prev(tree_cursor *c);
+extern int tree_cursor_get(const tree_cursor *c, uuid *key, unsigned long long *value);
+extern void tree_cursor_close(tree_cursor *c);
+
 extern void tree_destroy(tree *tptr);
 
 #endif